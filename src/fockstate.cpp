@@ -280,7 +280,7 @@ fockstate fockstate::copy() const {
 std::vector<int> fockstate::to_vect() const {
     std::vector<int> fs_vect(_m);
     for(int i=0;i<_n; i++)
-        fs_vect[_code[i]-65]++;
+        fs_vect[(unsigned char)_code[i]-'A']++;
     return fs_vect;
 }
 
@@ -288,7 +288,7 @@ void fockstate::to_vect(std::vector<int> &fs_vect) const {
     fs_vect.resize(_m);
     std::fill(fs_vect.begin(), fs_vect.end(), 0);
     for(int i=0;i<_n; i++)
-        fs_vect[_code[i]-65]++;
+        fs_vect[(unsigned char)_code[i]-'A']++;
 }
 
 fockstate fockstate::operator+(int c) const {
@@ -306,7 +306,7 @@ fockstate &fockstate::operator++() {
     if (!_code)
         throw std::invalid_argument("cannot make operation on ndef-state");
     int i;
-    for(i=_n-1; i>=0 && _code[i]==_m-1+'A'; i--);
+    for(i=_n-1; i>=0 && (unsigned char)_code[i]==_m-1+'A'; i--);
     if (i<0) {
         if (_owned_data)
             delete [] _code;
@@ -457,7 +457,8 @@ void fockstate::_check_slice(int &start, int &end, int step, int &slice_m, int &
         slice_m++;
     slice_n = 0;
     for(int i=0; i<_n; i++)
-        if (_code[i] >= start+'A' && _code[i] < end+'A' && (step == 1 || (_code[i]-start-'A') % step == 0))
+        if ((unsigned char)_code[i] >= start+'A' && (unsigned char)_code[i] < end+'A' &&
+            (step == 1 || ((unsigned char)_code[i]-start-'A') % step == 0))
             slice_n++;
 }
 
@@ -468,8 +469,9 @@ fockstate fockstate::slice(int start, int end, int step) const {
         return {slice_m, 0};
     char *_new_code = new char[slice_n];
     for(int k=0, i=0; i<_n; i++)
-        if (_code[i] >= start+'A' && _code[i] < end+'A' && (step == 1 || (_code[i]-start-'A') % step == 0)) {
-            _new_code[k++] = (_code[i]-start-'A') / step + 'A';
+        if ((unsigned char)_code[i] >= start+'A' && (unsigned char)_code[i] < end+'A' &&
+            (step == 1 || ((unsigned char)_code[i]-start-'A') % step == 0)) {
+            _new_code[k++] = char(((unsigned char)_code[i]-start-'A') / step + 'A');
         }
     map_m_lannot new_annotation_map;
     for(int j=0, i=start; i<end; i+=step, j++) {
@@ -495,12 +497,12 @@ fockstate fockstate::set_slice(const fockstate &fs, int start, int end) const {
     int k = 0;
     int i = 0; /* iterator on current fockstate */
     // photons on lower mode
-    for(; _code && i < _n && _code[i] < start+'A'; i++)
+    for(; _code && i < _n && (unsigned char)_code[i] < start+'A'; i++)
         _new_code[k++] = _code[i];
     // insert the slice photons
     for(int j=0; j < fs._n; j++)
         _new_code[k++] = fs._code[j]+start;
-    for(;_code && i<_n && _code[i] < end+'A'; i++);
+    for(;_code && i<_n && (unsigned char)_code[i] < end+'A'; i++);
     // add photons on higher modes
     for(;_code && i<_n;i++)
         _new_code[k++] = _code[i];
@@ -592,7 +594,7 @@ std::string fockstate::to_str(bool show_annotations) const {
         std::vector<int> fs_vect(_m);
         std::vector<std::string> annots_vect(_m);
         for (int i = 0; i < _n; i++) {
-            fs_vect[_code[i] - 'A']++;
+            fs_vect[(unsigned char)_code[i]-'A']++;
         }
         if (show_annotations) {
             for (int i = 0; i < _m; i++) {
@@ -628,8 +630,8 @@ int fockstate::operator[](int idx) const {
     if (idx<0 || idx>=_m)
         throw std::out_of_range("invalid mode");
     int nc=0;
-    for(int i=0;i<_n && _code[i]-'A'<=idx; i++)
-        if (_code[i]-'A'==idx) nc++;
+    for(int i=0;i<_n && (unsigned char)_code[i]-'A'<=idx; i++)
+        if ((unsigned char)_code[i]-'A'==idx) nc++;
     return nc;
 }
 
@@ -70,14 +70,14 @@ class fockstate {
         /** photon_idx to mode **/
         inline int photon2mode(int photon_idx) const {
             if (photon_idx < 0 || photon_idx >= _n) throw std::out_of_range("photon index out of range");
-            return _code[photon_idx]-'A';
+            return (unsigned char)_code[photon_idx]-'A';
         }
         /** retrieve first photon idx in given mode - or -1 if none **/
         inline int mode2photon(int mode_idx) const {
             if (mode_idx < 0 || mode_idx >= _m) throw std::out_of_range("mode index out of range");
             int k=0;
-            for(; k < _n && _code[k]-'A' < mode_idx; k++);
-            if (k == _n || _code[k]-'A' != mode_idx) return -1;
+            for(; k < _n && (unsigned char)_code[k]-'A' < mode_idx; k++);
+            if (k == _n || (unsigned char)_code[k]-'A' != mode_idx) return -1;
             return k;
         }
 
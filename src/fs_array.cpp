@@ -20,13 +20,20 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <memory>
 #include <unordered_map>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #include "fs_array.h"
+#include "parallel_tools.h"
 
 #define DEFAULT_FILENAME "layer-m%d-n%d.fsa"
 #define BUFFER_LENGTH 30
@@ -35,12 +42,9 @@ const unsigned long long fs_npos = 0xffffffff;
 
 void fs_array::_count_fs() {
     if (_p_mask) {
-        fockstate fs(_m, _n);
-        _count = 0;
-        while(true) {
-            if (_p_mask->match(fs)) _count++;
-            if (!(++fs)._code) break;
-        }
+        _count = _p_mask->enumerate(_n);
+    } else if (!_caps.empty()) {
+        _count = _cap_states(0, _n);
     } else {
         _count = 1;
         for (int nk = 1; nk <= _n; nk++) {
@@ -49,22 +53,257 @@ void fs_array::_count_fs() {
     }
 }
 
-fs_array::fs_array(int m, int n): _buffer(nullptr), _m(m), _n(n), _count(0), _p_mask(nullptr) {
+fs_array::fs_array(int m, int n): _buffer(nullptr), _generated(false), _m(m), _n(n), _count(0), _p_mask(nullptr),
+                                  _no_bunching(n <= 1) {
+    _count_fs();
+    _build_rank_table();
+}
+
+fs_array::fs_array(int m, int n, bool no_bunching): fs_array(m, n, std::vector<int>(m, no_bunching ? 1 : n)) {
+}
+
+fs_array::fs_array(int m, int n, int cap): fs_array(m, n, std::vector<int>(m, cap)) {
+}
+
+fs_array::fs_array(int m, int n, const std::vector<int> &caps): _buffer(nullptr), _generated(false), _m(m), _n(n),
+                                                                _count(0), _p_mask(nullptr), _no_bunching(n <= 1) {
+    if ((int)caps.size() != m)
+        throw std::invalid_argument("photon caps must be given for each mode");
+    bool truncated = false;
+    for(int cap: caps) {
+        if (cap < 0)
+            throw std::invalid_argument("invalid photon cap");
+        truncated |= cap < n;
+    }
+    /* caps of at least n photons do not truncate the fock space */
+    if (truncated) {
+        _caps = caps;
+        _no_bunching = _no_bunching || *std::max_element(caps.begin(), caps.end()) <= 1;
+    }
+    _build_rank_table();
     _count_fs();
 }
 
 fs_array::fs_array(int m, int n, const fs_mask &mask): _buffer(nullptr),
+                                                       _generated(false),
                                                        _m(m),
                                                        _n(n),
                                                        _count(0),
-                                                       _p_mask(new fs_mask(mask)) {
+                                                       _p_mask(new fs_mask(mask)),
+                                                       _no_bunching(false) {
     _count_fs();
 }
 
+void fs_array::_build_rank_table() {
+    if (!_caps.empty()) {
+        /* F(u, r) = sum of F(u+1, r-k) for k <= cap(u) photons in mode u - with P(u+1, .) the prefix sums of
+         * F(u+1, .), F(u, r) = P(u+1, r) - P(u+1, r-cap(u)-1) */
+        _cap_table.assign((_m+1)*(_n+1), 0);
+        _cap_prefix.assign((_m+1)*(_n+1), 1);
+        _cap_table[_m*(_n+1)] = 1;
+        for(int u=_m-1; u>=0; u--) {
+            int cap = std::min(_caps[u], _n);
+            unsigned long long sum = 0;
+            for(int r=0; r<=_n; r++) {
+                sum += _cap_table[u*(_n+1)+r] = _cap_sum(u+1, r) - _cap_sum(u+1, r-cap-1);
+                _cap_prefix[u*(_n+1)+r] = sum;
+            }
+        }
+        return;
+    }
+    /* C(m-u+r-1, r): number of r-photon completions with all photons in modes [u, m) */
+    _rank_table.assign((_n+1)*(_m+1), 0);
+    for(int r=0; r<=_n; r++) {
+        unsigned long long sum = 0;
+        for(int u=0; u<_m; u++) {
+            unsigned long long c = 1;
+            for(int k=1; k<=r; k++)
+                c = c * (_m-u+k-1) / k;
+            _rank_table[r*(_m+1)+u] = sum;
+            sum += c;
+        }
+        _rank_table[r*(_m+1)+_m] = sum;
+    }
+}
+
+unsigned long long fs_array::rank(const char *code) const {
+    if (_p_mask)
+        throw std::logic_error("rank is not available on masked fs-array");
+    unsigned long long idx = 0;
+    if (!_caps.empty()) {
+        /* the states before a state with occupancy o in mode c and R photons in modes [c, m) are, for the same
+         * occupancies of the previous modes, the states with more than o photons in mode c - the empty modes before c
+         * telescope, so that the rank is a sum over the occupied modes only */
+        int r = _n, u = 0;
+        for(int i=0; i<_n;) {
+            int c = (unsigned char)code[i]-'A', o = 1;
+            while (i+o < _n && code[i+o] == code[i])
+                o++;
+            if (c < u || o > _caps[c])
+                return fs_npos;
+            idx += _cap_states(u, r) - _cap_sum(c+1, r) + _cap_sum(c+1, r-o-1);
+            r -= o;
+            u = c+1;
+            i += o;
+        }
+        return idx;
+    }
+    int prev = 0;
+    for(int i=0; i<_n; i++) {
+        int c = (unsigned char)code[i]-'A';
+        idx += _rank_offset(_n-1-i, c) - _rank_offset(_n-1-i, prev);
+        prev = c;
+    }
+    return idx;
+}
+
+void fs_array::unrank(unsigned long long idx, char *code) const {
+    if (_p_mask)
+        throw std::logic_error("unrank is not available on masked fs-array");
+    if (!_caps.empty()) {
+        int r = _n;
+        for(int u=0; u<_m && r; u++) {
+            /* states with photons in mode u come first, by decreasing occupancy */
+            unsigned long long occupied = _cap_states(u, r) - _cap_states(u+1, r);
+            if (idx >= occupied) {
+                idx -= occupied;
+                continue;
+            }
+            int o = std::min(_caps[u], r);
+            while (idx >= _cap_states(u+1, r-o))
+                idx -= _cap_states(u+1, r-o--);
+            for(; o; o--, r--)
+                *code++ = char('A'+u);
+        }
+        return;
+    }
+    int v = 0;
+    for(int i=0; i<_n; i++) {
+        int r = _n-1-i;
+        /* skip the blocks of states starting with modes lower than the current photon mode */
+        while (v < _m-1 && idx >= _rank_offset(r, v+1) - _rank_offset(r, v)) {
+            idx -= _rank_offset(r, v+1) - _rank_offset(r, v);
+            v++;
+        }
+        code[i] = char('A'+v);
+    }
+}
+
+/* number of set bits */
+static inline int popcount64(unsigned long long bits) {
+#ifdef _MSC_VER
+    return (int)__popcnt64(bits);
+#else
+    return __builtin_popcountll(bits);
+#endif
+}
+
+/* index of the lowest set bit - bits must not be 0 */
+static inline int lowest_bit64(unsigned long long bits) {
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward64(&idx, bits);
+    return (int)idx;
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+void fs_array::_check_bits() const {
+    if (!_no_bunching || _p_mask || _m > 64)
+        throw std::logic_error("bitset states are only available on no-bunching fs-array of at most 64 modes");
+}
+
+unsigned long long fs_array::rank_bits(unsigned long long bits) const {
+    _check_bits();
+    if (popcount64(bits) != _n)
+        return fs_npos;
+    char code[64];
+    for(int i=0; bits; i++, bits &= bits-1)
+        code[i] = char('A'+lowest_bit64(bits));
+    return rank(code);
+}
+
+unsigned long long fs_array::unrank_bits(unsigned long long idx) const {
+    _check_bits();
+    char code[64];
+    unrank(idx, code);
+    unsigned long long bits = 0;
+    for(int i=0; i<_n; i++)
+        bits |= 1ULL << ((unsigned char)code[i]-'A');
+    return bits;
+}
+
+void fs_array::_fill_state(char *code, int r, int v) const {
+    /* smallest completion: the photons fill each mode up to its cap */
+    for(int k=0, o=0; k<r; k++, o++) {
+        for(; o == _caps[v]; o=0)
+            v++;
+        code[k] = char('A'+v);
+    }
+}
+
+bool fs_array::next_state(char *code) const {
+    if (_caps.empty())
+        return next_code(code, _m, _n);
+    /* the last photon that can move to a following mode is moved to the first mode open after its own - if the
+     * remaining photons fit in the modes from there, they are packed behind it */
+    for(int i=_n-1; i>=0; i--) {
+        int v = (unsigned char)code[i]-'A'+1;
+        while (v < _m && !_caps[v])
+            v++;
+        if (v < _m && _cap_states(v, _n-i)) {
+            _fill_state(code+i, _n-i, v);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool fs_array::next_code(char *code, int m, int n) {
+    int i;
+    for(i=n-1; i>=0 && (unsigned char)code[i]==m-1+'A'; i--);
+    if (i<0)
+        return false;
+    code[i] += 1;
+    for(int j=i+1; j<n; j++)
+        code[j] = code[i];
+    return true;
+}
+
 const unsigned char fs_array::version = 2;
 
+fs_array::fs_array(fs_array &&fsa) noexcept: _buffer(nullptr), _generated(false), _m(0), _n(0), _count(0),
+                                              _p_mask(nullptr), _no_bunching(false) {
+    *this = std::move(fsa);
+}
+
+fs_array &fs_array::operator=(fs_array &&fsa) noexcept {
+    if (this == &fsa)
+        return *this;
+    delete [] _buffer;
+    delete _p_mask;
+    _buffer = fsa._buffer;
+    _generated.store(fsa._generated.load(std::memory_order_acquire), std::memory_order_release);
+    _m = fsa._m;
+    _n = fsa._n;
+    _count = fsa._count;
+    _p_mask = fsa._p_mask;
+    _no_bunching = fsa._no_bunching;
+    _caps = std::move(fsa._caps);
+    _rank_table = std::move(fsa._rank_table);
+    _cap_table = std::move(fsa._cap_table);
+    _cap_prefix = std::move(fsa._cap_prefix);
+    fsa._buffer = nullptr;
+    fsa._generated.store(false, std::memory_order_release);
+    fsa._count = 0;
+    fsa._p_mask = nullptr;
+    return *this;
+}
+
 fs_array::~fs_array() {
     delete [] _buffer;
+    delete _p_mask;
 }
 
 unsigned long long fs_array::count() const {
@@ -76,19 +315,19 @@ unsigned long long fs_array::size() const {
 }
 
 void fs_array::generate() const {
-    if (_buffer)
+    if (_generated.load(std::memory_order_acquire))
         return;
-    _buffer = new char[size()==0?1:size()];
-    fockstate fs(_m, _n);
-    unsigned long long idx=0;
-    while(true) {
-        int i;
-        if (!_p_mask || _p_mask->match(fs)) {
-            for(i=0;i<_n;i++) _buffer[i+idx] = fs._code[i];
-            idx += _n;
-        }
-        if (!(++fs)._code) break;
+    std::lock_guard<std::mutex> lock(_generate_mutex);
+    if (_generated.load(std::memory_order_relaxed))
+        return;
+    char *buffer = new char[size()==0?1:size()];
+    if (_p_mask) {
+        _p_mask->enumerate(_n, buffer);
+    } else {
+        fs_enumerator(*this).next_block(buffer, _count);
     }
+    _buffer = buffer;
+    _generated.store(true, std::memory_order_release);
 }
 
 fs_array::const_iterator fs_array::find(const fockstate &fs) const {
@@ -110,8 +349,13 @@ unsigned long long fs_array::find_idx(const fockstate &fs) const {
     }
     if (fs.get_n() != _n)
         return fs_npos;
+    return _find_code(fs._code);
+}
+
+unsigned long long fs_array::_find_code(const char *code) const {
+    if (!_count)
+        return fs_npos;
     // binary search -> O(log_2 _count)
-    char *code = fs._code;
     unsigned long long begin_range = 0;
     unsigned long long end_range = _count;
     unsigned long long middle;
@@ -130,6 +374,41 @@ unsigned long long fs_array::find_idx(const fockstate &fs) const {
     return fs_npos;
 }
 
+void fs_array::index_map(const fs_array &target, unsigned long long *p_indexes, int n_threads) const {
+    if (target._m != _m || target._n != _n)
+        throw std::invalid_argument("fs-arrays do not have the same fock space");
+    generate();
+    if (!target.is_masked()) {
+        parallel_ranges(_count, n_threads, [&](unsigned long long from, unsigned long long to) {
+            const char *code = _buffer+from*_n;
+            for(unsigned long long i=from; i<to; i++, code+=_n)
+                p_indexes[i] = target.rank(code);
+        });
+        return;
+    }
+    target.generate();
+    const char *target_codes = target._buffer;
+    unsigned long long target_count = target._count;
+    int n = _n;
+    /* each range of states starts its merge at the first target code not lower than its first code */
+    parallel_ranges(_count, n_threads, [&, n](unsigned long long from, unsigned long long to) {
+        const char *code = _buffer+from*n;
+        unsigned long long begin = 0, end = target_count;
+        while (begin < end) {
+            unsigned long long middle = (begin+end)>>1;
+            if (strncmp(target_codes+middle*n, code, n) < 0) begin = middle+1;
+            else end = middle;
+        }
+        unsigned long long j = begin;
+        for(unsigned long long i=from; i<to; i++, code+=n) {
+            int comparator = -1;
+            while (j < target_count && (comparator = strncmp(target_codes+j*n, code, n)) < 0)
+                j++;
+            p_indexes[i] = j < target_count && comparator == 0 ? j : fs_npos;
+        }
+    });
+}
+
 fockstate fs_array::operator[](unsigned long long idx) const {
     if (idx>=_count)
         throw std::out_of_range("index too large");
@@ -137,89 +416,93 @@ fockstate fs_array::operator[](unsigned long long idx) const {
     return {_m, _n, _buffer+idx*_n};
 }
 
-fs_array::const_iterator::const_iterator(const fs_array *fsa, bool first):_fsa(fsa),_pfs(nullptr) {
+/* number of states of the blocks enumerated by the iterators of non-generated fs-arrays */
+#define ITERATOR_BLOCK 256
+
+fs_array::const_iterator::const_iterator(const fs_array *fsa, bool first):_fsa(fsa), _p_enum(nullptr), _block_pos(0),
+                                                                          _block_count(0) {
     if (first)
         idx = 0;
     else
         idx = fsa->_count;
-    /* if fsa is not generated - just go through the different states */
-    if (!fsa->_buffer) {
-        _pfs = new fockstate(fsa->_m, fsa->_n);
-        _find_next();
+    /* if fsa is not generated - the states are enumerated by blocks */
+    if (first && !fsa->is_generated() && fsa->_count) {
+        _p_enum = new fs_enumerator(*fsa);
+        _next_block();
     }
 }
 
 fs_array::const_iterator::const_iterator(const fs_array *fsa, unsigned long long f_idx):_fsa(fsa),
-                                                                                        _pfs(nullptr),
+                                                                                        _p_enum(nullptr),
+                                                                                        _block_pos(0),
+                                                                                        _block_count(0),
                                                                                         idx(f_idx) {
-    if (!fsa->_buffer) {
-        _pfs = new fockstate(fsa->_m, fsa->_n);
-        _find_next();
-        while(f_idx && _pfs->_code) {
-            ++(*_pfs);
-            _find_next();
-            --f_idx;
-        }
+    if (!fsa->is_generated() && f_idx < fsa->_count) {
+        _p_enum = new fs_enumerator(*fsa, f_idx);
+        _next_block();
     }
 }
 
-fs_array::const_iterator::const_iterator(const_iterator &it):_fsa(it._fsa), idx(it.idx) {
-    if (it._pfs)
-        _pfs = new fockstate(*it._pfs);
-    else
-        _pfs = nullptr;
+fs_array::const_iterator::const_iterator(const_iterator &it):_fsa(it._fsa), _block(it._block),
+                                                             _block_pos(it._block_pos), _block_count(it._block_count),
+                                                             idx(it.idx) {
+    _p_enum = it._p_enum ? new fs_enumerator(*it._p_enum) : nullptr;
 }
 
-fs_array::const_iterator::const_iterator(const_iterator &&it) noexcept :_fsa(it._fsa), idx(it.idx) {
-    _pfs = it._pfs;
-    it._pfs = nullptr;
+fs_array::const_iterator::const_iterator(const_iterator &&it) noexcept :_fsa(it._fsa), _block(std::move(it._block)),
+                                                                        _block_pos(it._block_pos),
+                                                                        _block_count(it._block_count), idx(it.idx) {
+    _p_enum = it._p_enum;
+    it._p_enum = nullptr;
 }
 
 fs_array::const_iterator &fs_array::const_iterator::operator=(fs_array::const_iterator const&it) {
     if (&it == this)
         return *this;
     _fsa = it._fsa;
-    delete _pfs;
-    if (it._pfs)
-        _pfs = new fockstate(*it._pfs);
-    else
-        _pfs = nullptr;
+    delete _p_enum;
+    _p_enum = it._p_enum ? new fs_enumerator(*it._p_enum) : nullptr;
+    _block = it._block;
+    _block_pos = it._block_pos;
+    _block_count = it._block_count;
     idx = it.idx;
     return *this;
 }
 
 fs_array::const_iterator &fs_array::const_iterator::operator=(fs_array::const_iterator &&it) noexcept {
     _fsa = it._fsa;
-    delete _pfs;
-    _pfs = it._pfs;
-    it._pfs = nullptr;
+    delete _p_enum;
+    _p_enum = it._p_enum;
+    it._p_enum = nullptr;
+    _block = std::move(it._block);
+    _block_pos = it._block_pos;
+    _block_count = it._block_count;
     idx = it.idx;
     return *this;
 }
 
 fs_array::const_iterator::~const_iterator() {
-    delete _pfs;
+    delete _p_enum;
 }
 
-void fs_array::const_iterator::_find_next() {
-    if (_pfs) {
-        while(_pfs->_code && _fsa->_p_mask && !_fsa->_p_mask->match(*_pfs)) {
-            ++(*_pfs);
-        }
-    }
+void fs_array::const_iterator::_next_block() {
+    _block.resize(ITERATOR_BLOCK*_fsa->_n+1);
+    _block_count = _p_enum->next_block(_block.data(), ITERATOR_BLOCK);
+    _block_pos = 0;
 }
 
 fs_array::const_iterator::self_type &fs_array::const_iterator::operator++() {
     if (idx<_fsa->_count) {
         ++idx;
-        if (_pfs) { ++(*_pfs); _find_next(); }
+        if (_p_enum && idx<_fsa->_count && ++_block_pos == _block_count)
+            _next_block();
     }
     return *this;
 }
 
 fockstate fs_array::const_iterator::operator*() {
-    if (_pfs)
-        return _pfs->copy();
+    if (_p_enum)
+        return {_fsa->_m, _fsa->_n, _block.data()+_block_pos*_fsa->_n, false};
     return {_fsa->_m, _fsa->_n, _fsa->_buffer+idx*_fsa->_n, false};
 }
 
@@ -231,25 +514,189 @@ bool fs_array::const_iterator::operator!=(const fs_array::const_iterator::self_t
     return this->idx != rhs.idx || this->_fsa != rhs._fsa;
 }
 
-void fs_array::norm_coefs(std::complex<double> *p_coefs) const {
+/* factorial table up to n - prod n_i! of a state is the product of the table entries of its photon runs */
+static std::vector<double> factorials(int n) {
+    std::vector<double> fact(n+1, 1);
+    for(int k=2; k<=n; k++)
+        fact[k] = fact[k-1]*k;
+    return fact;
+}
+
+void fs_array::norm_coefs(std::complex<double> *p_coefs, int batch) const {
     generate();
+    std::vector<double> sqrt_fact = factorials(_n);
+    for(double &f: sqrt_fact)
+        f = sqrt(f);
     const char *_code = _buffer;
-    std::unordered_map<unsigned long, double> sqrt_o;
     for(unsigned long i=0; i < count(); i++, _code+=_n) {
-        unsigned long p = 1;
+        double coef = 1;
         for(int j=0; j<_n;) {
             int k=1;
             while (j+k<_n && _code[j+k] == _code[j])
-                p *= ++k;
+                k++;
+            coef *= sqrt_fact[k];
             j += k;
         }
-        auto it = sqrt_o.find(p);
-        double coef;
-        if (it == sqrt_o.end()) {
-            coef = sqrt((double) p);
-            sqrt_o[p] = coef;
-        } else
-            coef = it->second;
-        p_coefs[i] *= coef;
+        for(int b=0; b<batch; b++)
+            p_coefs[i*batch+b] *= coef;
+    }
+}
+
+void fs_array::probabilities(const std::complex<double> *p_coefs, double scale, double *p_probabilities,
+                             fs_reductions *p_reductions, int n_threads) const {
+    generate();
+    bool marginals = p_reductions && p_reductions->mode_marginals;
+    bool clicks = p_reductions && p_reductions->click_patterns;
+    size_t n_masks = p_reductions ? p_reductions->masks.size() : 0;
+    if (clicks && _m > 64)
+        throw std::invalid_argument("click patterns are limited to 64 modes");
+    std::vector<double> fact = factorials(_n);
+    int threads = parallel_threads(_count, n_threads);
+    /* per-thread partial reductions, merged at the end */
+    std::vector<std::vector<double>> partial_marginals(threads);
+    std::vector<std::unordered_map<unsigned long long, double>> partial_clicks(threads);
+    std::vector<std::vector<double>> partial_masks(threads, std::vector<double>(n_masks));
+    std::vector<double> partial_totals(threads);
+    parallel_blocks(_count, threads, [&](int t, unsigned long long from, unsigned long long to) {
+        if (marginals)
+            partial_marginals[t].assign(_m*(_n+1), 0);
+        const char *code = _buffer+from*_n;
+        for(unsigned long long i=from; i<to; i++, code+=_n) {
+            double p = 1;
+            unsigned long long pattern = 0;
+            for(int j=0; j<_n;) {
+                int k=1;
+                while (j+k<_n && code[j+k] == code[j])
+                    k++;
+                p *= fact[k];
+                j += k;
+            }
+            double probability = std::norm(p_coefs[i]) * p * scale;
+            if (p_probabilities)
+                p_probabilities[i] = probability;
+            if (!p_reductions)
+                continue;
+            partial_totals[t] += probability;
+            for(int j=0; j<_n;) {
+                int k=1;
+                while (j+k<_n && code[j+k] == code[j])
+                    k++;
+                int mode = (unsigned char)code[j]-'A';
+                if (marginals)
+                    partial_marginals[t][mode*(_n+1)+k] += probability;
+                if (clicks)
+                    pattern |= 1ULL << mode;
+                j += k;
+            }
+            if (clicks)
+                partial_clicks[t][pattern] += probability;
+            for(size_t c=0; c<n_masks; c++)
+                if (p_reductions->masks[c].match_code(code, _n, p_reductions->masks_allow_missing))
+                    partial_masks[t][c] += probability;
+        }
+    });
+    if (!p_reductions)
+        return;
+    double total = 0;
+    for(double partial: partial_totals)
+        total += partial;
+    p_reductions->total = total;
+    p_reductions->marginals.clear();
+    if (marginals) {
+        p_reductions->marginals.assign(_m*(_n+1), 0);
+        for(auto &partial: partial_marginals)
+            for(size_t c=0; c<partial.size(); c++)
+                p_reductions->marginals[c] += partial[c];
+        /* empty modes are the complement of the occupied ones */
+        for(int j=0; j<_m; j++) {
+            double occupied = 0;
+            for(int c=1; c<=_n; c++)
+                occupied += p_reductions->marginals[j*(_n+1)+c];
+            p_reductions->marginals[j*(_n+1)] = total-occupied;
+        }
+    }
+    p_reductions->clicks.clear();
+    for(auto &partial: partial_clicks)
+        for(auto &c: partial)
+            p_reductions->clicks[c.first] += c.second;
+    p_reductions->mask_totals.assign(n_masks, 0);
+    for(auto &partial: partial_masks)
+        for(size_t c=0; c<n_masks; c++)
+            p_reductions->mask_totals[c] += partial[c];
+}
+
+fs_enumerator::fs_enumerator(int m, int n): _p_fsa(nullptr), _m(m), _n(n), _done(n > 0 && m <= 0), _code(n, 'A') {
+}
+
+fs_enumerator::fs_enumerator(const fs_array &fsa, unsigned long long from): _p_fsa(&fsa), _m(fsa.get_m()),
+                                                                             _n(fsa.get_n()), _done(false),
+                                                                             _code(fsa.get_n(), 'A') {
+    if (from >= fsa.count()) {
+        _done = true;
+    } else if (!fsa.is_masked()) {
+        fsa.unrank(from, _code.data());
+    } else if (fsa.is_generated()) {
+        memcpy(_code.data(), fsa._buffer+from*_n, _n);
+    } else {
+        /* masked states before from are enumerated and dropped */
+        std::vector<char> skipped(ITERATOR_BLOCK*_n+1);
+        for(; from; from -= next_block(skipped.data(), std::min(from, (unsigned long long)ITERATOR_BLOCK)));
+    }
+}
+
+size_t fs_enumerator::_next_full_block(char *out, size_t k) {
+    if (_done || !k)
+        return 0;
+    if (!_n) {
+        _done = true;
+        return 1;
+    }
+    size_t written = 0;
+    unsigned char last_mode = (unsigned char)('A'+_m-1);
+    while (written < k && !_done) {
+        /* run of the states sharing their n-1 first photons: the last photon goes through the following modes */
+        unsigned char last = _code[_n-1];
+        size_t run = std::min((size_t)(last_mode-last+1), k-written);
+        for(size_t t=0; t<run; t++, out+=_n) {
+            memcpy(out, _code.data(), _n-1);
+            out[_n-1] = char(last+t);
+        }
+        written += run;
+        _code[_n-1] = char(last+run-1);
+        /* the carry is only resolved at the end of a run */
+        if ((unsigned char)_code[_n-1] == last_mode)
+            _done = !fs_array::next_code(_code.data(), _m, _n);
+        else
+            _code[_n-1]++;
+    }
+    return written;
+}
+
+size_t fs_enumerator::next_block(char *out, size_t k) {
+    if (!_p_fsa || _p_fsa->is_full())
+        return _next_full_block(out, k);
+    size_t written = 0;
+    if (!_p_fsa->is_masked()) {
+        /* truncated fock space: direct successors */
+        for(; written < k && !_done; written++, out+=_n) {
+            memcpy(out, _code.data(), _n);
+            _done = !_p_fsa->next_state(_code.data());
+        }
+        return written;
+    }
+    /* masked fock space: blocks of the full fock space are matched at once, and the matching states compacted */
+    size_t chunk_size = std::min(k, (size_t)ITERATOR_BLOCK);
+    std::vector<char> chunk(chunk_size*_n+1);
+    std::unique_ptr<bool[]> matches(new bool[chunk_size]);
+    while (written < k && !_done) {
+        size_t count = _next_full_block(chunk.data(), std::min(chunk_size, k-written));
+        _p_fsa->_p_mask->match_many(chunk.data(), count, _n, matches.get());
+        for(size_t i=0; i<count; i++)
+            if (matches[i]) {
+                memcpy(out, chunk.data()+i*_n, _n);
+                out += _n;
+                written++;
+            }
     }
+    return written;
 }
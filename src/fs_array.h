@@ -23,31 +23,92 @@
 #ifndef FS_ARRAY_H
 #define FS_ARRAY_H
 
+#include <atomic>
 #include <cstring>
 #include <complex>
+#include <map>
+#include <mutex>
+#include <vector>
 
 #include "fockstate.h"
 #include "fs_mask.h"
 #include "memory_tools.h"
 
 class fs_map;
+class fs_enumerator;
 
 extern const unsigned long long fs_npos;
 
+/**
+ * reductions of the output probabilities accumulated by `fs_array::probabilities` in the same pass
+ */
+struct fs_reductions {
+    /** if true, fills `marginals`: `marginals[j*(n+1)+c]` is the probability of having c photons in mode j */
+    bool mode_marginals;
+    /** if true, fills `clicks`: probability of each threshold detector pattern, bit j being set if mode j is
+     * occupied - only for m <= 64 */
+    bool click_patterns;
+    /** fills `mask_totals`: total probability of the states matching each mask */
+    std::vector<fs_mask> masks;
+    /** if true, states with less photons than a mask match it when they can still be completed - otherwise their
+     * occupancies must match the mask as they are */
+    bool masks_allow_missing;
+    std::vector<double> marginals;
+    std::map<unsigned long long, double> clicks;
+    std::vector<double> mask_totals;
+    /** total probability of the states */
+    double total;
+    fs_reductions(): mode_marginals(false), click_patterns(false), masks_allow_missing(true), total(0) {}
+};
+
 class fs_array {
     /* fs_array are ordered vector of all possible fock states for given m, n */
     friend class fs_map;
+    friend class fs_enumerator;
     public:
         static const unsigned char version;
         fs_array(int m, int n);
         fs_array(int m, int n, const fs_mask &mask);
+        /**
+         * fs-array of a (m,n) fock space restricted to the collision-free states - at most one photon per mode: the
+         * C(m, n) states are subsets of modes
+         * @param no_bunching if false, the fs-array holds the full fock space
+         */
+        fs_array(int m, int n, bool no_bunching);
+        /**
+         * fs-array of a (m,n) fock space truncated to at most `cap` photons per mode - the states are counted, ranked
+         * and enumerated from the number of states of each suffix of modes, without going through the bunched states
+         * @param cap maximal number of photons in each mode
+         */
+        fs_array(int m, int n, int cap);
+        /**
+         * fs-array of a (m,n) fock space truncated to a per-mode photon cap
+         * @param caps maximal number of photons of each mode
+         * @throws std::invalid_argument if caps does not have m non-negative values
+         */
+        fs_array(int m, int n, const std::vector<int> &caps);
+        /**
+         * move the states and the mask of another fs-array - that must not be in use by other threads
+         */
+        fs_array(fs_array &&fsa) noexcept;
+        fs_array &operator=(fs_array &&fsa) noexcept;
         ~fs_array();
         unsigned long long count() const;
         unsigned long long size() const;
         inline int get_m() const { return this->_m; }
         inline int get_n() const { return this->_n; }
+        /**
+         * generate the states in memory - only the first call generates them, and concurrent calls wait for it to
+         * complete: once generated, the const API can be used concurrently
+         */
         void generate() const;
+        inline bool is_generated() const { return _generated.load(std::memory_order_acquire); }
         fockstate operator[](unsigned long long) const;
+        /**
+         * iterator through the states - on a fs-array that is not generated, the states are enumerated by blocks and
+         * dereferencing returns a view on the current block, valid until the iterator moves to the next block: copy
+         * the state to keep it
+         */
         class const_iterator
         {
             public:
@@ -64,9 +125,12 @@ class fs_array {
                 bool operator==(const self_type& rhs) const;
                 bool operator!=(const self_type& rhs) const;
             private:
-                void _find_next();
+                void _next_block();
                 const fs_array *_fsa;
-                fockstate *_pfs;
+                fs_enumerator *_p_enum;
+                std::vector<char> _block;
+                size_t _block_pos;
+                size_t _block_count;
             public:
                 unsigned long long idx;
         };
@@ -82,16 +146,149 @@ class fs_array {
          * @return the idx of the fockstate or npos if not found
          */
         unsigned long long find_idx(const fockstate &fs_vec) const;
+        /**
+         * rank of a state code in the unmasked fock space - computed in O(n) from combinatorial tables, without
+         * generating the array
+         * @param code the state code (n sorted mode characters)
+         * @return the index of the state, npos if the state is not in a restricted fock space
+         * @throws std::logic_error if the array is masked
+         */
+        unsigned long long rank(const char *code) const;
+        /**
+         * inverse of rank - computed in O(n+m)
+         * @param idx the index of the state
+         * @param code filled with the n characters of the state code
+         * @throws std::logic_error if the array is masked
+         */
+        void unrank(unsigned long long idx, char *code) const;
+        /**
+         * index translation table towards another fs-array of the same fock space - typically a masked fs-array and
+         * its unmasked parent, or two differently masked fs-arrays - so that coefficients are moved from one array to
+         * the other by a single gather. Built by ranking if the target is unmasked, otherwise by a parallel merge
+         * of the sorted state codes
+         * @param target the target fs-array
+         * @param p_indexes output buffer of `count()` indexes: index in target of each state, npos if it is not in
+         * target
+         * @param n_threads number of threads, 0 to use all the available cores
+         * @throws std::invalid_argument if the fs-arrays do not have the same m and n
+         */
+        void index_map(const fs_array &target, unsigned long long *p_indexes, int n_threads=0) const;
+        /**
+         * rank of a collision-free state given as a bitset of its occupied modes
+         * @throws std::logic_error if the array is not a no-bunching array of at most 64 modes
+         */
+        unsigned long long rank_bits(unsigned long long bits) const;
+        /**
+         * inverse of rank_bits
+         */
+        unsigned long long unrank_bits(unsigned long long idx) const;
+        /**
+         * replace a code by the next state code in lexicographic order
+         * @return false if code was the last state
+         */
+        static bool next_code(char *code, int m, int n);
+        /**
+         * replace a code by the next state code of the (unmasked) fs-array in lexicographic order
+         * @return false if code was the last state
+         */
+        bool next_state(char *code) const;
+        inline bool is_masked() const { return _p_mask != nullptr; }
+        /**
+         * true if no state of the fs-array has several photons in a mode
+         */
+        inline bool is_no_bunching() const { return _no_bunching; }
+        /**
+         * per-mode photon caps, empty if the fock space is not truncated
+         */
+        inline const std::vector<int> &get_caps() const { return _caps; }
+        /**
+         * true if the fs-array holds the full (m,n) fock space - neither masked nor truncated
+         */
+        inline bool is_full() const { return !_p_mask && _caps.empty(); }
         const_iterator begin() const { return {this, true}; }
         const_iterator end() const { return {this, false}; }
-        void norm_coefs(std::complex<double> *p_coefs) const;
+        /**
+         * multiply each coefficient by sqrt(prod n_i!) of the corresponding state
+         * @param p_coefs the coefficients
+         * @param batch number of consecutive coefficients per state
+         */
+        void norm_coefs(std::complex<double> *p_coefs, int batch=1) const;
+        /**
+         * fused output stage: computes the probabilities |c|^2.prod n_i!.scale of the states from their coefficients,
+         * and accumulates the requested reductions in the same pass - disjoint ranges of states are processed in
+         * parallel
+         * @param p_coefs the `count()` coefficients
+         * @param scale global factor of the probabilities
+         * @param p_probabilities output buffer of the `count()` probabilities, or nullptr if only reductions are needed
+         * @param p_reductions the reductions to compute, or nullptr
+         * @param n_threads number of threads, 0 to use all the available cores
+         * @throws std::invalid_argument if click patterns are requested for more than 64 modes
+         */
+        void probabilities(const std::complex<double> *p_coefs, double scale, double *p_probabilities,
+                           fs_reductions *p_reductions=nullptr, int n_threads=0) const;
     private:
         void _count_fs();
+        void _build_rank_table();
+        /* index of a state code in the generated array, or npos */
+        unsigned long long _find_code(const char *code) const;
+        void _check_bits() const;
+        /* sum for u<v of the number of r-photon completions with all photons in modes [u, m) */
+        inline unsigned long long _rank_offset(int r, int v) const { return _rank_table[r*(_m+1)+v]; }
+        /* truncated fock space: number of states of r photons in modes [u, m), and its prefix sum over r */
+        inline unsigned long long _cap_states(int u, int r) const { return _cap_table[u*(_n+1)+r]; }
+        inline unsigned long long _cap_sum(int u, int r) const { return r < 0 ? 0 : _cap_prefix[u*(_n+1)+r]; }
+        /* first r photons of a truncated state code, from mode v on */
+        void _fill_state(char *code, int r, int v) const;
         mutable char *_buffer;
+        /* set once _buffer is filled - checked without locking, _generate_mutex serializing the generation */
+        mutable std::atomic<bool> _generated;
+        mutable std::mutex _generate_mutex;
         int _m;
         int _n;
         unsigned long long _count;
         const fs_mask *_p_mask;
+        bool _no_bunching;
+        std::vector<int> _caps;
+        std::vector<unsigned long long> _rank_table;
+        std::vector<unsigned long long> _cap_table;
+        std::vector<unsigned long long> _cap_prefix;
+};
+
+/**
+ * Enumeration of the states of a fs-array - or of a full (m, n) fock space - in lexicographic order without generating
+ * them: the states are written by blocks in a caller-provided buffer, without allocation per state. In the full fock
+ * space, the run of states differing only by their last photon is written at once, the carry to the previous photons
+ * being resolved once per run. Masked fs-arrays are enumerated by filtering blocks of the full fock space with
+ * `fs_mask::match_many`
+ */
+class fs_enumerator {
+    public:
+        /**
+         * enumerator of the full (m, n) fock space
+         */
+        fs_enumerator(int m, int n);
+        /**
+         * enumerator of the states of a fs-array
+         * @param fsa the fs-array - it must outlive the enumerator
+         * @param from index of the first state to enumerate
+         */
+        explicit fs_enumerator(const fs_array &fsa, unsigned long long from=0);
+        /**
+         * write the next states
+         * @param out buffer of at least k*n characters - the states are written contiguously, n characters each
+         * @param k maximal number of states to write
+         * @return the number of states written, lower than k only at the end of the enumeration
+         */
+        size_t next_block(char *out, size_t k);
+        inline bool done() const { return _done; }
+    private:
+        size_t _next_full_block(char *out, size_t k);
+        const fs_array *_p_fsa;
+        int _m;
+        int _n;
+        bool _done;
+        /* next state to write - in the full fock space for masked fs-arrays */
+        std::vector<char> _code;
 };
 
 #endif
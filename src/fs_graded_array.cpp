@@ -0,0 +1,170 @@
+// MIT License
+//
+// Copyright (c) 2022 Quandela
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "fs_graded_array.h"
+
+fs_graded_array::fs_graded_array(int m, int n): fs_graded_array(std::make_shared<fs_hierarchy>(m, n)) {
+}
+
+fs_graded_array::fs_graded_array(std::shared_ptr<fs_hierarchy> hierarchy): _m(hierarchy->get_m()),
+                                                                            _n(hierarchy->get_n()),
+                                                                            _hierarchy(hierarchy) {
+    _offsets.assign(_n+2, 0);
+    for(int k=0; k<=_n; k++) {
+        _grades.push_back(_hierarchy->layer(k));
+        _offsets[k+1] = _offsets[k] + _grades[k]->count();
+    }
+}
+
+unsigned long long fs_graded_array::offset(int k) const {
+    if (k < 0 || k > _n+1)
+        throw std::out_of_range("invalid grade");
+    return _offsets[k];
+}
+
+const fs_array &fs_graded_array::grade(int k) const {
+    if (k < 0 || k > _n)
+        throw std::out_of_range("invalid grade");
+    return *_grades[k];
+}
+
+int fs_graded_array::grade_of(unsigned long long idx) const {
+    if (idx >= count())
+        throw std::out_of_range("index too large");
+    /* last grade starting at or before idx - empty grades start at the same offset as the next one */
+    return int(std::upper_bound(_offsets.begin(), _offsets.end(), idx) - _offsets.begin()) - 1;
+}
+
+void fs_graded_array::generate() const {
+    for(auto &p_grade: _grades)
+        p_grade->generate();
+}
+
+fockstate fs_graded_array::operator[](unsigned long long idx) const {
+    int k = grade_of(idx);
+    return (*_grades[k])[idx-_offsets[k]];
+}
+
+unsigned long long fs_graded_array::find_code(const char *code, int k) const {
+    if (k < 0 || k > _n)
+        return fs_npos;
+    const fs_array &fsa = *_grades[k];
+    unsigned long long idx;
+    if (fsa.is_masked())
+        idx = fsa.find_idx(fockstate(_m, k, code));
+    else
+        idx = fsa.rank(code);
+    return idx == fs_npos ? fs_npos : _offsets[k]+idx;
+}
+
+unsigned long long fs_graded_array::find_idx(const fockstate &fs) const {
+    if (fs.get_m() != _m)
+        throw std::invalid_argument("incorrect fock state");
+    return find_code(fs.get_code(), fs.get_n());
+}
+
+fs_graded_array::const_iterator::const_iterator(const fs_graded_array *p_graded, bool first):
+                                                                            _p_graded(p_graded),
+                                                                            _k(first ? 0 : p_graded->_n),
+                                                                            _it(first ? p_graded->_grades[0]->begin() :
+                                                                                p_graded->_grades[p_graded->_n]->end()),
+                                                                            idx(first ? 0 : p_graded->count()) {
+    if (first)
+        _skip_empty_grades();
+}
+
+void fs_graded_array::const_iterator::_skip_empty_grades() {
+    /* move to the first state of the next non-empty grade when the current one is exhausted */
+    while (_k < _p_graded->_n && idx == _p_graded->_offsets[_k+1]) {
+        _k++;
+        _it = _p_graded->_grades[_k]->begin();
+    }
+}
+
+fs_graded_array::const_iterator::self_type &fs_graded_array::const_iterator::operator++() {
+    if (idx < _p_graded->count()) {
+        ++idx;
+        ++_it;
+        _skip_empty_grades();
+    }
+    return *this;
+}
+
+fockstate fs_graded_array::const_iterator::operator*() {
+    return *_it;
+}
+
+bool fs_graded_array::const_iterator::operator==(const self_type& rhs) const {
+    return _p_graded == rhs._p_graded && idx == rhs.idx;
+}
+
+bool fs_graded_array::const_iterator::operator!=(const self_type& rhs) const {
+    return idx != rhs.idx || _p_graded != rhs._p_graded;
+}
+
+void fs_graded_array::probabilities(const std::complex<double> *p_coefs, double scale, double *p_probabilities,
+                                    fs_reductions *p_reductions, double *p_grade_totals, int n_threads) const {
+    bool marginals = p_reductions && p_reductions->mode_marginals;
+    size_t n_masks = p_reductions ? p_reductions->masks.size() : 0;
+    fs_reductions grade_reductions;
+    if (p_reductions) {
+        grade_reductions.mode_marginals = p_reductions->mode_marginals;
+        grade_reductions.click_patterns = p_reductions->click_patterns;
+        for(const fs_mask &mask: p_reductions->masks)
+            grade_reductions.masks.push_back(mask);
+        /* states of the lower grades are complete: they are not counted as partial states of the mask */
+        grade_reductions.masks_allow_missing = false;
+        p_reductions->marginals.assign(marginals ? _m*(_n+1) : 0, 0);
+        p_reductions->clicks.clear();
+        p_reductions->mask_totals.assign(n_masks, 0);
+        p_reductions->total = 0;
+    }
+    bool reduce = p_reductions || p_grade_totals;
+    /* each grade is processed in parallel by the output stage of its layer - the reductions of the grades are then
+     * merged, marginals of grade k covering photon counts 0..k */
+    for(int k=0; k<=_n; k++) {
+        const fs_array &fsa = *_grades[k];
+        if (!fsa.count()) {
+            if (p_grade_totals)
+                p_grade_totals[k] = 0;
+            continue;
+        }
+        fsa.probabilities(p_coefs+_offsets[k], scale, p_probabilities ? p_probabilities+_offsets[k] : nullptr,
+                          reduce ? &grade_reductions : nullptr, n_threads);
+        if (p_grade_totals)
+            p_grade_totals[k] = grade_reductions.total;
+        if (!p_reductions)
+            continue;
+        p_reductions->total += grade_reductions.total;
+        if (marginals)
+            for(int j=0; j<_m; j++)
+                for(int c=0; c<=k; c++)
+                    p_reductions->marginals[j*(_n+1)+c] += grade_reductions.marginals[j*(k+1)+c];
+        for(auto &c: grade_reductions.clicks)
+            p_reductions->clicks[c.first] += c.second;
+        for(size_t c=0; c<n_masks; c++)
+            p_reductions->mask_totals[c] += grade_reductions.mask_totals[c];
+    }
+}
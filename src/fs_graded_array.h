@@ -0,0 +1,132 @@
+// MIT License
+//
+// Copyright (c) 2022 Quandela
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef QUANDELIBC_FS_GRADED_ARRAY_H
+#define QUANDELIBC_FS_GRADED_ARRAY_H
+
+#include <complex>
+#include <memory>
+#include <vector>
+
+#include "fs_array.h"
+#include "fs_hierarchy.h"
+
+/**
+ * A graded fs-array holds the states of all the photon numbers 0..n of a fock space, as the concatenation of the
+ * layers 0..n of a fs-hierarchy: the global index of a state is the offset of its grade - its photon number - plus its
+ * index in the layer. Coefficients over all the photon numbers, typically of lossy or heralded computations, are
+ * stored in a single vector in this order
+ */
+class fs_graded_array {
+    public:
+        /**
+         * graded fs-array of the (m, k) fock spaces for k in [0, n]
+         * @throws std::invalid_argument if n is negative
+         */
+        fs_graded_array(int m, int n);
+        /**
+         * graded fs-array over the layers of a fs-hierarchy - masked or truncated layers included. The layers are
+         * shared with the other users of the hierarchy, typically a SLOS engine
+         */
+        explicit fs_graded_array(std::shared_ptr<fs_hierarchy> hierarchy);
+        inline int get_m() const { return _m; }
+        inline int get_n() const { return _n; }
+        /**
+         * total number of states over all the grades
+         */
+        inline unsigned long long count() const { return _offsets[_n+1]; }
+        /**
+         * global index of the first state of grade k - `offset(n+1)` is `count()`
+         * @throws std::out_of_range if k is not in [0, n+1]
+         */
+        unsigned long long offset(int k) const;
+        /**
+         * fs-array of the states of grade k
+         * @throws std::out_of_range if k is not in [0, n]
+         */
+        const fs_array &grade(int k) const;
+        /**
+         * grade of a global index - in O(log n)
+         * @throws std::out_of_range if idx is not lower than `count()`
+         */
+        int grade_of(unsigned long long idx) const;
+        /**
+         * generate the states of all the grades
+         */
+        void generate() const;
+        fockstate operator[](unsigned long long idx) const;
+        /**
+         * global index of a state code of k photons - ranked in O(k) in unmasked grades, searched in O(log count) in
+         * masked ones
+         * @return the index, npos if the state is not in the graded array
+         */
+        unsigned long long find_code(const char *code, int k) const;
+        /**
+         * global index of a fockstate
+         * @return the index, npos if the state is not in the graded array
+         */
+        unsigned long long find_idx(const fockstate &fs) const;
+        class const_iterator {
+            public:
+                typedef const_iterator self_type;
+                const_iterator(const fs_graded_array *p_graded, bool first);
+                self_type &operator++();
+                fockstate operator*();
+                bool operator==(const self_type& rhs) const;
+                bool operator!=(const self_type& rhs) const;
+            private:
+                void _skip_empty_grades();
+                const fs_graded_array *_p_graded;
+                int _k;
+                fs_array::const_iterator _it;
+            public:
+                unsigned long long idx;
+        };
+        /**
+         * iterate through the states of all the grades, by increasing photon number
+         */
+        const_iterator begin() const { return {this, true}; }
+        const_iterator end() const { return {this, false}; }
+        /**
+         * fused output stage over all the grades: probabilities |c|^2.prod n_i!.scale of the states from their
+         * coefficients, with the reductions accumulated over all the grades and the total probability of each
+         * photon number, in a single pass
+         * @param p_coefs the `count()` coefficients
+         * @param scale global factor of the probabilities
+         * @param p_probabilities output buffer of the `count()` probabilities, or nullptr
+         * @param p_reductions the reductions to compute over all the grades, or nullptr - marginals are given for
+         * photon counts 0..n, and the states of every grade must match the masks without missing photons
+         * @param p_grade_totals output buffer of the n+1 total probabilities of each grade, or nullptr
+         * @param n_threads number of threads, 0 to use all the available cores
+         */
+        void probabilities(const std::complex<double> *p_coefs, double scale, double *p_probabilities,
+                           fs_reductions *p_reductions=nullptr, double *p_grade_totals=nullptr,
+                           int n_threads=0) const;
+    private:
+        int _m;
+        int _n;
+        std::shared_ptr<fs_hierarchy> _hierarchy;
+        std::vector<std::shared_ptr<const fs_array>> _grades;
+        std::vector<unsigned long long> _offsets;
+};
+
+#endif //QUANDELIBC_FS_GRADED_ARRAY_H
@@ -0,0 +1,183 @@
+// MIT License
+//
+// Copyright (c) 2022 Quandela
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdexcept>
+
+#include "fs_hierarchy.h"
+
+fs_hierarchy::fs_hierarchy(int m, int n, bool implicit_maps): _m(m), _n(n), _implicit_maps(implicit_maps),
+                                                              _p_mask(nullptr) {
+    if (n < 0)
+        throw std::invalid_argument("invalid number of photons");
+    _layers.resize(n+1);
+    _maps.resize(n+1);
+    _held_layers.resize(n+1);
+    _held_maps.resize(n+1);
+}
+
+fs_hierarchy::fs_hierarchy(int m, int n, const fs_mask &mask): _m(m), _n(n), _implicit_maps(false),
+                                                               _p_mask(nullptr) {
+    if (n < 0)
+        throw std::invalid_argument("invalid number of photons");
+    _p_mask = new fs_mask(mask);
+    _layers.resize(n+1);
+    _maps.resize(n+1);
+    _held_layers.resize(n+1);
+    _held_maps.resize(n+1);
+}
+
+fs_hierarchy::fs_hierarchy(int m, int n, const std::vector<int> &caps, bool implicit_maps): _m(m), _n(n),
+                                                                                          _implicit_maps(implicit_maps),
+                                                                                          _p_mask(nullptr),
+                                                                                          _caps(caps) {
+    if (n < 0)
+        throw std::invalid_argument("invalid number of photons");
+    if ((int)caps.size() != m)
+        throw std::invalid_argument("photon caps must be given for each mode");
+    _layers.resize(n+1);
+    _maps.resize(n+1);
+    _held_layers.resize(n+1);
+    _held_maps.resize(n+1);
+}
+
+fs_hierarchy::~fs_hierarchy() {
+    /* layers still used outside of the hierarchy have their own copy of the mask */
+    delete _p_mask;
+}
+
+void fs_hierarchy::_check_layer(int k, int k_min) const {
+    if (k < k_min || k > _n)
+        throw std::out_of_range("invalid layer");
+}
+
+std::shared_ptr<fs_array> fs_hierarchy::_layer(int k) const {
+    std::shared_ptr<fs_array> p_layer = _layers[k].lock();
+    if (!p_layer) {
+        if (_p_mask)
+            p_layer = std::make_shared<fs_array>(_m, k, *_p_mask);
+        else if (!_caps.empty())
+            /* photon removals keep the caps: the parents of the states of a truncated layer are all in the
+             * truncated parent layer */
+            p_layer = std::make_shared<fs_array>(_m, k, _caps);
+        else
+            p_layer = std::make_shared<fs_array>(_m, k);
+        _layers[k] = p_layer;
+    }
+    _held_layers[k] = p_layer;
+    return p_layer;
+}
+
+std::shared_ptr<fs_map> fs_hierarchy::_map(int k) const {
+    std::shared_ptr<fs_map> p_map = _maps[k].lock();
+    if (!p_map) {
+        std::shared_ptr<fs_array> p_current = _layer(k);
+        std::shared_ptr<fs_array> p_parent = _layer(k-1);
+        /* the map refers to its fs-arrays: the deleter keeps them alive as long as the map - and drops them when
+         * called, the deleter itself living as long as weak references to the map */
+        p_map = std::shared_ptr<fs_map>(new fs_map(*p_current, *p_parent, false, _implicit_maps),
+                                        [p_current, p_parent](fs_map *p) mutable {
+                                            delete p;
+                                            p_current.reset();
+                                            p_parent.reset();
+                                        });
+        _maps[k] = p_map;
+    }
+    _held_maps[k] = p_map;
+    return p_map;
+}
+
+std::shared_ptr<const fs_array> fs_hierarchy::layer(int k) const {
+    _check_layer(k, 0);
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _layer(k);
+}
+
+std::shared_ptr<const fs_map> fs_hierarchy::map(int k) const {
+    _check_layer(k, 1);
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _map(k);
+}
+
+void fs_hierarchy::generate(int k, int n_threads) const {
+    _check_layer(k, 0);
+    std::shared_ptr<const fs_array> p_layer = layer(k);
+    /* generation is once-only and thread-safe: other layers can be accessed meanwhile */
+    p_layer->generate();
+    if (k)
+        map(k)->generate(n_threads);
+}
+
+void fs_hierarchy::generate_all(int n_threads) const {
+    for(int k=0; k<=_n; k++)
+        generate(k, n_threads);
+}
+
+void fs_hierarchy::release(int k) const {
+    _check_layer(k, 0);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _held_maps[k].reset();
+    _held_layers[k].reset();
+}
+
+void fs_hierarchy::release_all() const {
+    for(int k=0; k<=_n; k++)
+        release(k);
+}
+
+std::vector<fs_layer_report> fs_hierarchy::memory_report() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<fs_layer_report> report(_n+1);
+    for(int k=0; k<=_n; k++) {
+        fs_layer_report &r = report[k];
+        r.k = k;
+        r.count = 0;
+        r.array_bytes = 0;
+        r.map_bytes = 0;
+        std::shared_ptr<fs_array> p_layer = _layers[k].lock();
+        r.loaded = (bool)p_layer;
+        /* not counting the reference taken for the report */
+        r.users = p_layer ? p_layer.use_count()-1 : 0;
+        if (p_layer) {
+            r.count = p_layer->count();
+            if (p_layer->is_generated())
+                r.array_bytes = p_layer->size();
+        }
+        std::shared_ptr<fs_map> p_map = _maps[k].lock();
+        if (p_map && p_map->is_generated()) {
+            r.map_bytes = p_map->size();
+            if (p_map->has_reverse()) {
+                unsigned long long n_current = p_map->count_current();
+                unsigned long long n_edges = p_map->reverse_offsets()[n_current];
+                r.map_bytes += (n_current+1)*sizeof(unsigned long long)
+                               + n_edges*(sizeof(unsigned long long)+sizeof(unsigned char));
+            }
+        }
+    }
+    return report;
+}
+
+unsigned long long fs_hierarchy::memory_usage() const {
+    unsigned long long total = 0;
+    for(const fs_layer_report &r: memory_report())
+        total += r.array_bytes + r.map_bytes;
+    return total;
+}
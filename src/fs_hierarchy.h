@@ -0,0 +1,150 @@
+// MIT License
+//
+// Copyright (c) 2022 Quandela
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef QUANDELIBC_FS_HIERARCHY_H
+#define QUANDELIBC_FS_HIERARCHY_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "fs_array.h"
+#include "fs_map.h"
+#include "fs_mask.h"
+
+/**
+ * memory usage of one layer of a fs-hierarchy
+ */
+struct fs_layer_report {
+    /** number of photons of the layer */
+    int k;
+    /** number of states of the layer, 0 if the layer is not loaded */
+    unsigned long long count;
+    /** true if the layer is held by the hierarchy or by one of its users */
+    bool loaded;
+    /** number of users of the fs-array of the layer - the hierarchy itself included */
+    long users;
+    /** bytes of the generated fs-array */
+    unsigned long long array_bytes;
+    /** bytes of the generated (k-1)->k fs-map and of its reverse index - 0 for k=0 */
+    unsigned long long map_bytes;
+};
+
+/**
+ * A fs-hierarchy owns the fs-arrays of layers 0..n of a (m, n) fock space, and the fs-maps between consecutive
+ * layers. Layers and maps are created on first access, and generated on demand - they are returned as shared
+ * pointers, so that several simulations can share them: a fs-map keeps its two fs-arrays alive, and a released
+ * layer is only deleted once its last user drops it. All methods can be called concurrently - generation being
+ * once-only, concurrent users of a layer wait for its generation to complete
+ */
+class fs_hierarchy {
+    public:
+        /**
+         * Build the hierarchy of a (m, n) fock space - nothing is allocated until layers are accessed
+         * @param m number of modes
+         * @param n number of photons of the last layer
+         * @param implicit_maps if true, fs-maps are not stored: transitions are computed from the ranks of the states
+         * @throws std::invalid_argument if n is negative
+         */
+        fs_hierarchy(int m, int n, bool implicit_maps=false);
+        /**
+         * Build the hierarchy of a masked (m, n) fock space
+         * @param mask the mask applying to all layers
+         */
+        fs_hierarchy(int m, int n, const fs_mask &mask);
+        /**
+         * Build the hierarchy of a (m, n) fock space truncated to a per-mode photon cap - the bunched states beyond the
+         * caps are neither stored nor mapped
+         * @param caps maximal number of photons of each mode
+         * @param implicit_maps if true, fs-maps are not stored: transitions are computed from the ranks of the states
+         * @throws std::invalid_argument if caps does not have m non-negative values
+         */
+        fs_hierarchy(int m, int n, const std::vector<int> &caps, bool implicit_maps=false);
+        ~fs_hierarchy();
+        fs_hierarchy(const fs_hierarchy &) = delete;
+        fs_hierarchy &operator=(const fs_hierarchy &) = delete;
+        inline int get_m() const { return _m; }
+        inline int get_n() const { return _n; }
+        inline bool is_implicit() const { return _implicit_maps; }
+        /**
+         * mask of the layers, nullptr if the hierarchy is not masked
+         */
+        inline const fs_mask *mask() const { return _p_mask; }
+        /**
+         * per-mode photon caps of the layers, empty if the hierarchy is not truncated
+         */
+        inline const std::vector<int> &caps() const { return _caps; }
+        /**
+         * fs-array of layer k - created if needed, but not generated
+         * @throws std::out_of_range if k is not in [0, n]
+         */
+        std::shared_ptr<const fs_array> layer(int k) const;
+        /**
+         * fs-map between layer k-1 and layer k - created if needed, but not generated
+         * @throws std::out_of_range if k is not in [1, n]
+         */
+        std::shared_ptr<const fs_map> map(int k) const;
+        /**
+         * generate the fs-array of layer k and the fs-map leading to it
+         * @param n_threads number of threads used for the fs-map, 0 to use all the available cores
+         */
+        void generate(int k, int n_threads=0) const;
+        /**
+         * generate all the layers and maps
+         */
+        void generate_all(int n_threads=0) const;
+        /**
+         * release the layer k and the fs-map leading to it: the hierarchy drops its own references, the memory being
+         * freed as soon as no user holds them - accessing the layer again reuses them if they are still in use,
+         * otherwise they are created again
+         */
+        void release(int k) const;
+        /**
+         * release all the layers and maps
+         */
+        void release_all() const;
+        /**
+         * memory usage of the layers 0..n
+         */
+        std::vector<fs_layer_report> memory_report() const;
+        /**
+         * total bytes of the generated fs-arrays and fs-maps
+         */
+        unsigned long long memory_usage() const;
+    private:
+        void _check_layer(int k, int k_min) const;
+        std::shared_ptr<fs_array> _layer(int k) const;
+        std::shared_ptr<fs_map> _map(int k) const;
+        int _m;
+        int _n;
+        bool _implicit_maps;
+        const fs_mask *_p_mask;
+        std::vector<int> _caps;
+        mutable std::mutex _mutex;
+        /* layers and maps are tracked as long as they are used, and held by the hierarchy until released */
+        mutable std::vector<std::weak_ptr<fs_array>> _layers;
+        mutable std::vector<std::weak_ptr<fs_map>> _maps;
+        mutable std::vector<std::shared_ptr<fs_array>> _held_layers;
+        mutable std::vector<std::shared_ptr<fs_map>> _held_maps;
+};
+
+#endif //QUANDELIBC_FS_HIERARCHY_H
@@ -20,39 +20,60 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
-#include <unordered_map>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 #include "fs_map.h"
 #include "fockstate.h"
+#include "parallel_tools.h"
 
-struct NStrHash {
-    int _size;
-    explicit NStrHash(int size):_size(size) {}
-    unsigned long long operator()(const char *s) const {
-        return fockstate::hash_function(s, _size);
+/* p_out[b] += p_a[b] * p_b[b] for b in [0, size) */
+static inline void multiply_add(std::complex<double> *p_out,
+                                const std::complex<double> *p_a, const std::complex<double> *p_b,
+                                int size) {
+    int b = 0;
+#ifdef __AVX__
+    /* two complex numbers per register: (ar+i.ai)*(br+i.bi) = (ar.br-ai.bi) + i.(ai.br+ar.bi) */
+    for(; b+2 <= size; b+=2) {
+        __m256d A = _mm256_loadu_pd(reinterpret_cast<const double*>(p_a+b));
+        __m256d B = _mm256_loadu_pd(reinterpret_cast<const double*>(p_b+b));
+        __m256d C1 = _mm256_mul_pd(A, _mm256_movedup_pd(B));
+        __m256d C2 = _mm256_mul_pd(_mm256_permute_pd(A, 0x5), _mm256_permute_pd(B, 0xF));
+        __m256d O = _mm256_loadu_pd(reinterpret_cast<double*>(p_out+b));
+        _mm256_storeu_pd(reinterpret_cast<double*>(p_out+b), _mm256_add_pd(O, _mm256_addsub_pd(C1, C2)));
     }
-};
-
-struct NStrCompare {
-    int _size;
-    explicit NStrCompare(int size):_size(size) {}
-    bool operator()(const char *s1, const char *s2) const {
-        return memcmp(s1, s2, _size) == 0;
+#endif
+    for(; b<size; b++) {
+        double ar = p_a[b].real(), ai = p_a[b].imag();
+        double br = p_b[b].real(), bi = p_b[b].imag();
+        p_out[b] += std::complex<double>(ar*br-ai*bi, ai*br+ar*bi);
     }
-};
-
-typedef std::unordered_map<const char*, unsigned long long, NStrHash, NStrCompare> NStrUMap;
+}
 
-unsigned char fs_map::version = 1;
+unsigned char fs_map::version = 3;
 
 /* given layer nk generate map between nk-1 and nk */
-fs_map::fs_map(const fs_array &fsa_current, const fs_array &fsa_parent, bool do_generate):_buffer(nullptr),
+fs_map::fs_map(const fs_array &fsa_current, const fs_array &fsa_parent, bool do_generate, bool implicit):
+                                                                                          _buffer(nullptr),
+                                                                                          _p_file(nullptr),
                                                                                           _pfsa_current(&fsa_current),
-                                                                                          _pfsa_parent(&fsa_parent) {
+                                                                                          _pfsa_parent(&fsa_parent),
+                                                                                          _implicit(implicit),
+                                                                                          _rev_offsets(nullptr),
+                                                                                          _rev_parents(nullptr),
+                                                                                          _rev_modes(nullptr),
+                                                                                          _reverse_mapped(false),
+                                                                                          _generated(false),
+                                                                                          _reverse_generated(false) {
+    if (implicit && (fsa_current.is_masked() || fsa_parent.is_masked()))
+        throw std::invalid_argument("implicit fs-map requires unmasked fs-arrays");
     int nk = fsa_current.get_n();
     _m = fsa_current.get_m();
     _n = nk-1;
@@ -66,60 +87,344 @@ fs_map::fs_map(const fs_array &fsa_current, const fs_array &fsa_parent, bool do_
         generate();
 }
 
-void fs_map::generate() const {
-    if (_buffer) return;
-    _pfsa_current->generate();
-    _pfsa_parent->generate();
+/* parent indexes of all the states obtained by removing one photon from a current state code d (n+1 photons): removing
+ * the photon at position i shifts the rank terms of positions > i - with A the prefix sums of the parent rank terms of
+ * d and B the suffix sums of the shifted terms, all the parent ranks are obtained in O(n) */
+void fs_map::_parent_ranks(const char *code, unsigned long long *A, unsigned long long *B,
+                           unsigned long long *p_parents) const {
+    const fs_array &fsa_parent = *_pfsa_parent;
+    int n = _n;
+    A[0] = 0;
+    for(int k=0; k<n; k++) {
+        int d = (unsigned char)code[k]-'A', d_prev = k ? (unsigned char)code[k-1]-'A' : 0;
+        A[k+1] = A[k] + fsa_parent._rank_offset(n-1-k, d) - fsa_parent._rank_offset(n-1-k, d_prev);
+    }
+    B[n+1] = 0;
+    for(int k=n; k>=1; k--) {
+        int d = (unsigned char)code[k]-'A', d_prev = (unsigned char)code[k-1]-'A';
+        B[k] = B[k+1] + fsa_parent._rank_offset(n-k, d) - fsa_parent._rank_offset(n-k, d_prev);
+    }
+    for(int i=0; i<=n; i++) {
+        unsigned long long idx = A[i];
+        if (i < n) {
+            int d_prev = i ? (unsigned char)code[i-1]-'A' : 0;
+            idx += fsa_parent._rank_offset(n-1-i, (unsigned char)code[i+1]-'A') -
+                   fsa_parent._rank_offset(n-1-i, d_prev);
+            idx += B[i+2];
+        }
+        p_parents[i] = idx;
+    }
+}
+
+void fs_map::_generate_range(unsigned long long from, unsigned long long to, bool forward, bool reverse) const {
     int nk = _n+1;
-    /* the map is an array of size _count (number of states in parent fsa) * m - each map cell is the transition
-     * between parent fsa and current fsa when adding the additional photon in mode m */
-    _buffer = new unsigned char[size()];
-    ::memset(_buffer, 0xff, size());
-    NStrUMap index_current_level(0, NStrHash(_n), NStrCompare(_n));
-    index_current_level.reserve(2*_count);
-    unsigned long long idx = 0;
-    /* fsa array for level n (parent fsa) can be directly obtained from current fsa array - just skipping first photon
-     * index current level is the address of parent state in parent fsa */
-    for(fockstate fs: *_pfsa_parent) {
-        index_current_level[fs.get_code()] = idx;
-        idx++;
-    }
-    const char *state_nk = _pfsa_current->_buffer;
-    char *fs_temp=new char[_n];
-    /* simply go through the current state, and build all the possible parent states, get their index
-     * and save them in the "map" */
-    for(unsigned long long k=0; k<_pfsa_current->_count; k++, state_nk+=nk) {
-        /* starting from state_k[i*nk] => builds the fock_state-1 with one photon less */
-        int prev_i = 0;
+    /* full parent: all the parent ranks at once - restricted parent: one rank per parent - masked parent: search */
+    bool ranked = _pfsa_parent->is_full();
+    bool searched = _pfsa_parent->is_masked();
+    std::vector<char> fs_temp(nk);
+    std::vector<unsigned long long> A(nk+1), B(nk+1), parents(nk);
+    const char *state_nk = _pfsa_current->_buffer+from*nk;
+    for(unsigned long long k=from; k<to; k++, state_nk+=nk) {
+        if (ranked)
+            _parent_ranks(state_nk, A.data(), B.data(), parents.data());
+        unsigned long long r = reverse ? _rev_offsets[k] : 0;
         for(int i=0; i<nk; i++) {
+            /* photons in the same mode lead to the same transition */
             if (i<_n && state_nk[i+1] == state_nk[i])
                 continue;
-            for(int h=prev_i;h<i;h++)
-                fs_temp[h] = state_nk[h];
-            for(int h=i+1;h<nk;h++)
-                fs_temp[h-1] = state_nk[h];
-            prev_i = i;
-            /* search fs_temp in index of previous level */
             unsigned long long idx_m1;
-            if (nk>1)
-                idx_m1 = index_current_level[fs_temp];
-            else
-                idx_m1 = 0;
-            /* we save the pointer to current state (idx_current) in idx_m1 - mode state_nk[i] */
-            unsigned char *ptr_pointer = _buffer+(idx_m1*_m+state_nk[i]-65)*_step;
-            int size_pointer = _step;
-            unsigned long long idx_current = k;
-            while (size_pointer--) {
-                *(ptr_pointer++) = idx_current & 0xFF;
-                idx_current >>= 8;
+            if (ranked)
+                idx_m1 = parents[i];
+            else {
+                /* masked parent: search the state with one photon less in the sorted parent array */
+                for(int h=0; h<i; h++)
+                    fs_temp[h] = state_nk[h];
+                for(int h=i+1; h<nk; h++)
+                    fs_temp[h-1] = state_nk[h];
+                if (nk == 1)
+                    idx_m1 = 0;
+                else
+                    idx_m1 = searched ? _pfsa_parent->_find_code(fs_temp.data()) : _pfsa_parent->rank(fs_temp.data());
+            }
+            int mode = (unsigned char)state_nk[i]-'A';
+            if (reverse) {
+                _rev_parents[r] = idx_m1;
+                _rev_modes[r++] = (unsigned char)mode;
             }
+            if (!forward || idx_m1 == fs_npos)
+                continue;
+            /* each (parent, mode) cell is reached from a single current state - ranges can be written concurrently */
+            unsigned char *ptr_pointer = _buffer+(idx_m1*_m+mode)*_step;
+            unsigned long long idx_current = k;
+            for(int s=0; s<_step; s++, idx_current >>= 8)
+                ptr_pointer[s] = idx_current & 0xFF;
         }
     }
-    delete [] fs_temp;
+}
+
+void fs_map::generate(int n_threads, bool with_reverse) const {
+    if (_implicit) {
+        if (with_reverse)
+            throw std::logic_error("implicit fs-map has no reverse index");
+        return;
+    }
+    if (is_generated() && (!with_reverse || has_reverse()))
+        return;
+    std::lock_guard<std::mutex> lock(_generate_mutex);
+    bool forward = !_buffer;
+    bool reverse = with_reverse && !_rev_offsets;
+    if (!forward && !reverse) return;
+    _pfsa_current->generate();
+    _pfsa_parent->generate();
+    unsigned long long n_current = _pfsa_current->_count;
+    if (forward) {
+        /* the map is an array of size _count (number of states in parent fsa) * m - each map cell is the transition
+         * between parent fsa and current fsa when adding the additional photon in mode m */
+        unsigned char *buffer = new unsigned char[size()];
+        /* between full fock spaces, every cell is reached */
+        if (!_pfsa_current->is_full() || !_pfsa_parent->is_full())
+            ::memset(buffer, 0xff, size());
+        _buffer = buffer;
+    }
+    if (reverse) {
+        /* the predecessors of a current state are its distinct occupied modes - their number gives the CSR offsets */
+        int nk = _n+1;
+        _rev_offsets = new unsigned long long[n_current+1];
+        _rev_offsets[0] = 0;
+        parallel_ranges(n_current, n_threads, [this, nk](unsigned long long from, unsigned long long to) {
+            const char *state_nk = _pfsa_current->_buffer+from*nk;
+            for(unsigned long long k=from; k<to; k++, state_nk+=nk) {
+                unsigned long long c = 1;
+                for(int i=1; i<nk; i++)
+                    c += state_nk[i] != state_nk[i-1];
+                _rev_offsets[k+1] = c;
+            }
+        });
+        for(unsigned long long k=0; k<n_current; k++)
+            _rev_offsets[k+1] += _rev_offsets[k];
+        _rev_parents = new unsigned long long[_rev_offsets[n_current]];
+        _rev_modes = new unsigned char[_rev_offsets[n_current]];
+    }
+    /* the current states are split in disjoint ranges processed in parallel - the parent of each photon removal is
+     * found by ranking, or by binary search for masked fs-arrays */
+    parallel_ranges(n_current, n_threads, [this, forward, reverse](unsigned long long from, unsigned long long to) {
+        _generate_range(from, to, forward, reverse);
+    });
+    if (forward)
+        _generated.store(true, std::memory_order_release);
+    if (reverse)
+        _reverse_generated.store(true, std::memory_order_release);
 }
 
 fs_map::~fs_map() {
-    delete [] _buffer;
+    release();
+}
+
+void fs_map::release() const {
+    std::lock_guard<std::mutex> lock(_generate_mutex);
+    _release();
+}
+
+void fs_map::_release() const {
+    _generated.store(false, std::memory_order_release);
+    _reverse_generated.store(false, std::memory_order_release);
+    if (!_p_file)
+        delete [] _buffer;
+    /* a reverse index generated after loading a file without it is owned by the map */
+    if (!_reverse_mapped) {
+        delete [] _rev_offsets;
+        delete [] _rev_parents;
+        delete [] _rev_modes;
+    }
+    delete _p_file;
+    _p_file = nullptr;
+    _reverse_mapped = false;
+    _buffer = nullptr;
+    _rev_offsets = nullptr;
+    _rev_parents = nullptr;
+    _rev_modes = nullptr;
+}
+
+#define FSM_HEADER_SIZE 40
+
+/* header: "FSM" version step(4) m(4) n(4) count(8) reverse(1) - padded to 32 bytes - fingerprint(8) */
+static void fsm_header(char *header, int step, int m, int n, unsigned long long count, bool reverse,
+                       unsigned long long fingerprint) {
+    memset(header, 0, FSM_HEADER_SIZE);
+    memcpy(header, "FSM", 3);
+    header[3] = (char)fs_map::version;
+    int32_t v;
+    v = step; memcpy(header+4, &v, 4);
+    v = m; memcpy(header+8, &v, 4);
+    v = n; memcpy(header+12, &v, 4);
+    uint64_t c = count; memcpy(header+16, &c, 8);
+    header[24] = reverse ? 1 : 0;
+    uint64_t f = fingerprint; memcpy(header+32, &f, 8);
+}
+
+/* FNV-1a hash of a byte sequence */
+static unsigned long long fnv1a(unsigned long long h, const void *data, size_t size) {
+    const unsigned char *p = (const unsigned char *)data;
+    for(size_t i=0; i<size; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+unsigned long long fs_map::_fingerprint() const {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    for(const fs_array *p_fsa: {_pfsa_current, _pfsa_parent}) {
+        /* restriction of the fock space: mask conditions, caps and no-bunching flag */
+        unsigned char flags = (p_fsa->_p_mask ? 1 : 0) | (p_fsa->_no_bunching ? 2 : 0);
+        h = fnv1a(h, &flags, 1);
+        if (p_fsa->_p_mask) {
+            for(const std::string &condition: p_fsa->_p_mask->conditions())
+                h = fnv1a(h, condition.c_str(), condition.size()+1);
+        }
+        int32_t n_caps = (int32_t)p_fsa->_caps.size();
+        h = fnv1a(h, &n_caps, 4);
+        for(int cap: p_fsa->_caps) {
+            int32_t c = cap;
+            h = fnv1a(h, &c, 4);
+        }
+    }
+    return h;
+}
+
+/* the reverse index follows the map, aligned on 8 bytes */
+static unsigned long long fsm_reverse_offset(unsigned long long map_size) {
+    return (FSM_HEADER_SIZE + map_size + 7) & ~7ULL;
+}
+
+void fs_map::save(const std::string &filename) const {
+    if (_implicit)
+        throw std::logic_error("implicit fs-map cannot be saved");
+    generate();
+    char header[FSM_HEADER_SIZE];
+    fsm_header(header, _step, _m, _n, _count, has_reverse(), _fingerprint());
+    std::ofstream f(filename, std::ios::binary | std::ios::trunc);
+    if (!f)
+        throw std::runtime_error("cannot write file: " + filename);
+    f.write(header, FSM_HEADER_SIZE);
+    f.write((const char *)_buffer, size());
+    if (has_reverse()) {
+        unsigned long long n_current = _pfsa_current->_count;
+        char padding[8] = {0};
+        f.write(padding, fsm_reverse_offset(size()) - FSM_HEADER_SIZE - size());
+        f.write((const char *)_rev_offsets, (n_current+1)*sizeof(unsigned long long));
+        f.write((const char *)_rev_parents, _rev_offsets[n_current]*sizeof(unsigned long long));
+        f.write((const char *)_rev_modes, _rev_offsets[n_current]);
+    }
+    if (!f)
+        throw std::runtime_error("cannot write file: " + filename);
+}
+
+void fs_map::_generate_parents(unsigned char *buffer, unsigned long long from, unsigned long long to) const {
+    bool searched = _pfsa_current->is_masked();
+    std::vector<char> parent_code(_n+1), code(_n+2);
+    std::vector<unsigned long long> children(_m);
+    for(unsigned long long i=from; i<to; i++) {
+        if (_n)
+            memcpy(parent_code.data(), _pfsa_parent->_buffer+i*_n, _n);
+        if (!searched)
+            _implicit_children(parent_code.data(), children.data());
+        else {
+            /* masked current layer: search the states with one photon more in the sorted current array */
+            int t = 0;
+            for(int j=0; j<_m; j++) {
+                while (t < _n && (unsigned char)parent_code[t]-'A' <= j)
+                    t++;
+                memcpy(code.data(), parent_code.data(), t);
+                code[t] = char('A'+j);
+                memcpy(code.data()+t+1, parent_code.data()+t, _n-t);
+                children[j] = _pfsa_current->_find_code(code.data());
+            }
+        }
+        for(int j=0; j<_m; j++) {
+            unsigned long long idx_current = children[j];
+            for(int s=0; s<_step; s++, idx_current >>= 8)
+                *buffer++ = idx_current == fs_npos ? 0xff : idx_current & 0xFF;
+        }
+    }
+}
+
+void fs_map::generate_file(const std::string &filename, unsigned long long chunk, int n_threads) const {
+    if (_implicit)
+        throw std::logic_error("implicit fs-map cannot be saved");
+    if (!chunk)
+        throw std::invalid_argument("invalid chunk size");
+    _pfsa_current->generate();
+    _pfsa_parent->generate();
+    auto *p_file = new mapped_file(filename, FSM_HEADER_SIZE + size(), true);
+    char header[FSM_HEADER_SIZE];
+    fsm_header(header, _step, _m, _n, _count, false, _fingerprint());
+    memcpy(p_file->data(), header, FSM_HEADER_SIZE);
+    unsigned char *buffer = (unsigned char *)p_file->data() + FSM_HEADER_SIZE;
+    unsigned long long row = (unsigned long long)_m * _step;
+    /* parent states are processed in order: each chunk is written sequentially, then written back and released */
+    for(unsigned long long i0=0; i0 < _count; i0 += chunk) {
+        unsigned long long i1 = std::min(i0+chunk, _count);
+        parallel_ranges(i1-i0, n_threads, [this, buffer, row, i0](unsigned long long from, unsigned long long to) {
+            _generate_parents(buffer+(i0+from)*row, i0+from, i0+to);
+        });
+        p_file->dont_need(FSM_HEADER_SIZE + i0*row, (i1-i0)*row);
+    }
+    std::lock_guard<std::mutex> lock(_generate_mutex);
+    _release();
+    _p_file = p_file;
+    _buffer = buffer;
+    _generated.store(true, std::memory_order_release);
+}
+
+void fs_map::load(const std::string &filename) const {
+    if (_implicit)
+        throw std::logic_error("implicit fs-map cannot be loaded");
+    auto *p_file = new mapped_file(filename, 0, false);
+    char header[FSM_HEADER_SIZE];
+    bool reverse = p_file->size() >= FSM_HEADER_SIZE && p_file->data()[24] == 1;
+    fsm_header(header, _step, _m, _n, _count, reverse, _fingerprint());
+    unsigned long long expected_size = FSM_HEADER_SIZE + size();
+    unsigned long long n_current = _pfsa_current->_count;
+    unsigned long long rev_offset = fsm_reverse_offset(size());
+    if (reverse) {
+        expected_size = rev_offset + (n_current+1)*sizeof(unsigned long long);
+        if (p_file->size() >= expected_size) {
+            unsigned long long n_entries = ((unsigned long long *)(p_file->data() + rev_offset))[n_current];
+            expected_size += n_entries*(sizeof(unsigned long long)+1);
+        }
+    }
+    if (p_file->size() != expected_size || memcmp(p_file->data(), header, FSM_HEADER_SIZE) != 0) {
+        delete p_file;
+        throw std::invalid_argument("file does not match fs-map: " + filename);
+    }
+    std::lock_guard<std::mutex> lock(_generate_mutex);
+    _release();
+    _p_file = p_file;
+    _buffer = (unsigned char *)p_file->data() + FSM_HEADER_SIZE;
+    if (reverse) {
+        _rev_offsets = (unsigned long long *)(p_file->data() + rev_offset);
+        _rev_parents = _rev_offsets + n_current + 1;
+        _rev_modes = (unsigned char *)(_rev_parents + _rev_offsets[n_current]);
+        _reverse_mapped = true;
+        _reverse_generated.store(true, std::memory_order_release);
+    }
+    _generated.store(true, std::memory_order_release);
+}
+
+void fs_map::advise(unsigned long long from, unsigned long long to, bool will_need) const {
+    if (!_p_file || from >= to)
+        return;
+    unsigned long long offset = FSM_HEADER_SIZE + from * _m * _step;
+    unsigned long long length = (to - from) * _m * _step;
+    if (will_need)
+        _p_file->will_need(offset, length);
+    else
+        _p_file->dont_need(offset, length);
+}
+
+void fs_map::prefetch(unsigned long long from, unsigned long long to) const {
+    if (!_p_file || from >= to)
+        return;
+    _p_file->prefetch(FSM_HEADER_SIZE + from * _m * _step, (to - from) * _m * _step);
 }
 
 unsigned long long fs_map::get(unsigned long long idx, int m) const {
@@ -131,16 +436,234 @@ unsigned long long fs_map::get(unsigned long long idx, int m) const {
     return fs_map::get_nc(idx, m);
 }
 
+/* the child obtained by adding a photon in mode j to parent code c is c with j inserted at position t, where t is
+ * the number of photons of c in modes <= j - its rank is the rank sum of c with the terms shifted from position t.
+ * With P the prefix sums of the child rank terms of c and Q the suffix sums of the terms shifted by one position,
+ * all m children are obtained in O(n+m) */
+void fs_map::_implicit_children(const char *parent_code, unsigned long long *p_children) const {
+    const fs_array &fsa = *_pfsa_current;
+    int n = _n;
+    if (!fsa.is_full()) {
+        /* restricted fock space: each child is ranked, npos if it is not in the space */
+        char local[256];
+        std::vector<char> large;
+        char *code = local;
+        if (n+1 > 256) {
+            large.resize(n+1);
+            code = large.data();
+        }
+        int t = 0;
+        for(int j=0; j<_m; j++) {
+            while (t < n && (unsigned char)parent_code[t]-'A' <= j)
+                t++;
+            memcpy(code, parent_code, t);
+            code[t] = char('A'+j);
+            memcpy(code+t+1, parent_code+t, n-t);
+            p_children[j] = fsa.rank(code);
+        }
+        return;
+    }
+    /* called per parent state - the prefix and suffix sums are on the stack unless n is very large */
+    unsigned long long local[2*256];
+    std::vector<unsigned long long> large;
+    unsigned long long *P = local;
+    if (n+1 > 256) {
+        large.resize(2*(n+1));
+        P = large.data();
+    }
+    unsigned long long *Q = P+n+1;
+    P[0] = 0;
+    for(int i=0; i<n; i++) {
+        int c = (unsigned char)parent_code[i]-'A', c_prev = i ? (unsigned char)parent_code[i-1]-'A' : 0;
+        P[i+1] = P[i] + fsa._rank_offset(n-i, c) - fsa._rank_offset(n-i, c_prev);
+    }
+    Q[n] = 0;
+    for(int i=n-1; i>=0; i--) {
+        int c = (unsigned char)parent_code[i]-'A', c_prev = i ? (unsigned char)parent_code[i-1]-'A' : 0;
+        Q[i] = Q[i+1] + fsa._rank_offset(n-1-i, c) - fsa._rank_offset(n-1-i, c_prev);
+    }
+    int t = 0;
+    for(int j=0; j<_m; j++) {
+        while (t < n && (unsigned char)parent_code[t]-'A' <= j)
+            t++;
+        int c_prev = t ? (unsigned char)parent_code[t-1]-'A' : 0;
+        unsigned long long idx = P[t] + fsa._rank_offset(n-t, j) - fsa._rank_offset(n-t, c_prev);
+        if (t < n)
+            idx += fsa._rank_offset(n-t-1, (unsigned char)parent_code[t]-'A') - fsa._rank_offset(n-t-1, j) +
+                   Q[t+1];
+        p_children[j] = idx;
+    }
+}
+
+unsigned long long fs_map::_implicit_get(unsigned long long idx, int m) const {
+    /* called per transition - the code is on the stack unless the number of photons is very large */
+    char local[256];
+    std::vector<char> large;
+    char *code = local;
+    if (_n+1 > 256) {
+        large.resize(_n+1);
+        code = large.data();
+    }
+    _pfsa_parent->unrank(idx, code);
+    /* insert the additional photon in the sorted code */
+    int t = _n;
+    for(; t > 0 && (unsigned char)code[t-1]-'A' > m; t--)
+        code[t] = code[t-1];
+    code[t] = char('A'+m);
+    return _pfsa_current->rank(code);
+}
+
+template<typename S, typename F>
+void fs_map::_for_each_transition(unsigned long long from, unsigned long long to, S skip, F f) const {
+    if (from >= to)
+        return;
+    if (!_implicit) {
+        for(unsigned long long i=from; i < to; i++) {
+            if (skip(i))
+                continue;
+            for(int j=0; j<_m; j++) {
+                unsigned long long idx = get_nc(i, j);
+                if (idx != fs_npos)
+                    f(i, j, idx);
+            }
+        }
+        return;
+    }
+    /* parent states are enumerated in order from the first one, instead of being unranked one by one */
+    std::vector<char> code(_n+1);
+    std::vector<unsigned long long> children(_m);
+    _pfsa_parent->unrank(from, code.data());
+    for(unsigned long long i=from; i < to; i++) {
+        if (!skip(i)) {
+            _implicit_children(code.data(), children.data());
+            for(int j=0; j<_m; j++)
+                if (children[j] != fs_npos)
+                    f(i, j, children[j]);
+        }
+        _pfsa_parent->next_state(code.data());
+    }
+}
+
 void fs_map::compute_slos_layer(const std::complex<double> *p_u,
                                 int m,
                                 int mk,
                                 std::complex<double> *p_coefs, unsigned long n_coefs,
                                 const std::complex<double> *p_parent_coefs, unsigned long n_parent_coefs) const {
     memset((void*)p_coefs, 0, n_coefs*sizeof(std::complex<double>));
-    for(unsigned long i=0; i < n_parent_coefs; i++)
-        for(int j=0; j<m; j++) {
-            unsigned long long idx = get_nc(i, j);
+    accumulate_slos_layer(p_u, m, mk, p_coefs, p_parent_coefs, 0, n_parent_coefs);
+}
+
+void fs_map::accumulate_slos_layer(const std::complex<double> *p_u,
+                                   int m,
+                                   int mk,
+                                   std::complex<double> *p_coefs,
+                                   const std::complex<double> *p_parent_coefs,
+                                   unsigned long long from, unsigned long long to) const {
+    _for_each_transition(from, to,
+                         [&](unsigned long long i) { return p_parent_coefs[i] == 0.; },
+                         [&](unsigned long long i, int j, unsigned long long idx) {
+                             p_coefs[idx] += p_parent_coefs[i] * p_u[j*m+mk];
+                         });
+}
+
+void fs_map::compute_slos_layer_sparse(const std::complex<double> *p_u,
+                                       int m,
+                                       int mk,
+                                       std::complex<double> *p_coefs, unsigned long n_coefs,
+                                       const std::complex<double> *p_parent_coefs,
+                                       const unsigned long long *p_parent_support, unsigned long n_parent_support,
+                                       std::vector<unsigned long long> &support) const {
+    std::vector<int> modes;
+    for(int j=0; j<m; j++)
+        if (p_u[j*m+mk] != 0.) modes.push_back(j);
+    /* implicit maps: the children of the support are computed once and used by both passes */
+    std::vector<unsigned long long> children;
+    if (_implicit) {
+        std::vector<char> code(_n+1);
+        children.resize(n_parent_support*_m);
+        for(unsigned long s=0; s < n_parent_support; s++) {
+            _pfsa_parent->unrank(p_parent_support[s], code.data());
+            _implicit_children(code.data(), children.data()+s*_m);
+        }
+    }
+    auto child = [&](unsigned long s, int j) {
+        return _implicit ? children[s*_m+j] : get_nc(p_parent_support[s], j);
+    };
+    /* first pass: mark and clear the reached coefficients */
+    std::vector<uint64_t> bitmap((n_coefs+63)/64);
+    for(unsigned long s=0; s < n_parent_support; s++) {
+        for(int j: modes) {
+            unsigned long long idx = child(s, j);
+            if (idx != fs_npos && !(bitmap[idx>>6] & (1ULL << (idx&63)))) {
+                bitmap[idx>>6] |= 1ULL << (idx&63);
+                p_coefs[idx] = 0;
+            }
+        }
+    }
+    /* second pass: accumulate */
+    for(unsigned long s=0; s < n_parent_support; s++) {
+        unsigned long long i = p_parent_support[s];
+        for(int j: modes) {
+            unsigned long long idx = child(s, j);
             if (idx != fs_npos)
                 p_coefs[idx] += p_parent_coefs[i] * p_u[j*m+mk];
         }
+    }
+    support.clear();
+    for(unsigned long long w=0; w < bitmap.size(); w++)
+        if (bitmap[w])
+            for(int b=0; b<64; b++)
+                if (bitmap[w] & (1ULL << b)) support.push_back((w<<6)+b);
+}
+
+void fs_map::compute_slos_layer_batch(const std::complex<double> *p_u_cols,
+                                      int batch,
+                                      std::complex<double> *p_coefs, unsigned long n_coefs,
+                                      const std::complex<double> *p_parent_coefs, unsigned long n_parent_coefs) const {
+    memset((void*)p_coefs, 0, n_coefs*batch*sizeof(std::complex<double>));
+    _for_each_transition(0, n_parent_coefs,
+                         [](unsigned long long) { return false; },
+                         [&](unsigned long long i, int j, unsigned long long idx) {
+                             multiply_add(p_coefs+idx*batch, p_parent_coefs+i*batch, p_u_cols+j*batch, batch);
+                         });
+}
+
+void fs_map::compute_slos_layer_gather(const std::complex<double> *p_u,
+                                       int m,
+                                       int mk,
+                                       std::complex<double> *p_coefs, unsigned long n_coefs,
+                                       const std::complex<double> *p_parent_coefs,
+                                       int n_threads) const {
+    generate(n_threads, true);
+    /* each current coefficient is only written by its own range */
+    parallel_ranges(n_coefs, n_threads, [&](unsigned long long from, unsigned long long to) {
+        for(unsigned long long k=from; k<to; k++) {
+            std::complex<double> c = 0;
+            for(unsigned long long r=_rev_offsets[k]; r<_rev_offsets[k+1]; r++)
+                if (_rev_parents[r] != fs_npos)
+                    c += p_parent_coefs[_rev_parents[r]] * p_u[_rev_modes[r]*m+mk];
+            p_coefs[k] = c;
+        }
+    });
+}
+
+void fs_map::compute_slos_layer_adjoint(const std::complex<double> *p_u,
+                                        int m,
+                                        int mk,
+                                        const std::complex<double> *p_coefs_adj,
+                                        const std::complex<double> *p_parent_coefs,
+                                        std::complex<double> *p_parent_adj, unsigned long n_parent_coefs,
+                                        std::complex<double> *p_u_adj) const {
+    /* c[idx] += parent[i]*U[j,mk] gives adj(parent[i]) += adj(c[idx])*conj(U[j,mk]) and
+     * adj(U[j,mk]) += adj(c[idx])*conj(parent[i]) - parent-major, so that each parent adjoint has a single writer */
+    std::vector<std::complex<double>> u_adj(m);
+    memset((void*)p_parent_adj, 0, n_parent_coefs*sizeof(std::complex<double>));
+    _for_each_transition(0, n_parent_coefs,
+                         [](unsigned long long) { return false; },
+                         [&](unsigned long long i, int j, unsigned long long idx) {
+                             p_parent_adj[i] += p_coefs_adj[idx] * std::conj(p_u[j*m+mk]);
+                             u_adj[j] += p_coefs_adj[idx] * std::conj(p_parent_coefs[i]);
+                         });
+    for(int j=0; j<m; j++)
+        p_u_adj[j*m+mk] += u_adj[j];
 }
@@ -23,10 +23,14 @@
 #ifndef FS_MAP_H
 #define FS_MAP_H
 
+#include <atomic>
 #include <complex>
 #include <iostream>
+#include <mutex>
+#include <vector>
 
 #include "fs_array.h"
+#include "mapped_file.h"
 
 /**
  * A Fock State map (fs-map) is used to map states with k-1 photons to states with k photons
@@ -42,9 +46,11 @@ class fs_map {
          * @param fsa_current the fs-array for the current layer (k photons)
          * @param fsa_parent the fs-array of the parent layer (k-1 photons)
          * @param generate if true, immediately generates the structure in memory
+         * @param implicit if true, the map is never stored: transitions are computed from the combinatorial ranks of
+         * the states - only available for unmasked fs-arrays
          * @throws std::out_of_range if it is not possible to find parent state associated to current state
          */
-        fs_map(const fs_array &fsa_current, const fs_array &fsa_parent, bool generate=false);
+        fs_map(const fs_array &fsa_current, const fs_array &fsa_parent, bool generate=false, bool implicit=false);
         /**
          * Delete a fs-map
          */
@@ -54,15 +60,23 @@ class fs_map {
          * @return the number of states
          */
         inline unsigned long long count() const { return _count; };
+        /**
+         * number of current states in the fs-map - is equivalent to `fsa_current.count()`
+         */
+        inline unsigned long long count_current() const { return _pfsa_current->count(); };
         /**
          * size of the parent map in memory - is `count()*_m*step` where step is the number of bytes necessary
          * to encode the index of a state in current layer
          * @return the number of states
          */
-        inline unsigned long long size() const { return _count * _m * _step; };
+        inline unsigned long long size() const { return _implicit ? 0 : _count * _m * _step; };
+        inline bool is_implicit() const { return _implicit; }
+        inline bool is_generated() const { return _generated.load(std::memory_order_acquire); }
         inline int get_m() const { return _m; };
         inline int get_n() const { return _n; };
         inline unsigned long long get_nc(unsigned long long idx, int m) const {
+            if (_implicit)
+                return _implicit_get(idx, m);
             unsigned char *ptr_pointer = _buffer + (idx * _m + m) * _step;
             int size_pointer = _step;
             unsigned long long idx_p1 = 0;
@@ -76,22 +90,176 @@ class fs_map {
             return idx_p1;
         }
         unsigned long long get(unsigned long long idx, int m) const;
-        void generate() const;
+        /**
+         * generate the structure in memory - current states are processed by disjoint ranges in parallel, and parent
+         * states are found by ranking (or by binary search for masked fs-arrays). Only the first call generates the
+         * structure, concurrent calls waiting for it to complete: once generated, the const API can be used
+         * concurrently - except `release` and `load` that must not be called while the map is in use
+         * @param n_threads number of threads, 0 to use all the available cores
+         * @param with_reverse if true, also generate the reverse index in the same pass
+         * @throws std::logic_error if the reverse index is requested on an implicit map
+         */
+        void generate(int n_threads=0, bool with_reverse=false) const;
+        /**
+         * reverse index (CSR): the predecessors of current state idx are the entries
+         * [reverse_offsets()[idx], reverse_offsets()[idx+1]) of `reverse_parents()` (parent index) and
+         * `reverse_modes()` (mode of the added photon) - a state has one predecessor per occupied mode.
+         * These are nullptr until the map is generated `with_reverse`
+         */
+        inline const unsigned long long *reverse_offsets() const { return _rev_offsets; }
+        inline const unsigned long long *reverse_parents() const { return _rev_parents; }
+        inline const unsigned char *reverse_modes() const { return _rev_modes; }
+        inline bool has_reverse() const { return _reverse_generated.load(std::memory_order_acquire); }
+        /**
+         * release the in-memory structure - it will be generated again when needed
+         */
+        void release() const;
+        /**
+         * save the generated structure to a file - including the reverse index if generated
+         * @param filename the file path
+         * @throws std::runtime_error if the file cannot be written
+         */
+        void save(const std::string &filename) const;
+        /**
+         * generate the structure directly in a file, by chunks of parent states, so that the whole map is never held
+         * in memory - each chunk is written back once generated. The file is then mapped as by `load`, and can be
+         * loaded later on. The reverse index is not generated
+         * @param filename the file path
+         * @param chunk number of parent states generated per chunk
+         * @param n_threads number of threads, 0 to use all the available cores
+         * @throws std::runtime_error if the file cannot be written
+         */
+        void generate_file(const std::string &filename, unsigned long long chunk=1<<20, int n_threads=0) const;
+        /**
+         * load the structure from a file written by `save` - the file is mapped in memory and is only read
+         * from disk when accessed
+         * @param filename the file path
+         * @throws std::runtime_error if the file cannot be read, or std::invalid_argument if it does not match the map -
+         * the file records the masks, caps and no-bunching flags of both fs-arrays, which must be the same
+         */
+        void load(const std::string &filename) const;
+        /**
+         * advise that map entries of parent states [from, to) will be accessed soon (`will_need`) or will
+         * not be accessed anymore - only effective on a loaded map
+         */
+        void advise(unsigned long long from, unsigned long long to, bool will_need) const;
+        /**
+         * read the map entries of parent states [from, to) from the file, blocking until they are in memory - only
+         * effective on a loaded map
+         */
+        void prefetch(unsigned long long from, unsigned long long to) const;
+        /**
+         * true if the map is backed by a file, after `load` or `generate_file`
+         */
+        inline bool is_mapped() const { return _p_file != nullptr; }
 
         void compute_slos_layer(const std::complex<double> *p_u,
                                 int m,
                                 int mk,
                                 std::complex<double> *p_coefs, unsigned long n_coefs,
                                 const std::complex<double> *p_parent_coefs, unsigned long n_parent_coefs) const;
+        /**
+         * accumulate in p_coefs the contributions of parent coefficients [from, to) - p_coefs is not cleared, so that
+         * a layer can be computed by chunks of parent states
+         */
+        void accumulate_slos_layer(const std::complex<double> *p_u,
+                                   int m,
+                                   int mk,
+                                   std::complex<double> *p_coefs,
+                                   const std::complex<double> *p_parent_coefs,
+                                   unsigned long long from, unsigned long long to) const;
+        /**
+         * sparse version of compute_slos_layer: only the parent coefficients listed in the parent support are
+         * propagated, and only through the modes with a non-zero unitary element
+         * @param p_parent_support sorted indexes of the non-zero parent coefficients
+         * @param n_parent_support number of indexes in the parent support
+         * @param support filled with the sorted indexes of the current coefficients reached from the parent support,
+         * only these coefficients are written in p_coefs - the others are left untouched
+         */
+        void compute_slos_layer_sparse(const std::complex<double> *p_u,
+                                       int m,
+                                       int mk,
+                                       std::complex<double> *p_coefs, unsigned long n_coefs,
+                                       const std::complex<double> *p_parent_coefs,
+                                       const unsigned long long *p_parent_support, unsigned long n_parent_support,
+                                       std::vector<unsigned long long> &support) const;
+        /**
+         * batched version of compute_slos_layer: propagates `batch` coefficient vectors at once, each of them
+         * with its own input mode. Coefficient blocks are stored state-major: coefficient of input b for state i is
+         * at `i*batch+b` so that each map lookup is shared by the `batch` inputs
+         * @param p_u_cols the unitary columns used by each input: `p_u_cols[j*batch+b]` is `U[j, mk_b]`
+         * @param batch number of inputs
+         */
+        void compute_slos_layer_batch(const std::complex<double> *p_u_cols,
+                                      int batch,
+                                      std::complex<double> *p_coefs, unsigned long n_coefs,
+                                      const std::complex<double> *p_parent_coefs, unsigned long n_parent_coefs) const;
+        /**
+         * gather version of compute_slos_layer: each current coefficient is computed from its predecessors through the
+         * reverse index - generated if needed - so that disjoint ranges of current states are computed in parallel
+         * @param n_threads number of threads, 0 to use all the available cores
+         */
+        void compute_slos_layer_gather(const std::complex<double> *p_u,
+                                       int m,
+                                       int mk,
+                                       std::complex<double> *p_coefs, unsigned long n_coefs,
+                                       const std::complex<double> *p_parent_coefs,
+                                       int n_threads=1) const;
+        /**
+         * adjoint of compute_slos_layer: given the adjoints of the current coefficients (dL/dRe c + i.dL/dIm c for a
+         * real function L), computes the adjoints of the parent coefficients and accumulates the adjoints of the
+         * unitary elements of column mk
+         * @param p_coefs_adj adjoints of the current coefficients
+         * @param p_parent_coefs parent coefficients of the forward propagation
+         * @param p_parent_adj output buffer of the `n_parent_coefs` parent adjoints
+         * @param p_u_adj the m*m unitary adjoints, column mk is incremented
+         */
+        void compute_slos_layer_adjoint(const std::complex<double> *p_u,
+                                        int m,
+                                        int mk,
+                                        const std::complex<double> *p_coefs_adj,
+                                        const std::complex<double> *p_parent_coefs,
+                                        std::complex<double> *p_parent_adj, unsigned long n_parent_coefs,
+                                        std::complex<double> *p_u_adj) const;
 
     private:
+        /* hash of the restrictions - masks, caps, no-bunching - of the current and parent fs-arrays */
+        unsigned long long _fingerprint() const;
+        /* release without locking */
+        void _release() const;
+        /* fill the map cells reached from the current states [from, to) */
+        void _generate_range(unsigned long long from, unsigned long long to, bool forward, bool reverse) const;
+        /* fill the map cells of the parent states [from, to) in buffer - the cells of parent state i starting at
+         * buffer+(i-from)*m*step */
+        void _generate_parents(unsigned char *buffer, unsigned long long from, unsigned long long to) const;
+        /* parent indexes of the n+1 states obtained by removing each photon of a current state code */
+        void _parent_ranks(const char *code, unsigned long long *A, unsigned long long *B,
+                           unsigned long long *p_parents) const;
+        unsigned long long _implicit_get(unsigned long long idx, int m) const;
+        /* indexes of the m children of a parent state given its code - for implicit maps */
+        void _implicit_children(const char *parent_code, unsigned long long *p_children) const;
+        /* call f(i, j, idx) for each transition from the parent states [from, to) not skipped by skip(i) */
+        template<typename S, typename F>
+        void _for_each_transition(unsigned long long from, unsigned long long to, S skip, F f) const;
         int _step;
         unsigned long long _count;
         int _m;
         int _n;
         mutable unsigned char *_buffer;
+        mutable mapped_file *_p_file;
         const fs_array *_pfsa_current;
         const fs_array *_pfsa_parent;
+        bool _implicit;
+        mutable unsigned long long *_rev_offsets;
+        mutable unsigned long long *_rev_parents;
+        mutable unsigned char *_rev_modes;
+        /* true if the reverse index is mapped from the file - it is allocated otherwise, even on a loaded map */
+        mutable bool _reverse_mapped;
+        /* set once the map (resp. the reverse index) is available - checked without locking, _generate_mutex
+         * serializing generate, release and load */
+        mutable std::atomic<bool> _generated;
+        mutable std::atomic<bool> _reverse_generated;
+        mutable std::mutex _generate_mutex;
 };
 
 #endif
@@ -20,22 +20,266 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "fs_mask.h"
+#include "fs_array.h"
 
 fs_mask::fs_mask(int m, int n):_m(m),_n(n) {
+    _compile();
 }
 
 fs_mask::fs_mask(int m, int n, const std::string &condition):_m(m), _n(n) {
     _conditions.push_back(condition);
+    _compile();
 }
 
 fs_mask::fs_mask(int m, int n, std::list<std::string> conditions):_m(m), _n(n),
                                                                   _conditions(std::move(conditions)) {
+    _compile();
+}
+
+fs_mask::fs_mask(const fs_mask &fs):_m(fs._m), _n(fs._n), _conditions(fs._conditions), _stride(fs._stride),
+                                    _lower(fs._lower), _upper(fs._upper), _parity(fs._parity), _groups(fs._groups),
+                                    _extended(fs._extended) {}
+
+static int parse_number(const std::string &condition, size_t &pos) {
+    int value = -1;
+    while (pos < condition.size() && condition[pos] >= '0' && condition[pos] <= '9') {
+        value = (value < 0 ? 0 : value*10) + condition[pos++] - '0';
+        if (value > 255)
+            throw std::invalid_argument("invalid mask condition: occupancy larger than 255");
+    }
+    return value;
+}
+
+bool fs_mask::_parse_bounds(const std::string &condition, size_t &pos, int &lower, int &upper, int &parity) {
+    parity = 0;
+    if (condition[pos]>=0x30 && condition[pos]<0x50) {
+        lower = upper = condition[pos++] - 0x30;
+        return true;
+    }
+    if (condition[pos] != '[')
+        return false;
+    pos++;
+    int a = parse_number(condition, pos);
+    int b = a;
+    if (pos < condition.size() && condition[pos] == '-') {
+        pos++;
+        b = parse_number(condition, pos);
+    }
+    lower = a < 0 ? 0 : a;
+    upper = b < 0 ? 255 : b;
+    if (pos < condition.size() && (condition[pos] == 'e' || condition[pos] == 'o'))
+        parity = condition[pos++] == 'e' ? 1 : 2;
+    if (pos >= condition.size() || condition[pos] != ']' || lower > upper)
+        throw std::invalid_argument("invalid mask condition: " + condition);
+    pos++;
+    return true;
+}
+
+void fs_mask::_compile() {
+    _stride = (_m + 15) & ~15;
+    size_t n_conditions = _conditions.size();
+    _lower.assign(n_conditions*_stride, 0);
+    _upper.assign(n_conditions*_stride, 0xff);
+    _parity.assign(n_conditions*_stride, 0);
+    _groups.assign(n_conditions, std::vector<group>());
+    _extended.assign(n_conditions, false);
+    size_t c = 0;
+    for(const std::string &condition: _conditions) {
+        size_t pos = 0;
+        int lower, upper, parity;
+        for(int i=0; i<_m && pos<condition.size(); i++) {
+            if (_parse_bounds(condition, pos, lower, upper, parity)) {
+                _lower[c*_stride+i] = lower;
+                _upper[c*_stride+i] = upper;
+                _parity[c*_stride+i] = parity;
+                if (parity)
+                    _extended[c] = true;
+            } else
+                pos++;
+        }
+        /* group constraints - any other trailing code is reserved */
+        while (pos < condition.size() && condition[pos] == '(') {
+            if (pos+_m+2 > condition.size() || condition[pos+_m+1] != ')')
+                throw std::invalid_argument("invalid mask condition: " + condition);
+            group g;
+            for(int i=0; i<_m; i++)
+                if (condition[pos+1+i] != ' ' && condition[pos+1+i] != '.')
+                    g.modes.push_back(i);
+            pos += _m+2;
+            if (pos >= condition.size() || !_parse_bounds(condition, pos, g.lower, g.upper, parity) || parity)
+                throw std::invalid_argument("invalid mask condition: " + condition);
+            _groups[c].push_back(g);
+            _extended[c] = true;
+        }
+        c++;
+    }
 }
 
-fs_mask::fs_mask(const fs_mask &fs):_m(fs._m), _n(fs._n), _conditions(fs._conditions) {}
+void fs_mask::_occupancies(const char *code, int n, unsigned char *p_occupancies) const {
+    memset(p_occupancies, 0, _stride);
+    for(int k=0; k<n; k++) {
+        unsigned char &o = p_occupancies[(unsigned char)code[k]-'A'];
+        if (o != 0xff) o++;
+    }
+}
+
+bool fs_mask::_match_occupancies(const unsigned char *p_occupancies, int allowed_errors) const {
+    /**
+     * a condition is matched if no mode exceeds its upper bound, and if the photons missing to reach the lower
+     * bounds do not exceed allowed_errors
+     **/
+    const unsigned char *p_lower = _lower.data();
+    const unsigned char *p_upper = _upper.data();
+    for(size_t c=0; c<_conditions.size(); c++, p_lower+=_stride, p_upper+=_stride) {
+        int missing = 0;
+        bool exceeds = false;
+        int i = 0;
+#ifdef __SSE2__
+        for(; i<_stride; i+=16) {
+            __m128i occ = _mm_loadu_si128((const __m128i *)(p_occupancies+i));
+            __m128i upper = _mm_loadu_si128((const __m128i *)(p_upper+i));
+            __m128i lower = _mm_loadu_si128((const __m128i *)(p_lower+i));
+            /* occ <= upper <=> max(occ, upper) == upper */
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(occ, upper), upper)) != 0xffff) {
+                exceeds = true;
+                break;
+            }
+            __m128i sad = _mm_sad_epu8(_mm_subs_epu8(lower, occ), _mm_setzero_si128());
+            missing += _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+        }
+#endif
+        for(; !exceeds && i<_m; i++) {
+            if (p_occupancies[i] > p_upper[i])
+                exceeds = true;
+            else if (p_occupancies[i] < p_lower[i])
+                missing += p_lower[i] - p_occupancies[i];
+        }
+        if (exceeds || missing > allowed_errors) continue;
+        if (_extended[c] && !_match_extended(c, p_occupancies, allowed_errors)) continue;
+        return true;
+    }
+    return false;
+}
+
+void fs_mask::_check_compatible(const fs_mask &mask) const {
+    if (mask._m != _m || mask._n != _n)
+        throw std::invalid_argument("masks do not have the same m and n");
+}
+
+/* occupancy token of compiled bounds */
+static std::string bounds_token(int lower, int upper, int parity) {
+    if (lower == 0 && upper == 0xff && !parity)
+        return " ";
+    if (lower == upper && lower < 0x20 && !parity)
+        return std::string(1, char(0x30+lower));
+    std::string token = "[" + std::to_string(lower) + "-" + (upper == 0xff ? "" : std::to_string(upper));
+    if (parity)
+        token += parity == 1 ? 'e' : 'o';
+    return token + "]";
+}
+
+fs_mask fs_mask::operator&(const fs_mask &mask) const {
+    _check_compatible(mask);
+    if (_conditions.empty())
+        return mask;
+    if (mask._conditions.empty())
+        return *this;
+    std::list<std::string> conditions;
+    for(size_t c=0; c<_conditions.size(); c++)
+        for(size_t d=0; d<mask._conditions.size(); d++) {
+            std::string condition;
+            bool feasible = true;
+            for(int i=0; i<_m && feasible; i++) {
+                size_t a = c*_stride+i, b = d*mask._stride+i;
+                int lower = std::max(_lower[a], mask._lower[b]);
+                int upper = std::min(_upper[a], mask._upper[b]);
+                int parity = _parity[a] ? _parity[a] : mask._parity[b];
+                if (_parity[a] && mask._parity[b] && _parity[a] != mask._parity[b])
+                    feasible = false;
+                /* the range must hold an occupancy of the right parity */
+                if (parity && (lower & 1) != parity-1)
+                    lower++;
+                if (lower > upper)
+                    feasible = false;
+                condition += bounds_token(lower, upper, parity);
+            }
+            if (!feasible)
+                continue;
+            for(const std::vector<group> *p_groups: {&_groups[c], &mask._groups[d]})
+                for(const group &g: *p_groups) {
+                    std::string selector(_m, ' ');
+                    for(int i: g.modes)
+                        selector[i] = 'x';
+                    condition += "(" + selector + ")[" + std::to_string(g.lower) + "-"
+                                 + (g.upper == 0xff ? "" : std::to_string(g.upper)) + "]";
+                }
+            conditions.push_back(condition);
+        }
+    /* no condition would match all the states: an odd number of photons in [0, 0] matches none */
+    if (conditions.empty())
+        conditions.push_back("[0o]" + std::string(_m-1, ' '));
+    return fs_mask(_m, _n, conditions);
+}
+
+fs_mask fs_mask::operator|(const fs_mask &mask) const {
+    _check_compatible(mask);
+    if (_conditions.empty() || mask._conditions.empty())
+        return fs_mask(_m, _n);
+    std::list<std::string> conditions(_conditions);
+    conditions.insert(conditions.end(), mask._conditions.begin(), mask._conditions.end());
+    return fs_mask(_m, _n, conditions);
+}
+
+int fs_mask::_deficit(size_t c, int i, int occupancy) const {
+    size_t idx = c*_stride+i;
+    if (occupancy > _upper[idx])
+        return -1;
+    int target = std::max(occupancy, (int)_lower[idx]);
+    if (_parity[idx] && (target & 1) != _parity[idx]-1)
+        target++;
+    if (target > _upper[idx])
+        return -1;
+    return target-occupancy;
+}
+
+bool fs_mask::_match_extended(size_t c, const unsigned char *p_occupancies, int allowed_errors) const {
+    /* the missing photons are bounded below by the deficits of the modes, completed by the deficit of the
+     * group that needs the most additional photons - the bound being exact for complete states */
+    int missing = 0;
+    for(int i=0; i<_m; i++) {
+        int d = _deficit(c, i, p_occupancies[i]);
+        if (d < 0)
+            return false;
+        missing += d;
+    }
+    int group_missing = 0;
+    for(const group &g: _groups[c]) {
+        int total = 0, deficits = 0;
+        for(int i: g.modes) {
+            total += p_occupancies[i];
+            deficits += _deficit(c, i, p_occupancies[i]);
+        }
+        if (total > g.upper)
+            return false;
+        group_missing = std::max(group_missing, g.lower-total-deficits);
+    }
+    return missing+group_missing <= allowed_errors;
+}
 
 bool fs_mask::match(const fockstate &fs, bool allow_missing) const {
+    return match_code(fs.get_code(), fs.get_n(), allow_missing);
+}
+
+bool fs_mask::match_code(const char *code, int n, bool allow_missing) const {
     /**
      * we match a fockstate if there are no conditions, or if one of the conditions match
      * if allow_missing is True, number of errors cannot exceed missing
@@ -44,20 +288,145 @@ bool fs_mask::match(const fockstate &fs, bool allow_missing) const {
      **/
     if (_conditions.empty())
         return true;
-    for(const std::string &c: _conditions) {
-        int allowed_errors=0;
-        if (allow_missing)
-            allowed_errors = _n-fs.get_n();
-        for(int i=0; allowed_errors>=0 && i<_m; i++) {
-            if (c[i]>=0x30 && c[i]<0x50) {
-                /* there cannot be extraneous photons */
-                if (fs[i] > (c[i] - 0x30))
-                    allowed_errors = -1;
-                else
-                    allowed_errors -= c[i] - 0x30 - fs[i];
+    int allowed_errors = allow_missing ? _n-n : 0;
+    if (allowed_errors < 0)
+        return false;
+    unsigned char local[256];
+    std::vector<unsigned char> occupancies;
+    unsigned char *p_occupancies = local;
+    if (_stride > 256) {
+        occupancies.resize(_stride);
+        p_occupancies = occupancies.data();
+    }
+    _occupancies(code, n, p_occupancies);
+    return _match_occupancies(p_occupancies, allowed_errors);
+}
+
+void fs_mask::match_many(const char *codes, unsigned long long count, int n, bool *p_match,
+                         bool allow_missing) const {
+    int allowed_errors = allow_missing ? _n-n : 0;
+    if (_conditions.empty() || allowed_errors < 0) {
+        for(unsigned long long k=0; k<count; k++)
+            p_match[k] = _conditions.empty();
+        return;
+    }
+    std::vector<unsigned char> occupancies(_stride);
+    for(unsigned long long k=0; k<count; k++, codes+=n) {
+        _occupancies(codes, n, occupancies.data());
+        p_match[k] = _match_occupancies(occupancies.data(), allowed_errors);
+    }
+}
+
+/* depth-first assignment of the mode occupancies in lexicographic order of the codes - i.e. decreasing occupancy of
+ * the first modes - keeping for each condition the lower bound of its missing photons, and the totals of its groups */
+class fs_mask_enumeration {
+public:
+    fs_mask_enumeration(const fs_mask &mask, int n, char *p_codes): _mask(mask), _m(mask._m), _n(n),
+                                                                    _allowed(mask._n-n), _p_codes(p_codes),
+                                                                    _count(0) {
+        _n_conditions = (int)mask._conditions.size();
+        _occupancies.assign(mask._stride, 0);
+        _code.assign(n+1, 0);
+        _alive.assign((_m+1)*_n_conditions, 0);
+        _missing.assign((_m+1)*_n_conditions, 0);
+        /* capacity of the modes [i, m) of each condition */
+        _capacity.assign((_m+1)*_n_conditions, 0);
+        for(int c=0; c<_n_conditions; c++) {
+            _alive[c] = 1;
+            for(int i=_m-1; i>=0; i--)
+                _capacity[i*_n_conditions+c] = std::min(_capacity[(i+1)*_n_conditions+c]
+                                                        + mask._upper[c*mask._stride+i], n+1);
+        }
+        _mode_groups.resize(_m);
+        _group_totals.resize(_n_conditions);
+        for(int c=0; c<_n_conditions; c++) {
+            _group_totals[c].assign(mask._groups[c].size(), 0);
+            for(size_t g=0; g<mask._groups[c].size(); g++)
+                for(int i: mask._groups[c][g].modes)
+                    _mode_groups[i].push_back(std::make_pair(c, (int)g));
+        }
+    }
+    unsigned long long run() {
+        if (_allowed >= 0 && _m > 0)
+            _assign(0, _n, 0);
+        return _count;
+    }
+private:
+    void _assign(int i, int remaining, int pos) {
+        const int C = _n_conditions;
+        const char *alive = _alive.data()+i*C;
+        char *next_alive = _alive.data()+(i+1)*C;
+        const int *missing = _missing.data()+i*C;
+        int *next_missing = _missing.data()+(i+1)*C;
+        int max_occupancy = 0;
+        for(int c=0; c<C; c++)
+            if (alive[c])
+                max_occupancy = std::max(max_occupancy, (int)_mask._upper[c*_mask._stride+i]);
+        max_occupancy = std::min(max_occupancy, remaining);
+        int min_occupancy = i == _m-1 ? remaining : 0;
+        for(int occupancy=max_occupancy; occupancy>=min_occupancy; occupancy--) {
+            bool any = false;
+            for(int c=0; c<C; c++) {
+                next_alive[c] = 0;
+                if (!alive[c] || remaining-occupancy > _capacity[(i+1)*C+c])
+                    continue;
+                int d = _mask._deficit(c, i, occupancy);
+                if (d < 0 || missing[c]+d > _allowed)
+                    continue;
+                next_missing[c] = missing[c]+d;
+                next_alive[c] = 1;
+                any = true;
+            }
+            for(auto &cg: _mode_groups[i])
+                if (next_alive[cg.first] &&
+                    _group_totals[cg.first][cg.second]+occupancy > _mask._groups[cg.first][cg.second].upper)
+                    next_alive[cg.first] = 0;
+            if (!any)
+                continue;
+            _occupancies[i] = (unsigned char)std::min(occupancy, 255);
+            for(int k=0; k<occupancy; k++)
+                _code[pos+k] = char('A'+i);
+            if (i == _m-1) {
+                if (_mask._match_occupancies(_occupancies.data(), _allowed)) {
+                    if (_p_codes)
+                        memcpy(_p_codes+_count*_n, _code.data(), _n);
+                    _count++;
+                }
+            } else {
+                for(auto &cg: _mode_groups[i])
+                    _group_totals[cg.first][cg.second] += occupancy;
+                _assign(i+1, remaining-occupancy, pos+occupancy);
+                for(auto &cg: _mode_groups[i])
+                    _group_totals[cg.first][cg.second] -= occupancy;
             }
         }
-        if (allowed_errors>=0) return true;
+        _occupancies[i] = 0;
     }
-    return false;
+    const fs_mask &_mask;
+    int _m;
+    int _n;
+    int _allowed;
+    char *_p_codes;
+    unsigned long long _count;
+    int _n_conditions;
+    std::vector<unsigned char> _occupancies;
+    std::vector<char> _code;
+    /* state of the conditions once modes [0, i) are assigned, at [i*conditions+c] */
+    std::vector<char> _alive;
+    std::vector<int> _missing;
+    std::vector<int> _capacity;
+    std::vector<std::vector<std::pair<int, int>>> _mode_groups;
+    std::vector<std::vector<int>> _group_totals;
+};
+
+unsigned long long fs_mask::enumerate(int n, char *p_codes) const {
+    if (!_conditions.empty())
+        return fs_mask_enumeration(*this, n, p_codes).run();
+    /* without condition, all the states match */
+    if (p_codes)
+        return fs_enumerator(_m, n).next_block(p_codes, std::numeric_limits<size_t>::max());
+    unsigned long long count = 1;
+    for(int k=1; k<=n; k++)
+        count = count*(_m+k-1)/k;
+    return count;
 }
@@ -25,6 +25,7 @@
 
 #include <list>
 #include <string>
+#include <vector>
 
 #include "fockstate.h"
 
@@ -33,14 +34,22 @@
  * This is important to avoid combinatorial explosion of the memory structure when working
  * on identified subsets - for instance because of heralding conditions.
  * fs_mask are defined by list of inclusive conditions (OR) - each of them represented as a string C
- * of length m with following conventions:
+ * made of one token per mode (m tokens) with following conventions:
  *   - C[i] cannot take ',' or \x00 value - these characters are use for constructor
- *   - C[i] == ' ' if there is no constraint on mode i
- *   - C[i] == [0x30-0x50] if there are exactly ord(C[i])-48 photon in mode i (up to 32 photons)
+ *   - ' ' if there is no constraint on the mode
+ *   - [0x30-0x50] if there are exactly ord(C[i])-48 photon in the mode (up to 32 photons)
+ *   - "[a-b]", "[a-]", "[-b]" or "[a]": between a and b photons, at least a, at most b or exactly a photons, a and b
+ *     being decimal numbers - optionally followed by 'e' or 'o' for an even or odd number of photons: "[e]", "[1-5o]"
  *   - other codes are reserved for further usage
+ *  The mode tokens can be followed by group constraints on the total number of photons in a group of modes:
+ *  '(' followed by a selector of m characters - ' ' or '.' for modes outside of the group - ')' and an occupancy
+ *  token, for instance "    (xx  )[1-]" for at least one photon in modes 0 and 1 of a 4-mode state.
  *  A mask is defined for a given number of photons (n) - if the fockstate is not fully populated
  *  with n-photons then the mask can apply as long as the number of expected errors is not higher
  *  than the differences of photon count
+ * Conditions are compiled at construction into vectors of lower and upper occupancy bounds per mode, so that a state
+ * is matched from its occupancy vector in O(conditions.m) - and batches of states with SIMD compares. The bounds also
+ * prune the constructive enumeration of the matching states used to count and generate masked fs-arrays.
  */
 class fs_mask {
 public:
@@ -56,6 +65,7 @@ public:
      *
      * @param m number of modes on which the mask apply
      * @param conditions a list of string conditions
+     * @throws std::invalid_argument if a condition is malformed
      */
     fs_mask(int m, int n, const std::string &condition);
     /**
@@ -69,6 +79,23 @@ public:
      * copy constructor
      */
     fs_mask(const fs_mask &fs);
+    /**
+     * intersection of two masks: the states matching both masks - conditions are combined pairwise, intersecting
+     * their occupancy bounds and gathering their group constraints
+     *
+     * @throws std::invalid_argument if the masks do not have the same m and n
+     */
+    fs_mask operator&(const fs_mask &mask) const;
+    /**
+     * union of two masks: the states matching any of the masks
+     *
+     * @throws std::invalid_argument if the masks do not have the same m and n
+     */
+    fs_mask operator|(const fs_mask &mask) const;
+    /**
+     * the conditions of the mask
+     */
+    inline const std::list<std::string> &conditions() const { return _conditions; }
     /**
      * test if mask match a specific fockstate
      *
@@ -77,10 +104,63 @@ public:
      * @return boolean result of the match
      */
     bool match(const fockstate &fs, bool allow_missing=true) const;
+    /**
+     * test if mask match a state given by its code
+     *
+     * @param code the n sorted mode characters of the state
+     * @param n number of photons of the state
+     * @param allow_missing allow missing photons
+     * @return boolean result of the match
+     */
+    bool match_code(const char *code, int n, bool allow_missing=true) const;
+    /**
+     * batch match of consecutive state codes - typically a fs-array buffer
+     *
+     * @param codes the count*n characters of the state codes
+     * @param count number of states
+     * @param n number of photons of the states
+     * @param p_match output buffer of the count results
+     * @param allow_missing allow missing photons
+     */
+    void match_many(const char *codes, unsigned long long count, int n, bool *p_match, bool allow_missing=true) const;
+    /**
+     * constructive enumeration of the states matching the mask in lexicographic order (missing photons allowed):
+     * occupancies are assigned mode by mode, branches that cannot match any condition being pruned
+     *
+     * @param n number of photons of the states
+     * @param p_codes if not null, output buffer receiving the n characters of each matching state code
+     * @return the number of matching states
+     */
+    unsigned long long enumerate(int n, char *p_codes=nullptr) const;
 private:
+    friend class fs_mask_enumeration;
+    struct group {
+        std::vector<int> modes;
+        int lower;
+        int upper;
+    };
+    void _compile();
+    void _check_compatible(const fs_mask &mask) const;
+    /* parse an occupancy token at pos - returns false if it is not a bound token */
+    static bool _parse_bounds(const std::string &condition, size_t &pos, int &lower, int &upper, int &parity);
+    /* fill the occupancy vector (_stride bytes, saturated at 255) of a state code */
+    void _occupancies(const char *code, int n, unsigned char *p_occupancies) const;
+    bool _match_occupancies(const unsigned char *p_occupancies, int allowed_errors) const;
+    /* photons to add to mode i for condition c, -1 if the occupancy cannot match */
+    int _deficit(size_t c, int i, int occupancy) const;
+    bool _match_extended(size_t c, const unsigned char *p_occupancies, int allowed_errors) const;
     const int _m;
     const int _n;
     std::list<std::string> _conditions;
+    /* compiled conditions: occupancy bounds of condition c are [_lower[c*_stride+i], _upper[c*_stride+i]] - the
+     * vectors are padded to _stride, a multiple of 16, with [0, 255] */
+    int _stride;
+    std::vector<unsigned char> _lower;
+    std::vector<unsigned char> _upper;
+    /* extended constraints, checked after the bounds: parity of the modes (0: none, 1: even, 2: odd) and groups */
+    std::vector<unsigned char> _parity;
+    std::vector<std::vector<group>> _groups;
+    std::vector<bool> _extended;
 };
 
 #endif //QUANDELIBC_FS_MASK_H
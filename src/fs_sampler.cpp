@@ -0,0 +1,148 @@
+// MIT License
+//
+// Copyright (c) 2022 Quandela
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+
+#include "fs_sampler.h"
+#include "parallel_tools.h"
+
+/* number of samples drawn from each random stream */
+#define SAMPLES_PER_STREAM 65536
+
+fs_sampler::fs_sampler(const fs_array &fsa, const double *p_probabilities): _p_fsa(&fsa), _p_graded(nullptr),
+                                                                            _total(0) {
+    std::vector<double> probabilities(p_probabilities, p_probabilities+fsa.count());
+    _build(probabilities);
+}
+
+fs_sampler::fs_sampler(const fs_array &fsa, const std::complex<double> *p_amplitudes): _p_fsa(&fsa),
+                                                                                       _p_graded(nullptr),
+                                                                                       _total(0) {
+    _build(fsa.count(), p_amplitudes);
+}
+
+fs_sampler::fs_sampler(const fs_graded_array &graded, const double *p_probabilities): _p_fsa(nullptr),
+                                                                                      _p_graded(&graded),
+                                                                                      _total(0) {
+    std::vector<double> probabilities(p_probabilities, p_probabilities+graded.count());
+    _build(probabilities);
+}
+
+fs_sampler::fs_sampler(const fs_graded_array &graded, const std::complex<double> *p_amplitudes): _p_fsa(nullptr),
+                                                                                                 _p_graded(&graded),
+                                                                                                 _total(0) {
+    _build(graded.count(), p_amplitudes);
+}
+
+void fs_sampler::_build(unsigned long long count, const std::complex<double> *p_amplitudes) {
+    std::vector<double> probabilities(count);
+    parallel_ranges(count, 0, [&](unsigned long long from, unsigned long long to) {
+        for(unsigned long long i=from; i<to; i++)
+            probabilities[i] = std::norm(p_amplitudes[i]);
+    });
+    _build(probabilities);
+}
+
+void fs_sampler::_build(std::vector<double> &probabilities) {
+    unsigned long long count = probabilities.size();
+    for(double p: probabilities) {
+        if (p < 0)
+            throw std::invalid_argument("negative probability");
+        _total += p;
+    }
+    if (!(_total > 0))
+        throw std::invalid_argument("null distribution");
+    /* Vose alias method: probabilities are scaled to an average of 1, then each under-full cell is completed by
+     * an over-full one */
+    _threshold.resize(count);
+    _alias.resize(count);
+    std::vector<unsigned long long> small, large;
+    for(unsigned long long i=0; i<count; i++) {
+        probabilities[i] *= count/_total;
+        _alias[i] = i;
+        (probabilities[i] < 1 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        unsigned long long s = small.back(), l = large.back();
+        small.pop_back();
+        _threshold[s] = probabilities[s];
+        _alias[s] = l;
+        probabilities[l] -= 1-probabilities[s];
+        if (probabilities[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    /* remaining cells are full - up to rounding errors */
+    for(unsigned long long i: large)
+        _threshold[i] = 1;
+    for(unsigned long long i: small)
+        _threshold[i] = 1;
+}
+
+void fs_sampler::sample(unsigned long long n_samples, unsigned long long *p_indexes, unsigned long long seed,
+                        int n_threads) const {
+    unsigned long long count = _threshold.size();
+    unsigned long long n_streams = (n_samples+SAMPLES_PER_STREAM-1)/SAMPLES_PER_STREAM;
+    int threads = n_threads <= 0 ? (int)std::thread::hardware_concurrency() : n_threads;
+    if (threads < 1)
+        threads = 1;
+    if ((unsigned long long)threads > n_streams)
+        threads = n_streams ? (int)n_streams : 1;
+    /* streams are distributed over the threads - each stream is seeded from (seed, stream index) */
+    parallel_blocks(n_streams, threads, [&](int, unsigned long long from, unsigned long long to) {
+        for(unsigned long long stream=from; stream<to; stream++) {
+            std::seed_seq seq{(unsigned)(seed & 0xffffffff), (unsigned)(seed >> 32),
+                              (unsigned)(stream & 0xffffffff), (unsigned)(stream >> 32)};
+            std::mt19937_64 rng(seq);
+            std::uniform_int_distribution<unsigned long long> cell(0, count-1);
+            std::uniform_real_distribution<double> coin(0, 1);
+            unsigned long long end = std::min((stream+1)*SAMPLES_PER_STREAM, n_samples);
+            for(unsigned long long s=stream*SAMPLES_PER_STREAM; s<end; s++) {
+                unsigned long long i = cell(rng);
+                p_indexes[s] = coin(rng) < _threshold[i] ? i : _alias[i];
+            }
+        }
+    });
+}
+
+void fs_sampler::sample_occupancies(unsigned long long n_samples, int *p_occupancies, unsigned long long seed,
+                                    int n_threads) const {
+    std::vector<unsigned long long> indexes(n_samples);
+    sample(n_samples, indexes.data(), seed, n_threads);
+    int m = get_m();
+    if (_p_fsa)
+        _p_fsa->generate();
+    else
+        _p_graded->generate();
+    parallel_ranges(n_samples, n_threads, [&](unsigned long long from, unsigned long long to) {
+        for(unsigned long long s=from; s<to; s++) {
+            int *p_occupancy = p_occupancies+s*m;
+            std::fill(p_occupancy, p_occupancy+m, 0);
+            fockstate fs = _p_fsa ? (*_p_fsa)[indexes[s]] : (*_p_graded)[indexes[s]];
+            for(int k=0; k<fs.get_n(); k++)
+                p_occupancy[fs.photon2mode(k)]++;
+        }
+    });
+}
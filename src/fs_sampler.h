@@ -0,0 +1,92 @@
+// MIT License
+//
+// Copyright (c) 2022 Quandela
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef QUANDELIBC_FS_SAMPLER_H
+#define QUANDELIBC_FS_SAMPLER_H
+
+#include <complex>
+#include <vector>
+
+#include "fs_array.h"
+#include "fs_graded_array.h"
+
+/**
+ * Sampler of the states of a fs-array following a probability distribution - typically an output layer of SLOS.
+ * The distribution is stored as an alias table, so that each sample is drawn in constant time. Samples are drawn
+ * by blocks, each block having its own random stream, so that drawn samples only depend on the seed and not on
+ * the number of threads
+ */
+class fs_sampler {
+    public:
+        /**
+         * build the sampler from probabilities
+         * @param fsa the fs-array of the sampled states - it must outlive the sampler
+         * @param p_probabilities the `fsa.count()` probabilities of the states, not necessarily normalized
+         * @throws std::invalid_argument if a probability is negative or if they are all null
+         */
+        fs_sampler(const fs_array &fsa, const double *p_probabilities);
+        /**
+         * build the sampler from amplitudes - the probabilities being their squared magnitudes
+         * @param fsa the fs-array of the sampled states - it must outlive the sampler
+         * @param p_amplitudes the `fsa.count()` amplitudes of the states
+         */
+        fs_sampler(const fs_array &fsa, const std::complex<double> *p_amplitudes);
+        /**
+         * build the sampler over all the photon numbers of a graded fs-array - samples are global indexes
+         * @param graded the graded fs-array of the sampled states - it must outlive the sampler
+         * @param p_probabilities the `graded.count()` probabilities of the states, not necessarily normalized
+         */
+        fs_sampler(const fs_graded_array &graded, const double *p_probabilities);
+        fs_sampler(const fs_graded_array &graded, const std::complex<double> *p_amplitudes);
+        /**
+         * sum of the probabilities the sampler was built from
+         */
+        inline double total() const { return _total; }
+        inline int get_m() const { return _p_fsa ? _p_fsa->get_m() : _p_graded->get_m(); }
+        /**
+         * draw samples as fs-array indexes
+         * @param n_samples number of samples
+         * @param p_indexes output buffer of the `n_samples` indexes
+         * @param seed seed of the random streams
+         * @param n_threads number of threads, 0 to use all the available cores
+         */
+        void sample(unsigned long long n_samples, unsigned long long *p_indexes, unsigned long long seed,
+                    int n_threads=0) const;
+        /**
+         * draw samples as occupancy arrays
+         * @param p_occupancies output buffer of `n_samples*m` photon counts - sample s is in `[s*m, (s+1)*m)`
+         */
+        void sample_occupancies(unsigned long long n_samples, int *p_occupancies, unsigned long long seed,
+                                int n_threads=0) const;
+    private:
+        void _build(std::vector<double> &probabilities);
+        void _build(unsigned long long count, const std::complex<double> *p_amplitudes);
+        const fs_array *_p_fsa;
+        const fs_graded_array *_p_graded;
+        double _total;
+        /* alias table: state i is drawn with probability _threshold[i], its alias otherwise */
+        std::vector<double> _threshold;
+        std::vector<unsigned long long> _alias;
+};
+
+#endif //QUANDELIBC_FS_SAMPLER_H
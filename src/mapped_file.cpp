@@ -0,0 +1,150 @@
+// MIT License
+//
+// Copyright (c) 2022 Quandela
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mapped_file.h"
+
+#ifndef WIN32
+
+mapped_file::mapped_file(const std::string &filename, unsigned long long size, bool create):
+                                                                    _filename(filename), _data(nullptr),
+                                                                    _size(size), _writable(create), _fd(-1) {
+    _fd = create ? ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) : ::open(filename.c_str(), O_RDONLY);
+    if (_fd < 0)
+        throw std::runtime_error("cannot open file: " + filename);
+    if (create) {
+        if (::ftruncate(_fd, (off_t)size) != 0) {
+            ::close(_fd);
+            throw std::runtime_error("cannot allocate file: " + filename);
+        }
+    } else {
+        struct stat st;
+        if (::fstat(_fd, &st) != 0) {
+            ::close(_fd);
+            throw std::runtime_error("cannot stat file: " + filename);
+        }
+        _size = st.st_size;
+    }
+    if (!_size)
+        return;
+    void *p = ::mmap(nullptr, _size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, _fd, 0);
+    if (p == MAP_FAILED) {
+        ::close(_fd);
+        throw std::runtime_error("cannot map file: " + filename);
+    }
+    _data = (char *)p;
+}
+
+mapped_file::~mapped_file() {
+    if (_data)
+        ::munmap(_data, _size);
+    if (_fd >= 0)
+        ::close(_fd);
+}
+
+/* madvise requires page-aligned regions */
+static void page_align(unsigned long long &offset, unsigned long long &length) {
+    unsigned long long page = (unsigned long long)::sysconf(_SC_PAGESIZE);
+    unsigned long long start = offset - offset % page;
+    length += offset - start;
+    offset = start;
+}
+
+void mapped_file::will_need(unsigned long long offset, unsigned long long length) const {
+    if (!_data || offset >= _size) return;
+    if (offset + length > _size) length = _size - offset;
+    page_align(offset, length);
+    ::madvise(_data + offset, length, MADV_WILLNEED);
+}
+
+void mapped_file::dont_need(unsigned long long offset, unsigned long long length) const {
+    if (!_data || offset >= _size) return;
+    if (offset + length > _size) length = _size - offset;
+    page_align(offset, length);
+    /* start writing back the dirty pages before releasing them */
+    if (_writable)
+        ::msync(_data + offset, length, MS_ASYNC);
+    ::madvise(_data + offset, length, MADV_DONTNEED);
+}
+
+void mapped_file::prefetch(unsigned long long offset, unsigned long long length) const {
+    if (!_data || offset >= _size) return;
+    if (offset + length > _size) length = _size - offset;
+    page_align(offset, length);
+    ::madvise(_data + offset, length, MADV_WILLNEED);
+    /* touching one byte per page faults the pages in */
+    unsigned long long page = (unsigned long long)::sysconf(_SC_PAGESIZE);
+    volatile char sink = 0;
+    for(unsigned long long p=offset; p < offset+length; p += page)
+        sink = sink ^ _data[p];
+}
+
+#else // WIN32
+
+mapped_file::mapped_file(const std::string &filename, unsigned long long size, bool create):
+                                                                    _filename(filename), _data(nullptr),
+                                                                    _size(size), _writable(create), _fd(-1) {
+    if (create) {
+        std::ofstream f(filename, std::ios::binary | std::ios::trunc);
+        if (!f)
+            throw std::runtime_error("cannot open file: " + filename);
+        _data = new char[_size ? _size : 1];
+        memset(_data, 0, _size);
+    } else {
+        std::ifstream f(filename, std::ios::binary | std::ios::ate);
+        if (!f)
+            throw std::runtime_error("cannot open file: " + filename);
+        _size = f.tellg();
+        f.seekg(0);
+        _data = new char[_size ? _size : 1];
+        f.read(_data, _size);
+    }
+}
+
+mapped_file::~mapped_file() {
+    if (_writable) {
+        std::ofstream f(_filename, std::ios::binary | std::ios::trunc);
+        f.write(_data, _size);
+    }
+    delete [] _data;
+}
+
+void mapped_file::will_need(unsigned long long offset, unsigned long long length) const {
+}
+
+void mapped_file::dont_need(unsigned long long offset, unsigned long long length) const {
+}
+
+void mapped_file::prefetch(unsigned long long offset, unsigned long long length) const {
+}
+
+#endif // WIN32
@@ -0,0 +1,69 @@
+// MIT License
+//
+// Copyright (c) 2022 Quandela
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef QUANDELIBC_MAPPED_FILE_H
+#define QUANDELIBC_MAPPED_FILE_H
+
+#include <string>
+
+/**
+ * A file mapped in memory - used to back structures larger than the available memory
+ * On platforms without mmap, the file is read in memory and written back when the object is deleted
+ */
+class mapped_file {
+    public:
+        /**
+         * Map a file in memory
+         * @param filename the file path
+         * @param size if `create`, the size of the file to create, ignored otherwise
+         * @param create if true, create (or truncate) a zero-filled read-write file of `size` bytes,
+         * otherwise open an existing file read-only
+         * @throws std::runtime_error if the file cannot be opened or mapped
+         */
+        mapped_file(const std::string &filename, unsigned long long size, bool create);
+        ~mapped_file();
+        mapped_file(const mapped_file &) = delete;
+        mapped_file &operator=(const mapped_file &) = delete;
+        inline char *data() const { return _data; }
+        inline unsigned long long size() const { return _size; }
+        /**
+         * advise that a region will be accessed soon - the system can start reading it asynchronously
+         */
+        void will_need(unsigned long long offset, unsigned long long length) const;
+        /**
+         * advise that a region will not be accessed anymore - its pages can be written back and released
+         */
+        void dont_need(unsigned long long offset, unsigned long long length) const;
+        /**
+         * read the pages of a region so that they are in memory when accessed - blocks until they are read, and is
+         * meant to be called from a prefetch thread while another region is processed
+         */
+        void prefetch(unsigned long long offset, unsigned long long length) const;
+    private:
+        std::string _filename;
+        char *_data;
+        unsigned long long _size;
+        bool _writable;
+        int _fd;
+};
+
+#endif //QUANDELIBC_MAPPED_FILE_H
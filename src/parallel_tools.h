@@ -0,0 +1,65 @@
+// MIT License
+//
+// Copyright (c) 2022 Quandela
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef QUANDELIBC_PARALLEL_TOOLS_H
+#define QUANDELIBC_PARALLEL_TOOLS_H
+
+#include <thread>
+#include <vector>
+
+/* minimal number of states processed by each thread */
+#define MIN_STATES_PER_THREAD 4096
+
+/* number of threads used to process n states - n_threads=0 for all the available cores */
+inline int parallel_threads(unsigned long long n, int n_threads) {
+    if (n_threads <= 0)
+        n_threads = (int)std::thread::hardware_concurrency();
+    unsigned long long max_threads = n / MIN_STATES_PER_THREAD + 1;
+    if (n_threads < 1)
+        return 1;
+    if ((unsigned long long)n_threads > max_threads)
+        return (int)max_threads;
+    return n_threads;
+}
+
+/* call f(t, from, to) in parallel for each of the n_threads disjoint ranges splitting [0, n) */
+template<typename F>
+void parallel_blocks(unsigned long long n, int n_threads, F f) {
+    std::vector<std::thread> threads;
+    unsigned long long block_size = n / n_threads;
+    for(int t=1; t<n_threads; t++)
+        threads.emplace_back(f, t, t*block_size, t == n_threads-1 ? n : (t+1)*block_size);
+    f(0, 0, n_threads > 1 ? block_size : n);
+    for(auto &thread: threads)
+        thread.join();
+}
+
+/* call f(from, to) on disjoint ranges splitting [0, n) - one range per thread */
+template<typename F>
+void parallel_ranges(unsigned long long n, int n_threads, F f) {
+    parallel_blocks(n, parallel_threads(n, n_threads), [&f](int, unsigned long long from, unsigned long long to) {
+        f(from, to);
+    });
+}
+
+#endif //QUANDELIBC_PARALLEL_TOOLS_H
@@ -30,6 +30,10 @@
 #include "fs_array.h"
 #include "fs_map.h"
 #include "fs_mask.h"
+#include "fs_hierarchy.h"
+#include "fs_graded_array.h"
+#include "slos.h"
+#include "fs_sampler.h"
 
 #define STRINGIFY(x) #x
 #define MACRO_STRINGIFY(x) STRINGIFY(x)
@@ -125,11 +129,352 @@ void compute_slos_layer(const fs_map &fsm,
                            parent_coefs.data(), parent_coefs.shape()[0]);
 }
 
+void compute_slos_layer_gather(const fs_map &fsm,
+                               const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u,
+                               int m,
+                               int mk,
+                               py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &coefs,
+                               const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &parent_coefs,
+                               int n_threads) {
+    fsm.compute_slos_layer_gather(u.data(), m, mk, coefs.mutable_data(), coefs.shape()[0], parent_coefs.data(),
+                                  n_threads);
+}
+
+std::vector<std::pair<unsigned long long, int>> fs_map_parents(const fs_map &fsm, unsigned long long idx) {
+    if (idx >= fsm.count_current())
+        throw std::out_of_range("idx too large");
+    fsm.generate(0, true);
+    std::vector<std::pair<unsigned long long, int>> parents;
+    for(unsigned long long r=fsm.reverse_offsets()[idx]; r<fsm.reverse_offsets()[idx+1]; r++)
+        parents.emplace_back(fsm.reverse_parents()[r], fsm.reverse_modes()[r]);
+    return parents;
+}
+
+py::array_t<unsigned long long> fs_array_index_map(const fs_array &fsa, const fs_array &target, int n_threads) {
+    py::array_t<unsigned long long> indexes(fsa.count());
+    unsigned long long *p_indexes = indexes.mutable_data();
+    {
+        py::gil_scoped_release release;
+        fsa.index_map(target, p_indexes, n_threads);
+    }
+    return indexes;
+}
+
 void norm_coefs(const fs_array &fsa,
                 py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &coefs) {
     fsa.norm_coefs(coefs.mutable_data());
 }
 
+static void check_unitary(const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u, int m) {
+    if ( u.ndim()     != 2 )
+        throw std::runtime_error("Unitary should be 2-D NumPy array");
+    if ( u.shape()[0] != m || u.shape()[1] != m )
+        throw std::runtime_error("Unitary should have size [m,m]");
+}
+
+py::array slos_engine_compute(const slos &engine,
+                              const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u,
+                              const fockstate &input,
+                              bool probabilities) {
+    check_unitary(u, engine.get_m());
+    if (probabilities) {
+        py::array_t<double> output(engine.count());
+        double *p_out = output.mutable_data();
+        {
+            py::gil_scoped_release release;
+            engine.compute_probabilities(u.data(), input, p_out);
+        }
+        return output;
+    }
+    py::array_t<std::complex<double>> output(engine.count());
+    std::complex<double> *p_out = output.mutable_data();
+    {
+        py::gil_scoped_release release;
+        engine.compute(u.data(), input, p_out);
+    }
+    return output;
+}
+
+py::array slos_engine_compute_batch(const slos &engine,
+                                    const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u,
+                                    const std::vector<fockstate> &inputs,
+                                    bool probabilities) {
+    check_unitary(u, engine.get_m());
+    std::vector<size_t> shape{(size_t)engine.count(), inputs.size()};
+    py::array_t<std::complex<double>> output(shape);
+    std::complex<double> *p_out = output.mutable_data();
+    {
+        py::gil_scoped_release release;
+        engine.compute_batch(u.data(), inputs, p_out);
+    }
+    if (probabilities) {
+        py::array_t<double> probs(shape);
+        double *p_probs = probs.mutable_data();
+        for(size_t i=0; i<shape[0]*shape[1]; i++)
+            p_probs[i] = std::norm(p_out[i]);
+        return probs;
+    }
+    return output;
+}
+
+py::array_t<std::complex<double>> slos_engine_compute_shared(
+                                    const slos &engine,
+                                    const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u,
+                                    const std::vector<fockstate> &inputs,
+                                    unsigned long long memory_budget) {
+    check_unitary(u, engine.get_m());
+    std::vector<size_t> shape{inputs.size(), (size_t)engine.count()};
+    py::array_t<std::complex<double>> output(shape);
+    std::complex<double> *p_out = output.mutable_data();
+    {
+        py::gil_scoped_release release;
+        engine.compute_shared(u.data(), inputs, p_out, memory_budget);
+    }
+    return output;
+}
+
+py::object slos_engine_compute_sweep(const slos &engine,
+                                     const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &us,
+                                     const fockstate &input,
+                                     const py::object &callback,
+                                     int stream_block) {
+    int m = engine.get_m();
+    if ( us.ndim()     != 3 )
+        throw std::runtime_error("Unitaries should be 3-D NumPy array");
+    if ( us.shape()[1] != m || us.shape()[2] != m )
+        throw std::runtime_error("Unitaries should have size [K,m,m]");
+    int n_unitaries = (int)us.shape()[0];
+    size_t count = engine.count();
+    if (callback.is_none()) {
+        py::array_t<double> output(std::vector<size_t>{(size_t)n_unitaries, count});
+        double *p_out = output.mutable_data();
+        py::gil_scoped_release release;
+        engine.compute_sweep(us.data(), n_unitaries, input, [p_out, count](int q, const double *p_probs) {
+            memcpy(p_out + q*count, p_probs, count*sizeof(double));
+        }, stream_block);
+        return std::move(output);
+    }
+    py::gil_scoped_release release;
+    engine.compute_sweep(us.data(), n_unitaries, input, [&callback, count](int q, const double *p_probs) {
+        py::gil_scoped_acquire acquire;
+        py::array_t<double> probs(count);
+        memcpy(probs.mutable_data(), p_probs, count*sizeof(double));
+        callback(q, probs);
+    }, stream_block);
+    return py::none();
+}
+
+py::tuple slos_engine_compute_approximate(const slos &engine,
+                                          const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u,
+                                          const fockstate &input,
+                                          double threshold,
+                                          unsigned long long top_k) {
+    check_unitary(u, engine.get_m());
+    std::vector<unsigned long long> indexes;
+    std::vector<std::complex<double>> amplitudes;
+    double discarded;
+    {
+        py::gil_scoped_release release;
+        discarded = engine.compute_approximate(u.data(), input, threshold, top_k, indexes, amplitudes);
+    }
+    py::array_t<unsigned long long> output_indexes(indexes.size());
+    memcpy(output_indexes.mutable_data(), indexes.data(), indexes.size()*sizeof(unsigned long long));
+    py::array_t<std::complex<double>> output_amplitudes(amplitudes.size());
+    memcpy(output_amplitudes.mutable_data(), amplitudes.data(), amplitudes.size()*sizeof(std::complex<double>));
+    return py::make_tuple(output_indexes, output_amplitudes, discarded);
+}
+
+py::array_t<std::complex<double>> slos_engine_compute_restricted(const slos &engine,
+                                                                 const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u,
+                                                                 const fockstate &input,
+                                                                 const fs_array &targets) {
+    check_unitary(u, engine.get_m());
+    py::array_t<std::complex<double>> output(targets.count());
+    std::complex<double> *p_out = output.mutable_data();
+    {
+        py::gil_scoped_release release;
+        engine.compute_restricted(u.data(), input, targets, p_out);
+    }
+    return output;
+}
+
+py::array_t<std::complex<double>> slos_engine_compute_restricted_mask(const slos &engine,
+                                                                      const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u,
+                                                                      const fockstate &input,
+                                                                      const fs_mask &targets) {
+    return slos_engine_compute_restricted(engine, u, input, fs_array(engine.get_m(), engine.get_n(), targets));
+}
+
+py::dict slos_engine_compute_reductions(const slos &engine,
+                                        const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u,
+                                        const fockstate &input,
+                                        bool mode_marginals,
+                                        bool click_patterns,
+                                        const std::vector<fs_mask> &masks,
+                                        int n_threads) {
+    check_unitary(u, engine.get_m());
+    fs_reductions reductions;
+    reductions.mode_marginals = mode_marginals;
+    reductions.click_patterns = click_patterns;
+    reductions.masks = masks;
+    {
+        py::gil_scoped_release release;
+        engine.compute_probabilities(u.data(), input, nullptr, &reductions, n_threads);
+    }
+    py::dict result;
+    if (mode_marginals) {
+        int m = engine.get_m(), n = engine.get_n();
+        py::array_t<double> marginals(std::vector<size_t>{(size_t)m, (size_t)n+1});
+        memcpy(marginals.mutable_data(), reductions.marginals.data(), m*(n+1)*sizeof(double));
+        result["marginals"] = marginals;
+    }
+    if (click_patterns)
+        result["clicks"] = reductions.clicks;
+    if (!masks.empty())
+        result["mask_totals"] = reductions.mask_totals;
+    return result;
+}
+
+py::object slos_engine_compute_lossy(const slos &engine,
+                                     const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u,
+                                     const fockstate &input,
+                                     const py::array_t<double, py::array::c_style | py::array::forcecast> &transmission,
+                                     bool graded) {
+    check_unitary(u, engine.get_m());
+    std::vector<double> transmissions;
+    if (transmission.ndim() == 0)
+        transmissions.assign(engine.get_m(), *transmission.data());
+    else if (transmission.ndim() == 1 && transmission.shape()[0] == engine.get_m())
+        transmissions.assign(transmission.data(), transmission.data()+engine.get_m());
+    else
+        throw std::runtime_error("transmission should be a scalar or a vector of m values");
+    if (graded) {
+        py::array_t<double> output(engine.graded().count());
+        double *p_out = output.mutable_data();
+        {
+            py::gil_scoped_release release;
+            engine.compute_lossy(u.data(), input, transmissions.data(), p_out);
+        }
+        return output;
+    }
+    std::vector<std::vector<double>> probabilities;
+    {
+        py::gil_scoped_release release;
+        engine.compute_lossy(u.data(), input, transmissions.data(), probabilities);
+    }
+    std::vector<py::array_t<double>> output;
+    for(const auto &p: probabilities) {
+        py::array_t<double> layer(p.size());
+        memcpy(layer.mutable_data(), p.data(), p.size()*sizeof(double));
+        output.push_back(layer);
+    }
+    return py::cast(output);
+}
+
+py::tuple graded_probabilities(const fs_graded_array &graded,
+                               const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &coefs,
+                               double scale, int n_threads) {
+    if (coefs.ndim() != 1 || (unsigned long long)coefs.shape()[0] != graded.count())
+        throw std::runtime_error("coefs should be a vector of size count()");
+    py::array_t<double> probabilities(graded.count());
+    py::array_t<double> totals(graded.get_n()+1);
+    double *p_probabilities = probabilities.mutable_data(), *p_totals = totals.mutable_data();
+    {
+        py::gil_scoped_release release;
+        graded.probabilities(coefs.data(), scale, p_probabilities, nullptr, p_totals, n_threads);
+    }
+    return py::make_tuple(probabilities, totals);
+}
+
+py::array_t<double> slos_engine_compute_distinguishable(const slos &engine,
+                                                        const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u,
+                                                        const fockstate &input,
+                                                        int n_threads) {
+    check_unitary(u, engine.get_m());
+    py::array_t<double> output(engine.count());
+    double *p_out = output.mutable_data();
+    {
+        py::gil_scoped_release release;
+        engine.compute_distinguishable(u.data(), input, p_out, n_threads);
+    }
+    return output;
+}
+
+py::list hierarchy_memory_report(const fs_hierarchy &hierarchy) {
+    py::list report;
+    for(const fs_layer_report &r: hierarchy.memory_report()) {
+        py::dict layer;
+        layer["k"] = r.k;
+        layer["count"] = r.count;
+        layer["loaded"] = r.loaded;
+        layer["users"] = r.users;
+        layer["array_bytes"] = r.array_bytes;
+        layer["map_bytes"] = r.map_bytes;
+        report.append(layer);
+    }
+    return report;
+}
+
+py::array sampler_sample(const fs_sampler &sampler, unsigned long long n_samples, unsigned long long seed,
+                         int n_threads, bool occupancies) {
+    if (occupancies) {
+        int m = sampler.get_m();
+        py::array_t<int> output(std::vector<size_t>{(size_t)n_samples, (size_t)m});
+        int *p_out = output.mutable_data();
+        {
+            py::gil_scoped_release release;
+            sampler.sample_occupancies(n_samples, p_out, seed, n_threads);
+        }
+        return output;
+    }
+    py::array_t<unsigned long long> output(n_samples);
+    unsigned long long *p_out = output.mutable_data();
+    {
+        py::gil_scoped_release release;
+        sampler.sample(n_samples, p_out, seed, n_threads);
+    }
+    return output;
+}
+
+py::tuple slos_engine_compute_gradient(const slos &engine,
+                                       const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u,
+                                       const fockstate &input,
+                                       const py::array_t<double, py::array::c_style | py::array::forcecast> &weights,
+                                       int checkpoint_every) {
+    check_unitary(u, engine.get_m());
+    if (weights.ndim() != 1 || (unsigned long long)weights.shape()[0] != engine.count())
+        throw std::runtime_error("weights should be a vector of size count()");
+    int m = engine.get_m();
+    py::array_t<std::complex<double>> grad(std::vector<size_t>{(size_t)m, (size_t)m});
+    std::complex<double> *p_grad = grad.mutable_data();
+    double loss;
+    {
+        py::gil_scoped_release release;
+        loss = engine.compute_gradient(u.data(), input, weights.data(), p_grad, checkpoint_every);
+    }
+    return py::make_tuple(loss, grad);
+}
+
+void slos_engine_compute_streaming(const slos &engine,
+                                   const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u,
+                                   const fockstate &input,
+                                   const std::string &output_file,
+                                   const std::string &work_dir,
+                                   unsigned long long memory_budget,
+                                   unsigned long long chunk) {
+    check_unitary(u, engine.get_m());
+    py::gil_scoped_release release;
+    engine.compute_streaming(u.data(), input, output_file, work_dir, memory_budget, chunk);
+}
+
+py::array slos_compute_in(const py::array_t<std::complex<double>, py::array::c_style | py::array::forcecast> &u,
+                          const fockstate &input,
+                          bool probabilities) {
+    check_unitary(u, input.get_m());
+    slos engine(input.get_m(), input.get_n());
+    return slos_engine_compute(engine, u, input, probabilities);
+}
+
 
 PYBIND11_MODULE(quandelibc, m) {
     m.doc() = "Optimized c-functions";
@@ -222,35 +567,187 @@ PYBIND11_MODULE(quandelibc, m) {
     py::class_<fs_mask>(m, "FSMask")
         .def(py::init<int, int>())
         .def(py::init<int, int, std::list<std::string>>(), py::arg("m"), py::arg("n"), py::arg("conditions"))
-        .def("match", &fs_mask::match, py::arg("fs"), py::arg("allow_missing")=true);
+        .def("match", &fs_mask::match, py::arg("fs"), py::arg("allow_missing")=true)
+        .def_property("conditions", &fs_mask::conditions, nullptr)
+        .def(py::self & py::self)
+        .def(py::self | py::self);
 
     py::class_<fs_array>(m, "FSArray")
         .def(py::init<int, int>(), py::arg("m"), py::arg("n"))
         .def(py::init<int, int, fs_mask>(), py::arg("m"), py::arg("n"), py::arg("mask"))
+        .def(py::init<int, int, bool>(), py::arg("m"), py::arg("n"), py::arg("no_bunching"))
+        .def(py::init<int, int, int>(), py::arg("m"), py::arg("n"), py::arg("cap"))
+        .def(py::init<int, int, std::vector<int>>(), py::arg("m"), py::arg("n"), py::arg("cap"))
         .def("__getitem__", &fs_array::operator[], py::arg("idx"))
         .def("__iter__",
             [](const fs_array &fsa) { return py::make_iterator(fsa.begin(), fsa.end()); },
             py::keep_alive<0, 1>())
         .def("find", &fs_array::find_idx, py::arg("fs"))
         .def("count", &fs_array::count)
-        .def("generate", &fs_array::generate)
+        .def("generate", &fs_array::generate, py::call_guard<py::gil_scoped_release>())
         .def("size", &fs_array::size)
         .def_property("m", &fs_array::get_m, nullptr)
         .def_property("n", &fs_array::get_n, nullptr)
+        .def_property("no_bunching", &fs_array::is_no_bunching, nullptr)
+        .def_property("caps", &fs_array::get_caps, nullptr)
+        .def("index_map", &fs_array_index_map,
+             "index in target of each state, npos if the state is not in target",
+             py::arg("target"), py::arg("n_threads")=0)
         .def("norm_coefs", &norm_coefs);
 
 
     py::class_<fs_map>(m, "FSMap")
-        .def(py::init<const fs_array &, const fs_array &, bool>(),
+        .def(py::init<const fs_array &, const fs_array &, bool, bool>(),
                 py::arg("fsa_current"),
                 py::arg("fsa_parent"),
-                py::arg("generate")=false)
+                py::arg("generate")=false,
+                py::arg("implicit")=false)
         .def("get", &fs_map::get, py::arg("idx"), py::arg("mk"))
         .def("count", &fs_map::count)
         .def("size", &fs_map::size)
         .def_property("m", &fs_map::get_m, nullptr)
         .def_property("n", &fs_map::get_n, nullptr)
-        .def("compute_slos_layer", &compute_slos_layer);
+        .def_property("implicit", &fs_map::is_implicit, nullptr)
+        .def("generate", &fs_map::generate, py::arg("n_threads")=0, py::arg("with_reverse")=false,
+             py::call_guard<py::gil_scoped_release>())
+        .def("parents", &fs_map_parents, py::arg("idx"))
+        .def("release", &fs_map::release)
+        .def("save", &fs_map::save, py::arg("filename"))
+        .def("load", &fs_map::load, py::arg("filename"))
+        .def("generate_file", &fs_map::generate_file, py::arg("filename"), py::arg("chunk")=1<<20,
+             py::arg("n_threads")=0, py::call_guard<py::gil_scoped_release>())
+        .def("compute_slos_layer", &compute_slos_layer)
+        .def("compute_slos_layer_gather", &compute_slos_layer_gather,
+             py::arg("u"), py::arg("m"), py::arg("mk"), py::arg("coefs"), py::arg("parent_coefs"),
+             py::arg("n_threads")=1);
+
+    py::class_<fs_sampler>(m, "FSSampler")
+        .def(py::init([](const fs_array &fsa,
+                         const py::array_t<double, py::array::c_style | py::array::forcecast> &probabilities) {
+                 if (probabilities.ndim() != 1 || (unsigned long long)probabilities.shape()[0] != fsa.count())
+                     throw std::runtime_error("probabilities should be a vector of size fsa.count()");
+                 return new fs_sampler(fsa, probabilities.data());
+             }), "sampler from probabilities", py::arg("fsa"), py::arg("probabilities"), py::keep_alive<1, 2>())
+        .def(py::init([](const fs_array &fsa,
+                         const py::array_t<std::complex<double>, py::array::c_style> &amplitudes) {
+                 if (amplitudes.ndim() != 1 || (unsigned long long)amplitudes.shape()[0] != fsa.count())
+                     throw std::runtime_error("amplitudes should be a vector of size fsa.count()");
+                 return new fs_sampler(fsa, amplitudes.data());
+             }), "sampler from amplitudes", py::arg("fsa"), py::arg("amplitudes"), py::keep_alive<1, 2>())
+        .def(py::init([](const fs_graded_array &graded,
+                         const py::array_t<double, py::array::c_style | py::array::forcecast> &probabilities) {
+                 if (probabilities.ndim() != 1 || (unsigned long long)probabilities.shape()[0] != graded.count())
+                     throw std::runtime_error("probabilities should be a vector of size graded.count()");
+                 return new fs_sampler(graded, probabilities.data());
+             }), "sampler over all photon numbers from probabilities", py::arg("graded"), py::arg("probabilities"),
+             py::keep_alive<1, 2>())
+        .def("total", &fs_sampler::total)
+        .def_property("m", &fs_sampler::get_m, nullptr)
+        .def("sample", &sampler_sample,
+             "draw samples as fsa indexes, or as a [n_samples, m] occupancy array",
+             py::arg("n_samples"), py::arg("seed")=0, py::arg("n_threads")=0, py::arg("occupancies")=false);
+
+    py::class_<fs_hierarchy, std::shared_ptr<fs_hierarchy>>(m, "FSHierarchy")
+        .def(py::init<int, int, bool>(), py::arg("m"), py::arg("n"), py::arg("implicit_maps")=false)
+        .def(py::init<int, int, fs_mask>(), py::arg("m"), py::arg("n"), py::arg("mask"))
+        .def(py::init<int, int, std::vector<int>, bool>(), py::arg("m"), py::arg("n"), py::arg("caps"),
+             py::arg("implicit_maps")=false)
+        .def_property("caps", &fs_hierarchy::caps, nullptr)
+        .def_property("m", &fs_hierarchy::get_m, nullptr)
+        .def_property("n", &fs_hierarchy::get_n, nullptr)
+        .def("generate", &fs_hierarchy::generate, py::arg("k"), py::arg("n_threads")=0,
+             py::call_guard<py::gil_scoped_release>())
+        .def("generate_all", &fs_hierarchy::generate_all, py::arg("n_threads")=0,
+             py::call_guard<py::gil_scoped_release>())
+        .def("release", &fs_hierarchy::release, py::arg("k"))
+        .def("release_all", &fs_hierarchy::release_all)
+        .def("memory_report", &hierarchy_memory_report, "memory usage of each layer, as a list of dicts")
+        .def("memory_usage", &fs_hierarchy::memory_usage);
+
+    py::class_<fs_graded_array>(m, "FSGradedArray")
+        .def(py::init<int, int>(), py::arg("m"), py::arg("n"))
+        .def(py::init<std::shared_ptr<fs_hierarchy>>(), py::arg("hierarchy"))
+        .def_property("m", &fs_graded_array::get_m, nullptr)
+        .def_property("n", &fs_graded_array::get_n, nullptr)
+        .def("count", &fs_graded_array::count)
+        .def("offset", &fs_graded_array::offset, py::arg("k"))
+        .def("grade", &fs_graded_array::grade, py::arg("k"), py::return_value_policy::reference_internal)
+        .def("grade_of", &fs_graded_array::grade_of, py::arg("idx"))
+        .def("generate", &fs_graded_array::generate, py::call_guard<py::gil_scoped_release>())
+        .def("__getitem__", &fs_graded_array::operator[], py::arg("idx"))
+        .def("__iter__",
+            [](const fs_graded_array &graded) { return py::make_iterator(graded.begin(), graded.end()); },
+            py::keep_alive<0, 1>())
+        .def("find", &fs_graded_array::find_idx, py::arg("fs"))
+        .def("probabilities", &graded_probabilities,
+             "probabilities of the states from their coefficients, and total probability of each photon number",
+             py::arg("coefs"), py::arg("scale")=1., py::arg("n_threads")=0);
+
+    py::class_<slos>(m, "SLOS")
+        .def(py::init<int, int, bool>(), py::arg("m"), py::arg("n"), py::arg("implicit_maps")=false)
+        .def(py::init<int, int, fs_mask>(), py::arg("m"), py::arg("n"), py::arg("mask"))
+        .def(py::init<int, int, std::vector<int>, bool>(), py::arg("m"), py::arg("n"), py::arg("caps"),
+             py::arg("implicit_maps")=false)
+        .def(py::init<std::shared_ptr<fs_hierarchy>>(), py::arg("hierarchy"))
+        .def_property("hierarchy", &slos::hierarchy, nullptr)
+        .def("graded", &slos::graded, "graded fs-array over the layers 0..n of the engine")
+        .def("count", &slos::count)
+        .def("generate", &slos::generate, py::call_guard<py::gil_scoped_release>())
+        .def("layer", &slos::layer, py::arg("k"), py::return_value_policy::reference_internal)
+        .def_property("m", &slos::get_m, nullptr)
+        .def_property("n", &slos::get_n, nullptr)
+        .def_property("sparse_threshold", &slos::get_sparse_threshold, &slos::set_sparse_threshold)
+        .def("compute", &slos_engine_compute,
+             "compute output amplitudes (or probabilities) of an input state",
+             py::arg("U"), py::arg("input_state"), py::arg("probabilities")=false)
+        .def("compute_batch", &slos_engine_compute_batch,
+             "compute output amplitudes (or probabilities) of several input states, as a [count, len(inputs)] array",
+             py::arg("U"), py::arg("input_states"), py::arg("probabilities")=false)
+        .def("compute_shared", &slos_engine_compute_shared,
+             "compute output amplitudes of several input states sharing common photon prefixes, as a "
+             "[len(inputs), count] array",
+             py::arg("U"), py::arg("input_states"), py::arg("memory_budget")=0)
+        .def("compute_sweep", &slos_engine_compute_sweep,
+             "compute output probabilities of an input state through a [K,m,m] array of unitaries - either as a "
+             "[K,count] array or streamed through callback(k, probabilities)",
+             py::arg("Us"), py::arg("input_state"), py::arg("callback")=py::none(), py::arg("stream_block")=8)
+        .def("compute_approximate", &slos_engine_compute_approximate,
+             "approximate computation truncating small intermediate coefficients - returns a tuple "
+             "(indexes, amplitudes, discarded_probability)",
+             py::arg("U"), py::arg("input_state"), py::arg("threshold")=0., py::arg("top_k")=0)
+        .def("compute_streaming", &slos_engine_compute_streaming,
+             "memory-budgeted computation writing the output amplitudes to a file, spilling layers and maps to "
+             "memory-mapped files in work_dir",
+             py::arg("U"), py::arg("input_state"), py::arg("output_file"), py::arg("work_dir"),
+             py::arg("memory_budget"), py::arg("chunk")=1<<20)
+        .def("compute_reductions", &slos_engine_compute_reductions,
+             "reductions of the output probabilities computed in the output stage - returns a dict with the requested "
+             "'marginals' ([m, n+1] array of the photon count probabilities per mode), 'clicks' (probability of each "
+             "threshold detection pattern, bit j for mode j) and 'mask_totals' (total probability for each mask)",
+             py::arg("U"), py::arg("input_state"), py::arg("mode_marginals")=false, py::arg("click_patterns")=false,
+             py::arg("masks")=std::vector<fs_mask>(), py::arg("n_threads")=0)
+        .def("compute_distinguishable", &slos_engine_compute_distinguishable,
+             "output probabilities of an annotated input state made of groups of distinguishable photons",
+             py::arg("U"), py::arg("input_state"), py::arg("n_threads")=0)
+        .def("compute_lossy", &slos_engine_compute_lossy,
+             "output probabilities with photon loss - transmission is uniform or given per input mode - returns a "
+             "list of n+1 arrays, the k-th one holding the probabilities of the states of layer(k) - or a single array "
+             "ordered as graded() if graded is True",
+             py::arg("U"), py::arg("input_state"), py::arg("transmission"), py::arg("graded")=false)
+        .def("compute_gradient", &slos_engine_compute_gradient,
+             "reverse-mode gradient of L = sum(weights*probabilities) with respect to U - returns a tuple "
+             "(L, dL/dRe(U) + 1j*dL/dIm(U))",
+             py::arg("U"), py::arg("input_state"), py::arg("weights"), py::arg("checkpoint_every")=0)
+        .def("compute_restricted", &slos_engine_compute_restricted,
+             "computation of the output amplitudes of the target states only, ordered as targets",
+             py::arg("U"), py::arg("input_state"), py::arg("targets"))
+        .def("compute_restricted", &slos_engine_compute_restricted_mask,
+             "computation of the output amplitudes of the states matching a mask, ordered as FSArray(m, n, mask)",
+             py::arg("U"), py::arg("input_state"), py::arg("targets"));
+
+    m.def("slos_compute", &slos_compute_in,
+          "full SLOS computation of output amplitudes (or probabilities) of an input state",
+          py::arg("U"), py::arg("input_state"), py::arg("probabilities")=false);
 
 #ifdef VERSION_INFO
     m.attr("__version__") = MACRO_STRINGIFY(VERSION_INFO);
@@ -0,0 +1,804 @@
+// MIT License
+//
+// Copyright (c) 2022 Quandela
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include "slos.h"
+#include "mapped_file.h"
+
+#define MAP_FILENAME "map-m%d-n%d.fsm"
+#define LAYER_FILENAME "slos-layer-%d.coefs"
+#define FILENAME_LENGTH 64
+
+slos::slos(int m, int n, bool implicit_maps): slos(std::make_shared<fs_hierarchy>(m, n, implicit_maps)) {
+}
+
+slos::slos(int m, int n, const fs_mask &mask): slos(std::make_shared<fs_hierarchy>(m, n, mask)) {
+}
+
+slos::slos(int m, int n, const std::vector<int> &caps, bool implicit_maps):
+    slos(std::make_shared<fs_hierarchy>(m, n, caps, implicit_maps)) {
+}
+
+slos::slos(std::shared_ptr<fs_hierarchy> hierarchy): _m(hierarchy->get_m()), _n(hierarchy->get_n()),
+                                                     _p_mask(hierarchy->mask()), _hierarchy(hierarchy),
+                                                     _max_count(1), _sparse_threshold(0.25) {
+    for(int k=0; k<=_n; k++)
+        _layers.push_back(_hierarchy->layer(k));
+    for(int k=1; k<=_n; k++)
+        _maps.push_back(_hierarchy->map(k));
+    /* intermediate layers are kept in two ping-pong buffers */
+    for(int k=0; k<_n; k++)
+        if (_layers[k]->count() > _max_count) _max_count = _layers[k]->count();
+}
+
+slos::~slos() {
+}
+
+const fs_array &slos::layer(int k) const {
+    if (k < 0 || k > _n)
+        throw std::out_of_range("invalid layer");
+    return *_layers[k];
+}
+
+const fs_map &slos::map(int k) const {
+    if (k < 1 || k > _n)
+        throw std::out_of_range("invalid map");
+    return *_maps[k-1];
+}
+
+void slos::generate() const {
+    _hierarchy->generate_all();
+}
+
+void slos::_check_input(const fockstate &input) const {
+    if (input.get_m() != _m || input.get_n() != _n || !input.get_code())
+        throw std::invalid_argument("input state does not match slos engine");
+}
+
+void slos::compute(const std::complex<double> *p_u, const fockstate &input, std::complex<double> *p_out) const {
+    _check_input(input);
+    if (_layers[0]->count() == 0) {
+        std::fill(p_out, p_out+count(), std::complex<double>(0));
+        return;
+    }
+    _propagate(p_u, input, p_out);
+    _normalize(input, p_out);
+}
+
+void slos::_propagate(const std::complex<double> *p_u, const fockstate &input, std::complex<double> *p_out) const {
+    generate();
+    /* double buffering - only two intermediate layers are alive at any time, last layer is directly written
+     * in output buffer */
+    std::vector<std::complex<double>> buffer(2*_max_count);
+    std::complex<double> *p_parent = buffer.data();
+    p_parent[0] = 1;
+    if (_n == 0)
+        p_out[0] = 1;
+    /* layers are propagated sparsely - only from the parent support - as long as their density is low */
+    bool sparse = _sparse_threshold > 0;
+    std::vector<unsigned long long> parent_support(1, 0);
+    std::vector<unsigned long long> support;
+    for(int k=1; k<=_n; k++) {
+        std::complex<double> *p_current = k == _n ? p_out : buffer.data() + (k%2)*_max_count;
+        unsigned long long n_coefs = _layers[k]->count();
+        if (sparse) {
+            _maps[k-1]->compute_slos_layer_sparse(p_u, _m, input.photon2mode(k-1),
+                                                  p_current, n_coefs,
+                                                  p_parent, parent_support.data(), parent_support.size(),
+                                                  support);
+            parent_support.swap(support);
+            if (parent_support.size() > _sparse_threshold*n_coefs || k == _n) {
+                /* clear the coefficients out of the support and continue in dense mode */
+                unsigned long long i = 0;
+                for(unsigned long long idx: parent_support) {
+                    for(; i < idx; i++) p_current[i] = 0;
+                    i = idx+1;
+                }
+                for(; i < n_coefs; i++) p_current[i] = 0;
+                sparse = false;
+            }
+        } else
+            _maps[k-1]->compute_slos_layer(p_u, _m, input.photon2mode(k-1),
+                                           p_current, n_coefs,
+                                           p_parent, _layers[k-1]->count());
+        p_parent = p_current;
+    }
+}
+
+void slos::_normalize(const fockstate &input, std::complex<double> *p_out) const {
+    /* output normalization: sqrt(prod n_i!) on output state and 1/sqrt(prod n_i!) for input state */
+    _layers[_n]->norm_coefs(p_out);
+    double input_norm = 1/sqrt((double)input.prodnfact());
+    for(unsigned long long i=0; i<count(); i++)
+        p_out[i] *= input_norm;
+}
+
+void slos::compute_probabilities(const std::complex<double> *p_u, const fockstate &input, double *p_out,
+                                 fs_reductions *p_reductions, int n_threads) const {
+    _check_input(input);
+    std::vector<std::complex<double>> coefs(count());
+    if (_layers[0]->count() != 0)
+        _propagate(p_u, input, coefs.data());
+    /* normalization, squared magnitudes and reductions in a single pass */
+    _layers[_n]->probabilities(coefs.data(), 1/(double)input.prodnfact(), p_out, p_reductions, n_threads);
+}
+
+void slos::compute_batch(const std::complex<double> *p_u, const std::vector<fockstate> &inputs,
+                         std::complex<double> *p_out) const {
+    for(const fockstate &input: inputs)
+        _check_input(input);
+    int batch = (int)inputs.size();
+    if (!batch)
+        return;
+    generate();
+    if (_layers[0]->count() == 0) {
+        std::fill(p_out, p_out+count()*batch, std::complex<double>(0));
+        return;
+    }
+    std::vector<std::complex<double>> buffer(2*_max_count*batch);
+    std::vector<std::complex<double>> u_cols(_m*batch);
+    std::complex<double> *p_parent = buffer.data();
+    for(int b=0; b<batch; b++) {
+        p_parent[b] = 1;
+        if (_n == 0) p_out[b] = 1;
+    }
+    for(int k=1; k<=_n; k++) {
+        std::complex<double> *p_current = k == _n ? p_out : buffer.data() + (k%2)*_max_count*batch;
+        for(int b=0; b<batch; b++) {
+            int mk = inputs[b].photon2mode(k-1);
+            for(int j=0; j<_m; j++)
+                u_cols[j*batch+b] = p_u[j*_m+mk];
+        }
+        _maps[k-1]->compute_slos_layer_batch(u_cols.data(), batch,
+                                             p_current, _layers[k]->count(),
+                                             p_parent, _layers[k-1]->count());
+        p_parent = p_current;
+    }
+    _layers[_n]->norm_coefs(p_out, batch);
+    std::vector<double> input_norms(batch);
+    for(int b=0; b<batch; b++)
+        input_norms[b] = 1/sqrt((double)inputs[b].prodnfact());
+    for(unsigned long long i=0; i<count(); i++)
+        for(int b=0; b<batch; b++)
+            p_out[i*batch+b] *= input_norms[b];
+}
+
+unsigned long long slos::compute_shared(const std::complex<double> *p_u, const std::vector<fockstate> &inputs,
+                                        std::complex<double> *p_out,
+                                        unsigned long long memory_budget) const {
+    for(const fockstate &input: inputs)
+        _check_input(input);
+    size_t batch = inputs.size();
+    if (!batch)
+        return 0;
+    generate();
+    if (_layers[0]->count() == 0) {
+        std::fill(p_out, p_out+count()*batch, std::complex<double>(0));
+        return 0;
+    }
+    /* sort the inputs on their code - inputs sharing a prefix are then consecutive, and the common prefix of
+     * two inputs is the minimum of the common prefixes of the consecutive inputs between them */
+    std::vector<size_t> order(batch);
+    for(size_t b=0; b<batch; b++) order[b] = b;
+    std::sort(order.begin(), order.end(), [&inputs, this](size_t a, size_t b) {
+        return memcmp(inputs[a].get_code(), inputs[b].get_code(), _n) < 0;
+    });
+    std::vector<int> lcp(batch, 0);
+    for(size_t b=1; b<batch; b++) {
+        const char *c1 = inputs[order[b-1]].get_code();
+        const char *c2 = inputs[order[b]].get_code();
+        while (lcp[b] < _n && c1[lcp[b]] == c2[lcp[b]]) lcp[b]++;
+    }
+
+    /* stack of the kept layers along the current path of the prefix tree - layer 0 is always there */
+    std::vector<std::pair<int, std::vector<std::complex<double>>>> kept;
+    kept.emplace_back(0, std::vector<std::complex<double>>(1, 1));
+    unsigned long long kept_bytes = 0;
+    std::vector<std::complex<double>> buffer(2*_max_count);
+    std::vector<bool> keep(_n+1);
+    unsigned long long computed = 0;
+
+    for(size_t b=0; b<batch; b++) {
+        const fockstate &input = inputs[order[b]];
+        while (kept.back().first > lcp[b]) {
+            kept_bytes -= kept.back().second.size()*sizeof(std::complex<double>);
+            kept.pop_back();
+        }
+        int depth = kept.back().first;
+        /* layers of the path needed by the following inputs */
+        std::fill(keep.begin(), keep.end(), false);
+        int shared = _n;
+        for(size_t c=b+1; c<batch; c++) {
+            shared = std::min(shared, lcp[c]);
+            if (shared <= depth) break;
+            keep[shared] = true;
+        }
+        const std::complex<double> *p_parent = kept.back().second.data();
+        std::complex<double> *p_final = p_out + order[b]*count();
+        for(int k=depth+1; k<=_n; k++) {
+            std::complex<double> *p_current;
+            unsigned long long layer_bytes = _layers[k]->count()*sizeof(std::complex<double>);
+            if (k == _n)
+                p_current = p_final;
+            else if (keep[k] && (!memory_budget || kept_bytes+layer_bytes <= memory_budget)) {
+                kept.emplace_back(k, std::vector<std::complex<double>>(_layers[k]->count()));
+                kept_bytes += layer_bytes;
+                p_current = kept.back().second.data();
+            } else
+                p_current = buffer.data() + (k%2)*_max_count;
+            _maps[k-1]->compute_slos_layer(p_u, _m, input.photon2mode(k-1),
+                                           p_current, _layers[k]->count(),
+                                           p_parent, _layers[k-1]->count());
+            computed++;
+            p_parent = p_current;
+        }
+        if (_n == 0)
+            p_final[0] = 1;
+        _normalize(input, p_final);
+    }
+    return computed;
+}
+
+void slos::compute_sweep(const std::complex<double> *p_us, int n_unitaries, const fockstate &input,
+                         const std::function<void(int, const double *)> &on_probabilities,
+                         int stream_block) const {
+    _check_input(input);
+    if (n_unitaries <= 0)
+        return;
+    if (stream_block <= 0 || stream_block > n_unitaries)
+        stream_block = n_unitaries;
+    generate();
+    std::vector<double> probabilities(count());
+    if (_layers[0]->count() == 0 || _n == 0) {
+        if (_n == 0 && count()) probabilities[0] = 1;
+        for(int q=0; q<n_unitaries; q++)
+            on_probabilities(q, probabilities.data());
+        return;
+    }
+    /* layers 1..n-1 for all the unitaries, state-major */
+    std::vector<std::complex<double>> buffer(2*_max_count*n_unitaries);
+    std::vector<std::complex<double>> u_cols(_m*n_unitaries);
+    std::complex<double> *p_parent = buffer.data();
+    for(int q=0; q<n_unitaries; q++)
+        p_parent[q] = 1;
+    for(int k=1; k<_n; k++) {
+        std::complex<double> *p_current = buffer.data() + (k%2)*_max_count*n_unitaries;
+        int mk = input.photon2mode(k-1);
+        for(int j=0; j<_m; j++)
+            for(int q=0; q<n_unitaries; q++)
+                u_cols[j*n_unitaries+q] = p_us[(size_t)q*_m*_m+j*_m+mk];
+        _maps[k-1]->compute_slos_layer_batch(u_cols.data(), n_unitaries,
+                                             p_current, _layers[k]->count(),
+                                             p_parent, _layers[k-1]->count());
+        p_parent = p_current;
+    }
+    /* last layer - by blocks of stream_block unitaries */
+    unsigned long long n_parent = _layers[_n-1]->count();
+    int mk = input.photon2mode(_n-1);
+    std::vector<std::complex<double>> parent_block(n_parent*stream_block);
+    std::vector<std::complex<double>> out_block(count()*stream_block);
+    double input_norm = 1./input.prodnfact();
+    for(int q0=0; q0<n_unitaries; q0+=stream_block) {
+        int block = std::min(stream_block, n_unitaries-q0);
+        for(unsigned long long i=0; i<n_parent; i++)
+            for(int q=0; q<block; q++)
+                parent_block[i*block+q] = p_parent[i*n_unitaries+q0+q];
+        for(int j=0; j<_m; j++)
+            for(int q=0; q<block; q++)
+                u_cols[j*block+q] = p_us[(size_t)(q0+q)*_m*_m+j*_m+mk];
+        _maps[_n-1]->compute_slos_layer_batch(u_cols.data(), block,
+                                              out_block.data(), count(),
+                                              parent_block.data(), n_parent);
+        _layers[_n]->norm_coefs(out_block.data(), block);
+        for(int q=0; q<block; q++) {
+            for(unsigned long long i=0; i<count(); i++)
+                probabilities[i] = std::norm(out_block[i*block+q])*input_norm;
+            on_probabilities(q0+q, probabilities.data());
+        }
+    }
+}
+
+double slos::compute_approximate(const std::complex<double> *p_u, const fockstate &input,
+                                 double threshold, unsigned long long top_k,
+                                 std::vector<unsigned long long> &indexes,
+                                 std::vector<std::complex<double>> &amplitudes) const {
+    _check_input(input);
+    generate();
+    if (_layers[0]->count() == 0) {
+        indexes.clear();
+        amplitudes.clear();
+        return 0;
+    }
+    typedef std::pair<unsigned long long, std::complex<double>> sparse_coef;
+    std::vector<sparse_coef> parent(1, sparse_coef(0, 1));
+    std::unordered_map<unsigned long long, std::complex<double>> current;
+    unsigned long long prefix_nfact = 1;
+    int prefix_count = 0;
+    for(int k=1; k<=_n; k++) {
+        int mk = input.photon2mode(k-1);
+        current.clear();
+        current.reserve(std::min((unsigned long long)parent.size()*_m, _layers[k]->count()));
+        for(const sparse_coef &pc: parent)
+            for(int j=0; j<_m; j++) {
+                unsigned long long idx = _maps[k-1]->get_nc(pc.first, j);
+                if (idx != fs_npos)
+                    current[idx] += pc.second * p_u[j*_m+mk];
+            }
+        /* input normalization of the layer: prod n_i! of the k first input photons */
+        if (k > 1 && input.photon2mode(k-2) == mk)
+            prefix_nfact *= ++prefix_count;
+        else
+            prefix_count = 1;
+        std::vector<std::pair<double, sparse_coef>> layer;
+        layer.reserve(current.size());
+        for(const auto &c: current) {
+            double magnitude = std::abs(c.second) * sqrt((double)(*_layers[k])[c.first].prodnfact()/prefix_nfact);
+            if (k == _n || magnitude >= threshold)
+                layer.emplace_back(magnitude, c);
+        }
+        if (k < _n && top_k && layer.size() > top_k) {
+            std::nth_element(layer.begin(), layer.begin()+top_k, layer.end(),
+                             [](const std::pair<double, sparse_coef> &a, const std::pair<double, sparse_coef> &b) {
+                                 return a.first > b.first;
+                             });
+            layer.resize(top_k);
+        }
+        parent.clear();
+        for(const auto &c: layer)
+            parent.push_back(c.second);
+        std::sort(parent.begin(), parent.end(), [](const sparse_coef &a, const sparse_coef &b) {
+            return a.first < b.first;
+        });
+    }
+    indexes.clear();
+    amplitudes.clear();
+    double kept = 0;
+    double input_norm = 1/sqrt((double)input.prodnfact());
+    for(const sparse_coef &c: parent) {
+        std::complex<double> amplitude = c.second * sqrt((double)(*_layers[_n])[c.first].prodnfact()) * input_norm;
+        if (amplitude == 0.)
+            continue;
+        indexes.push_back(c.first);
+        amplitudes.push_back(amplitude);
+        kept += std::norm(amplitude);
+    }
+    return 1-kept;
+}
+
+/* call f(parent, mode) for each predecessor in layer k-1 of the state idx of layer k - through the reverse index of
+ * the fs-map, or by ranking the states with one photon less for implicit maps */
+template<typename F>
+static void for_each_parent(const fs_map &fsm, const fs_array &fsa_current, const fs_array &fsa_parent,
+                            unsigned long long idx, std::vector<char> &code, F f) {
+    if (!fsm.is_implicit()) {
+        for(unsigned long long r=fsm.reverse_offsets()[idx]; r<fsm.reverse_offsets()[idx+1]; r++)
+            if (fsm.reverse_parents()[r] != fs_npos)
+                f(fsm.reverse_parents()[r], fsm.reverse_modes()[r]);
+        return;
+    }
+    /* code holds the current state code followed by the parent state code */
+    int nk = fsa_current.get_n();
+    char *parent_code = code.data()+nk;
+    fsa_current.unrank(idx, code.data());
+    for(int i=0; i<nk; i++) {
+        if (i+1<nk && code[i+1] == code[i])
+            continue;
+        for(int h=0; h<nk; h++)
+            if (h != i) parent_code[h < i ? h : h-1] = code[h];
+        f(fsa_parent.rank(parent_code), (unsigned char)code[i]-'A');
+    }
+}
+
+void slos::compute_restricted(const std::complex<double> *p_u, const fockstate &input, const fs_array &targets,
+                              std::complex<double> *p_out) const {
+    _check_input(input);
+    if (targets.get_m() != _m || targets.get_n() != _n)
+        throw std::invalid_argument("targets do not match slos engine");
+    for(auto p: _maps)
+        p->generate(0, !p->is_implicit());
+    /* backward pass: supports[k] is the sorted list of the states of layer k reaching a target */
+    std::vector<std::vector<unsigned long long>> supports(_n+1);
+    std::vector<unsigned long long> target_idx;
+    for(fockstate fs: targets) {
+        target_idx.push_back(_layers[_n]->find_idx(fs));
+        if (target_idx.back() != fs_npos)
+            supports[_n].push_back(target_idx.back());
+    }
+    std::vector<char> code(2*_n+1);
+    for(int k=_n; k>=0; k--) {
+        std::sort(supports[k].begin(), supports[k].end());
+        supports[k].erase(std::unique(supports[k].begin(), supports[k].end()), supports[k].end());
+        if (!k)
+            break;
+        for(unsigned long long idx: supports[k])
+            for_each_parent(*_maps[k-1], *_layers[k], *_layers[k-1], idx, code,
+                            [&](unsigned long long parent, int) { supports[k-1].push_back(parent); });
+    }
+    /* forward pass on the supports only: each coefficient is gathered from its predecessors */
+    std::vector<std::complex<double>> parent(supports[0].size(), 1), current;
+    for(int k=1; k<=_n; k++) {
+        int mk = input.photon2mode(k-1);
+        const std::vector<unsigned long long> &parent_support = supports[k-1];
+        current.assign(supports[k].size(), 0);
+        for(unsigned long long a=0; a<supports[k].size(); a++)
+            for_each_parent(*_maps[k-1], *_layers[k], *_layers[k-1], supports[k][a], code,
+                            [&](unsigned long long p, int j) {
+                                auto it = std::lower_bound(parent_support.begin(), parent_support.end(), p);
+                                current[a] += parent[it-parent_support.begin()] * p_u[j*_m+mk];
+                            });
+        parent.swap(current);
+    }
+    double input_norm = 1/sqrt((double)input.prodnfact());
+    for(unsigned long long b=0; b<target_idx.size(); b++) {
+        if (target_idx[b] == fs_npos) {
+            p_out[b] = 0;
+            continue;
+        }
+        auto it = std::lower_bound(supports[_n].begin(), supports[_n].end(), target_idx[b]);
+        p_out[b] = parent[it-supports[_n].begin()] * sqrt((double)targets[b].prodnfact()) * input_norm;
+    }
+}
+
+void slos::compute_restricted(const std::complex<double> *p_u, const fockstate &input, const fs_mask &targets,
+                              std::complex<double> *p_out) const {
+    compute_restricted(p_u, input, fs_array(_m, _n, targets), p_out);
+}
+
+double slos::compute_gradient(const std::complex<double> *p_u, const fockstate &input, const double *p_weights,
+                              std::complex<double> *p_grad, int checkpoint_every,
+                              double *p_probabilities) const {
+    _check_input(input);
+    if (checkpoint_every < 0)
+        throw std::invalid_argument("invalid checkpoint interval");
+    generate();
+    /* layers[k] holds the coefficients of layer k if kept - layer 0 and layer n always are */
+    std::vector<std::vector<std::complex<double>>> layers(_n+1);
+    layers[0].assign(1, 1);
+    auto propagate = [&](int k) {
+        layers[k].resize(_layers[k]->count());
+        _maps[k-1]->compute_slos_layer(p_u, _m, input.photon2mode(k-1),
+                                       layers[k].data(), layers[k].size(),
+                                       layers[k-1].data(), layers[k-1].size());
+    };
+    for(int k=1; k<=_n; k++) {
+        propagate(k);
+        /* the last kept layer is needed to compute the next one */
+        if (k > 1 && checkpoint_every && (k-1) % checkpoint_every)
+            std::vector<std::complex<double>>().swap(layers[k-1]);
+    }
+    /* output: a_i = N_i.c_i, with N_i the normalization factor - adj(c_i) = 2.w_i.N_i.a_i */
+    std::vector<std::complex<double>> norm(count(), 1);
+    _normalize(input, norm.data());
+    std::vector<std::complex<double>> adj(count()), parent_adj;
+    double loss = 0;
+    for(unsigned long long i=0; i<count(); i++) {
+        std::complex<double> amplitude = layers[_n][i] * norm[i].real();
+        double probability = std::norm(amplitude);
+        if (p_probabilities)
+            p_probabilities[i] = probability;
+        loss += p_weights[i] * probability;
+        adj[i] = 2 * p_weights[i] * norm[i].real() * amplitude;
+    }
+    memset((void*)p_grad, 0, _m*_m*sizeof(std::complex<double>));
+    for(int k=_n; k>=1; k--) {
+        if (layers[k-1].empty()) {
+            /* recompute the segment from the closest checkpoint, keeping its layers for the next steps */
+            int base = k-2;
+            while (layers[base].empty())
+                base--;
+            for(int h=base+1; h<k; h++)
+                propagate(h);
+        }
+        parent_adj.resize(_layers[k-1]->count());
+        _maps[k-1]->compute_slos_layer_adjoint(p_u, _m, input.photon2mode(k-1), adj.data(),
+                                               layers[k-1].data(), parent_adj.data(), parent_adj.size(), p_grad);
+        adj.swap(parent_adj);
+        std::vector<std::complex<double>>().swap(layers[k]);
+    }
+    return loss;
+}
+
+fs_graded_array slos::graded() const {
+    return fs_graded_array(_hierarchy);
+}
+
+void slos::compute_lossy(const std::complex<double> *p_u, const fockstate &input, const double *p_transmission,
+                         double *p_out) const {
+    _check_input(input);
+    for(int i=0; i<_m; i++)
+        if (!(p_transmission[i] >= 0 && p_transmission[i] <= 1))
+            throw std::invalid_argument("invalid transmission");
+    generate();
+    /* the probabilities of layer k start at the offset of grade k */
+    std::vector<unsigned long long> offsets(_n+2, 0);
+    for(int k=0; k<=_n; k++)
+        offsets[k+1] = offsets[k] + _layers[k]->count();
+    memset(p_out, 0, offsets[_n+1]*sizeof(double));
+    if (_layers[0]->count() == 0)
+        return;
+    std::vector<int> occupation = input.to_vect();
+    /* prefix[K]: coefficients of the current prefix of kept photons, K being the number of kept photons */
+    std::vector<std::vector<std::complex<double>>> prefix(_n+1);
+    prefix[0].assign(1, 1);
+    std::vector<double> leaf;
+    /* visit(i, K, weight, nfact): the kept photons of the input modes < i are propagated in prefix[K] - weight is the
+     * probability of the loss pattern, and nfact the prod k_i! of the kept photons */
+    std::function<void(int, int, double, double)> visit = [&](int i, int K, double weight, double nfact) {
+        if (i == _m) {
+            leaf.resize(_layers[K]->count());
+            _layers[K]->probabilities(prefix[K].data(), weight/nfact, leaf.data(), nullptr, 1);
+            for(unsigned long long s=0; s<leaf.size(); s++)
+                p_out[offsets[K]+s] += leaf[s];
+            return;
+        }
+        int n_i = occupation[i];
+        double eta = p_transmission[i];
+        double binomial = 1, kept_fact = 1;
+        for(int c=0; c<=n_i; c++) {
+            if (c) {
+                /* one more photon of mode i is kept */
+                binomial = binomial * (n_i-c+1) / c;
+                kept_fact *= c;
+                prefix[K+c].resize(_layers[K+c]->count());
+                _maps[K+c-1]->compute_slos_layer(p_u, _m, i, prefix[K+c].data(), prefix[K+c].size(),
+                                                 prefix[K+c-1].data(), prefix[K+c-1].size());
+            }
+            double w = weight * binomial * std::pow(eta, c) * std::pow(1-eta, n_i-c);
+            if (w > 0)
+                visit(i+1, K+c, w, nfact*kept_fact);
+        }
+    };
+    visit(0, 0, 1, 1);
+}
+
+void slos::compute_lossy(const std::complex<double> *p_u, const fockstate &input, const double *p_transmission,
+                         std::vector<std::vector<double>> &probabilities) const {
+    std::vector<double> graded_probabilities;
+    unsigned long long total = 0;
+    for(int k=0; k<=_n; k++)
+        total += _layers[k]->count();
+    graded_probabilities.resize(total);
+    compute_lossy(p_u, input, p_transmission, graded_probabilities.data());
+    probabilities.assign(_n+1, std::vector<double>());
+    const double *p = graded_probabilities.data();
+    for(int k=0; k<=_n; k++) {
+        probabilities[k].assign(p, p+_layers[k]->count());
+        p += _layers[k]->count();
+    }
+}
+
+void slos::compute_lossy(const std::complex<double> *p_u, const fockstate &input, double transmission,
+                         std::vector<std::vector<double>> &probabilities) const {
+    std::vector<double> transmissions(_m, transmission);
+    compute_lossy(p_u, input, transmissions.data(), probabilities);
+}
+
+void slos::compute_distinguishable(const std::complex<double> *p_u, const fockstate &input, double *p_out,
+                                   int n_threads) const {
+    _check_input(input);
+    generate();
+    std::list<fockstate> separated = input.separate_state();
+    std::vector<fockstate> groups(separated.begin(), separated.end());
+    /* smallest groups are combined first, to keep the intermediate distributions small */
+    std::sort(groups.begin(), groups.end(), [](const fockstate &a, const fockstate &b) {
+        return a.get_n() < b.get_n();
+    });
+    /* output distribution of each group on the layer of its photon number */
+    std::vector<std::vector<double>> distributions(groups.size());
+    auto group_distribution = [&](size_t g) {
+        const fockstate &group = groups[g];
+        int n_g = group.get_n();
+        std::vector<std::complex<double>> parent(1, 1), current;
+        for(int k=1; k<=n_g; k++) {
+            current.resize(_layers[k]->count());
+            _maps[k-1]->compute_slos_layer(p_u, _m, group.photon2mode(k-1), current.data(), current.size(),
+                                           parent.data(), parent.size());
+            parent.swap(current);
+        }
+        distributions[g].resize(_layers[n_g]->count());
+        if (_layers[n_g]->count())
+            _layers[n_g]->probabilities(parent.data(), 1/(double)group.prodnfact(), distributions[g].data(),
+                                        nullptr, 1);
+    };
+    if (n_threads <= 0)
+        n_threads = (int)std::thread::hardware_concurrency();
+    std::vector<std::thread> threads;
+    for(size_t g=1; g<groups.size(); g++)
+        if ((int)threads.size()+1 < n_threads)
+            threads.emplace_back(group_distribution, g);
+        else
+            group_distribution(g);
+    group_distribution(0);
+    for(auto &thread: threads)
+        thread.join();
+    /* sparse tensor products: the output state of two groups is the merge of their sorted codes */
+    typedef std::pair<unsigned long long, double> sparse_probability;
+    std::vector<sparse_probability> combined;
+    for(unsigned long long i=0; i<distributions[0].size(); i++)
+        if (distributions[0][i] > 0) combined.emplace_back(i, distributions[0][i]);
+    int n_combined = groups[0].get_n();
+    std::vector<char> code(_n);
+    std::unordered_map<unsigned long long, double> merged;
+    for(size_t g=1; g<groups.size(); g++) {
+        int n_g = groups[g].get_n();
+        const fs_array &fsa_a = *_layers[n_combined], &fsa_b = *_layers[n_g];
+        const fs_array &fsa_merged = *_layers[n_combined+n_g];
+        merged.clear();
+        for(const sparse_probability &a: combined) {
+            fockstate fs_a = fsa_a[a.first];
+            for(unsigned long long b=0; b<distributions[g].size(); b++) {
+                if (distributions[g][b] <= 0)
+                    continue;
+                fockstate fs_b = fsa_b[b];
+                std::merge(fs_a.get_code(), fs_a.get_code()+n_combined, fs_b.get_code(), fs_b.get_code()+n_g,
+                           code.begin());
+                unsigned long long idx = fsa_merged.is_masked() ?
+                                         fsa_merged.find_idx(fockstate(_m, n_combined+n_g, code.data())) :
+                                         fsa_merged.rank(code.data());
+                if (idx != fs_npos)
+                    merged[idx] += a.second * distributions[g][b];
+            }
+        }
+        combined.assign(merged.begin(), merged.end());
+        n_combined += n_g;
+    }
+    memset(p_out, 0, count()*sizeof(double));
+    for(const sparse_probability &c: combined)
+        p_out[c.first] = c.second;
+}
+
+/* path of a file in a directory */
+static std::string dir_file(const std::string &dir, const char *format, int a, int b=0) {
+    char filename[FILENAME_LENGTH];
+    snprintf(filename, FILENAME_LENGTH, format, a, b);
+    if (dir.empty())
+        return filename;
+    return dir + "/" + filename;
+}
+
+void slos::compute_streaming(const std::complex<double> *p_u, const fockstate &input,
+                             const std::string &output_file, const std::string &work_dir,
+                             unsigned long long memory_budget, unsigned long long chunk) const {
+    _check_input(input);
+    if (!chunk)
+        throw std::invalid_argument("invalid chunk size");
+    const unsigned long long coef_size = sizeof(std::complex<double>);
+    mapped_file *p_out_file = new mapped_file(output_file, count()*coef_size, true);
+    /* parent and current layers - either in memory, or in a mapped file */
+    std::vector<std::complex<double>> parent(1, 1), current;
+    mapped_file *p_parent_file = nullptr, *p_current_file = nullptr;
+    fs_map *p_private_map = nullptr;
+    std::complex<double> *p_parent = parent.data();
+    std::thread prefetch_thread;
+    int k = 1;
+    try {
+        for(; k<=_n; k++) {
+            unsigned long long n_parent = _layers[k-1]->count();
+            unsigned long long n_current = _layers[k]->count();
+            unsigned long long used = p_parent_file ? 0 : n_parent*coef_size;
+            std::complex<double> *p_current;
+            if (k == _n)
+                p_current = (std::complex<double> *)p_out_file->data();
+            else if (used + n_current*coef_size <= memory_budget) {
+                current.assign(n_current, 0);
+                p_current = current.data();
+                used += n_current*coef_size;
+            } else {
+                p_current_file = new mapped_file(dir_file(work_dir, LAYER_FILENAME, k), n_current*coef_size, true);
+                p_current = (std::complex<double> *)p_current_file->data();
+            }
+            /* the maps of the hierarchy are shared with other engines: they are used if already available, otherwise
+             * the pass generates - or loads - and releases its own map */
+            const fs_map *p_fsm = _maps[k-1].get();
+            if (!p_fsm->is_implicit() && !p_fsm->is_generated()) {
+                p_private_map = new fs_map(*_layers[k], *_layers[k-1]);
+                p_fsm = p_private_map;
+                if (used + p_fsm->size() <= memory_budget)
+                    p_fsm->generate();
+                else {
+                    std::string map_file = dir_file(work_dir, MAP_FILENAME, _m, k-1);
+                    bool loaded = false;
+                    /* map files are named after the full fock space */
+                    if (_layers[k]->is_full()) {
+                        try {
+                            p_fsm->load(map_file);
+                            loaded = true;
+                        } catch (const std::exception &) {
+                        }
+                    }
+                    /* the map is generated by chunks straight into its file, never in memory */
+                    if (!loaded)
+                        p_fsm->generate_file(map_file, chunk);
+                }
+            }
+            const fs_map &fsm = *p_fsm;
+            int mk = input.photon2mode(k-1);
+            bool file_backed = p_parent_file || fsm.is_mapped();
+            if (file_backed) {
+                fsm.prefetch(0, std::min(chunk, n_parent));
+                if (p_parent_file) p_parent_file->prefetch(0, std::min(chunk, n_parent)*coef_size);
+            }
+            for(unsigned long long i0=0; i0 < n_parent; i0 += chunk) {
+                unsigned long long i1 = std::min(i0+chunk, n_parent);
+                unsigned long long i2 = std::min(i1+chunk, n_parent);
+                /* double buffering: the next chunk is read from the files by the prefetch thread while the current
+                 * one - read by the previous prefetch - is accumulated */
+                if (file_backed && i1 < i2) {
+                    const mapped_file *p_prefetched_file = p_parent_file;
+                    prefetch_thread = std::thread([&fsm, p_prefetched_file, i1, i2, coef_size]() {
+                        fsm.prefetch(i1, i2);
+                        if (p_prefetched_file) p_prefetched_file->prefetch(i1*coef_size, (i2-i1)*coef_size);
+                    });
+                }
+                fsm.accumulate_slos_layer(p_u, _m, mk, p_current, p_parent, i0, i1);
+                if (prefetch_thread.joinable())
+                    prefetch_thread.join();
+                fsm.advise(i0, i1, false);
+                if (p_parent_file) p_parent_file->dont_need(i0*coef_size, (i1-i0)*coef_size);
+            }
+            delete p_private_map;
+            p_private_map = nullptr;
+            if (p_parent_file) {
+                delete p_parent_file;
+                std::remove(dir_file(work_dir, LAYER_FILENAME, k-1).c_str());
+            }
+            p_parent_file = p_current_file;
+            p_current_file = nullptr;
+            parent.swap(current);
+            current.clear();
+            current.shrink_to_fit();
+            p_parent = p_current;
+        }
+        if (_n == 0 && count())
+            ((std::complex<double> *)p_out_file->data())[0] = 1;
+        if (count())
+            _normalize(input, (std::complex<double> *)p_out_file->data());
+    } catch (...) {
+        if (prefetch_thread.joinable())
+            prefetch_thread.join();
+        delete p_private_map;
+        delete p_current_file;
+        delete p_parent_file;
+        delete p_out_file;
+        /* the spilled layers are removed - the current one may exist even if it could not be mapped */
+        if (k < _n)
+            std::remove(dir_file(work_dir, LAYER_FILENAME, k).c_str());
+        if (k > 1 && k-1 < _n)
+            std::remove(dir_file(work_dir, LAYER_FILENAME, k-1).c_str());
+        throw;
+    }
+    delete p_out_file;
+}
+
+void slos_compute(const std::complex<double> *p_u, int m, const fockstate &input, std::complex<double> *p_out) {
+    slos engine(m, input.get_n());
+    engine.compute(p_u, input, p_out);
+}
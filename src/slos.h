@@ -0,0 +1,307 @@
+// MIT License
+//
+// Copyright (c) 2022 Quandela
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef QUANDELIBC_SLOS_H
+#define QUANDELIBC_SLOS_H
+
+#include <complex>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "fockstate.h"
+#include "fs_array.h"
+#include "fs_graded_array.h"
+#include "fs_hierarchy.h"
+#include "fs_map.h"
+#include "fs_mask.h"
+
+/**
+ * SLOS engine: computes the output amplitudes of a n-photon input state through a m-mode unitary by adding
+ * the photons one at a time - layer k holds the coefficients of the (m,k) fock space, and is obtained from layer k-1
+ * through the (k-1)->k fs-map
+ */
+class slos {
+    public:
+        /**
+         * Build the engine for a (m,n) fock space - the layers are generated lazily on first computation
+         * @param m number of modes
+         * @param n number of photons of the input states
+         * @param implicit_maps if true, fs-maps are not stored: transitions are computed on the fly from the ranks of
+         * the states, trading memory for computation
+         */
+        slos(int m, int n, bool implicit_maps=false);
+        /**
+         * Build the engine for a masked (m,n) fock space
+         * @param m number of modes
+         * @param n number of photons of the input states
+         * @param mask the mask applying to all layers
+         */
+        slos(int m, int n, const fs_mask &mask);
+        /**
+         * Build the engine for a (m,n) fock space truncated to a per-mode photon cap - transitions to states beyond the
+         * caps are skipped, the output layer only holds the states within the caps
+         * @param m number of modes
+         * @param n number of photons of the input states
+         * @param caps maximal number of photons of each mode
+         * @param implicit_maps if true, fs-maps are not stored
+         */
+        slos(int m, int n, const std::vector<int> &caps, bool implicit_maps=false);
+        /**
+         * Build the engine on a shared fs-hierarchy - layers and maps are shared with the other engines built on it,
+         * and kept alive as long as the engine exists
+         * @param hierarchy the fs-hierarchy, the engine handles n=`hierarchy->get_n()` photons
+         */
+        explicit slos(std::shared_ptr<fs_hierarchy> hierarchy);
+        ~slos();
+        slos(const slos &) = delete;
+        slos &operator=(const slos &) = delete;
+        inline int get_m() const { return _m; }
+        inline int get_n() const { return _n; }
+        /**
+         * number of states in the output layer
+         */
+        unsigned long long count() const { return _layers[_n]->count(); }
+        /**
+         * fs-array of layer k (k photons)
+         */
+        const fs_array &layer(int k) const;
+        /**
+         * fs-map between layer k-1 and layer k
+         */
+        const fs_map &map(int k) const;
+        /**
+         * fs-hierarchy holding the layers and maps of the engine
+         */
+        inline std::shared_ptr<fs_hierarchy> hierarchy() const { return _hierarchy; }
+        /**
+         * coefficient density (ratio of non-zero coefficients) below which `compute` propagates layers sparsely
+         * - the propagation switches to dense mode once a layer density passes the threshold
+         */
+        inline double get_sparse_threshold() const { return _sparse_threshold; }
+        inline void set_sparse_threshold(double threshold) { _sparse_threshold = threshold; }
+        /**
+         * generate all layers and maps of the engine
+         */
+        void generate() const;
+        /**
+         * compute the normalized output amplitudes of an input state
+         * @param p_u the unitary matrix (m*m, row-major)
+         * @param input the input fockstate (m modes, n photons)
+         * @param p_out the output buffer of `count()` amplitudes, ordered as `layer(n)`
+         * @throws std::invalid_argument if the input state does not fit the engine
+         */
+        void compute(const std::complex<double> *p_u, const fockstate &input, std::complex<double> *p_out) const;
+        /**
+         * same as compute - but returns output probabilities: the normalization, the squared magnitudes and the
+         * requested reductions of the last layer are computed in a single parallel pass
+         * @param p_out the output buffer of `count()` probabilities, ordered as `layer(n)`, or nullptr if only the
+         * reductions are needed
+         * @param p_reductions the reductions of the output probabilities to compute, or nullptr
+         * @param n_threads number of threads of the output stage, 0 to use all the available cores
+         */
+        void compute_probabilities(const std::complex<double> *p_u, const fockstate &input, double *p_out,
+                                   fs_reductions *p_reductions=nullptr, int n_threads=0) const;
+        /**
+         * compute the normalized output amplitudes of several input states at once - the map lookups and
+         * the coefficient propagation are shared by all inputs
+         * @param p_u the unitary matrix (m*m, row-major)
+         * @param inputs the input fockstates (m modes, n photons)
+         * @param p_out the output buffer of `count()*inputs.size()` amplitudes - amplitude of the input b
+         * for the output state i is `p_out[i*inputs.size()+b]`
+         */
+        void compute_batch(const std::complex<double> *p_u, const std::vector<fockstate> &inputs,
+                           std::complex<double> *p_out) const;
+        /**
+         * compute the normalized output amplitudes of several input states, sharing the computation of the
+         * layers common to inputs with identical photon prefixes: inputs are ordered as a prefix tree on their
+         * internal code, and intermediate layers at branching points are kept as long as following inputs need them
+         * @param p_u the unitary matrix (m*m, row-major)
+         * @param inputs the input fockstates (m modes, n photons)
+         * @param p_out the output buffer of `inputs.size()*count()` amplitudes - amplitudes of input b are stored
+         * in `p_out[b*count():(b+1)*count()]`
+         * @param memory_budget maximal number of bytes used to keep intermediate layers, 0 for no limit - when a
+         * layer does not fit, it is recomputed from the closest kept ancestor
+         * @return the number of layers computed
+         */
+        unsigned long long compute_shared(const std::complex<double> *p_u, const std::vector<fockstate> &inputs,
+                                          std::complex<double> *p_out,
+                                          unsigned long long memory_budget=0) const;
+        /**
+         * compute the output probabilities of an input state through a sweep of unitaries: the coefficients of all
+         * the unitaries are propagated together so that each map lookup is shared, and the last layer is streamed
+         * by blocks of unitaries to avoid holding all the output layers in memory
+         * @param p_us the n_unitaries unitary matrices (n_unitaries*m*m, each of them row-major)
+         * @param n_unitaries number of unitaries
+         * @param input the input fockstate (m modes, n photons)
+         * @param on_probabilities called for each unitary with its index and its `count()` output probabilities -
+         * the probability buffer is only valid during the call
+         * @param stream_block number of unitaries for which the last layer is computed at once
+         */
+        void compute_sweep(const std::complex<double> *p_us, int n_unitaries, const fockstate &input,
+                           const std::function<void(int, const double *)> &on_probabilities,
+                           int stream_block=8) const;
+        /**
+         * approximate computation of the output amplitudes of an input state: at each intermediate layer, the
+         * coefficients with a normalized magnitude below `threshold` are dropped, and only the `top_k` largest
+         * are kept - surviving coefficients are stored as sparse (index, coefficient) lists
+         * @param p_u the unitary matrix (m*m, row-major)
+         * @param input the input fockstate (m modes, n photons)
+         * @param threshold minimal magnitude of the kept coefficients, 0 to keep all
+         * @param top_k maximal number of coefficients kept per layer, 0 for no limit
+         * @param indexes filled with the sorted indexes in `layer(n)` of the non-zero output amplitudes
+         * @param amplitudes filled with the corresponding output amplitudes
+         * @return the discarded probability mass, i.e. 1-sum of the output probabilities - meaningful only for
+         * unitary matrices
+         */
+        double compute_approximate(const std::complex<double> *p_u, const fockstate &input,
+                                   double threshold, unsigned long long top_k,
+                                   std::vector<unsigned long long> &indexes,
+                                   std::vector<std::complex<double>> &amplitudes) const;
+        /**
+         * streaming computation of the output amplitudes of an input state for problems larger than memory:
+         * coefficient layers and fs-maps are kept in memory as long as they fit in the memory budget, otherwise
+         * they are backed by memory-mapped files in `work_dir`. Layers are computed by chunks of parent states,
+         * with double buffering: a prefetch thread reads the parent coefficients and fs-map entries of the next chunk
+         * from their files while the current one is accumulated, and the processed chunk is released. Writes to a
+         * file-backed current layer are written back by the system.
+         * fs-maps of the hierarchy are used when already generated - the hierarchy being shared, they are never
+         * loaded nor released here. Otherwise a private fs-map is built for the layer and deleted once the layer is
+         * processed: the fs-maps that do not fit are generated once, by chunks, directly in a file of `work_dir` -
+         * for unmasked engines, they are reused by following computations
+         * @param p_u the unitary matrix (m*m, row-major)
+         * @param input the input fockstate (m modes, n photons)
+         * @param output_file file receiving the `count()` output amplitudes as raw complex<double> values
+         * @param work_dir directory for the temporary layer files and for the fs-map files
+         * @param memory_budget number of bytes that coefficient layers and fs-maps can use in memory
+         * @param chunk number of parent states processed per chunk
+         */
+        void compute_streaming(const std::complex<double> *p_u, const fockstate &input,
+                               const std::string &output_file, const std::string &work_dir,
+                               unsigned long long memory_budget, unsigned long long chunk=1<<20) const;
+        /**
+         * compute the normalized output amplitudes of an input state for a target subset of the output states only:
+         * the states of each intermediate layer that can reach a target are found by walking backward through the
+         * fs-maps, and only these states are computed
+         * @param p_u the unitary matrix (m*m, row-major)
+         * @param input the input fockstate (m modes, n photons)
+         * @param targets the target output states (m modes, n photons)
+         * @param p_out the output buffer of `targets.count()` amplitudes, ordered as `targets` - targets outside of
+         * the engine fock space have a null amplitude
+         * @throws std::invalid_argument if the input state or the targets do not fit the engine
+         */
+        void compute_restricted(const std::complex<double> *p_u, const fockstate &input, const fs_array &targets,
+                                std::complex<double> *p_out) const;
+        /**
+         * same as compute_restricted - targets being the states matching a mask
+         * @param p_out the output buffer of `fs_array(m, n, targets).count()` amplitudes, ordered as
+         * `fs_array(m, n, targets)`
+         */
+        void compute_restricted(const std::complex<double> *p_u, const fockstate &input, const fs_mask &targets,
+                                std::complex<double> *p_out) const;
+        /**
+         * reverse-mode computation of the gradient of a weighted sum of the output probabilities with respect to the
+         * unitary: L = sum_i weights[i]*p_i. The layers are propagated forward, then the adjoints are propagated
+         * backward through the fs-maps - for the cost of about two forward propagations
+         * @param p_u the unitary matrix (m*m, row-major)
+         * @param input the input fockstate (m modes, n photons)
+         * @param p_weights the `count()` weights of the output probabilities (dL/dp_i)
+         * @param p_grad output buffer of m*m gradients (row-major): dL/dRe(U[j,k]) + i.dL/dIm(U[j,k])
+         * @param checkpoint_every if 0, all the layers of the forward propagation are kept, otherwise only one
+         * layer out of `checkpoint_every` is kept and the others are recomputed from the closest checkpoint during
+         * the backward propagation
+         * @param p_probabilities if not null, output buffer of the `count()` output probabilities
+         * @return L
+         */
+        double compute_gradient(const std::complex<double> *p_u, const fockstate &input, const double *p_weights,
+                                std::complex<double> *p_grad, int checkpoint_every=0,
+                                double *p_probabilities=nullptr) const;
+        /**
+         * compute the output probabilities of an input state with photon loss, for all the numbers of surviving
+         * photons at once: each photon of input mode i is transmitted with probability `p_transmission[i]`. The
+         * sub-inputs of kept photons are propagated as a prefix tree over layers k <= n - keeping a photon propagates
+         * the prefix to the next layer, losing it leaves the prefix in its layer - and their distributions are
+         * weighted by their binomial probabilities. A uniform transmission is equivalent to a uniform loss anywhere
+         * in the circuit
+         * @param p_u the unitary matrix (m*m, row-major)
+         * @param input the input fockstate (m modes, n photons)
+         * @param p_transmission the m transmissions of the input modes
+         * @param probabilities filled with n+1 vectors: `probabilities[k]` holds the probabilities of the states of
+         * `layer(k)`
+         * @throws std::invalid_argument if a transmission is not in [0, 1]
+         */
+        void compute_lossy(const std::complex<double> *p_u, const fockstate &input, const double *p_transmission,
+                           std::vector<std::vector<double>> &probabilities) const;
+        /**
+         * same as compute_lossy - with a uniform transmission
+         */
+        void compute_lossy(const std::complex<double> *p_u, const fockstate &input, double transmission,
+                           std::vector<std::vector<double>> &probabilities) const;
+        /**
+         * same as compute_lossy - the probabilities of all the photon numbers being written in a single vector,
+         * ordered as `graded()`
+         * @param p_out output buffer of `graded().count()` probabilities
+         */
+        void compute_lossy(const std::complex<double> *p_u, const fockstate &input, const double *p_transmission,
+                           double *p_out) const;
+        /**
+         * graded fs-array over the layers 0..n of the engine - sharing them with the engine
+         */
+        fs_graded_array graded() const;
+        /**
+         * compute the output probabilities of a partially distinguishable input state: the annotated input is
+         * separated (`fockstate::separate_state`) in groups of indistinguishable photons, the output distribution of
+         * each group is computed on the engine layer of its photon number - groups being computed in parallel - and
+         * the group distributions are combined by sparse tensor products, merging the output states of the groups
+         * @param p_u the unitary matrix (m*m, row-major)
+         * @param input the annotated input fockstate (m modes, n photons)
+         * @param p_out the output buffer of `count()` probabilities, ordered as `layer(n)`
+         * @param n_threads number of threads, 0 to use all the available cores
+         */
+        void compute_distinguishable(const std::complex<double> *p_u, const fockstate &input, double *p_out,
+                                     int n_threads=0) const;
+    private:
+        void _check_input(const fockstate &input) const;
+        void _normalize(const fockstate &input, std::complex<double> *p_out) const;
+        /* propagates the layers of an input state - the unnormalized last layer is written in p_out */
+        void _propagate(const std::complex<double> *p_u, const fockstate &input, std::complex<double> *p_out) const;
+        int _m;
+        int _n;
+        const fs_mask *_p_mask;
+        std::shared_ptr<fs_hierarchy> _hierarchy;
+        std::vector<std::shared_ptr<const fs_array>> _layers;
+        std::vector<std::shared_ptr<const fs_map>> _maps;
+        unsigned long long _max_count;
+        double _sparse_threshold;
+};
+
+/**
+ * one-shot SLOS computation of the output amplitudes of a given input state
+ * @param p_u the unitary matrix (m*m, row-major)
+ * @param m number of modes
+ * @param input the input fockstate
+ * @param p_out the output buffer of `fs_array(m, input.get_n()).count()` amplitudes
+ */
+void slos_compute(const std::complex<double> *p_u, int m, const fockstate &input, std::complex<double> *p_out);
+
+#endif //QUANDELIBC_SLOS_H
@@ -20,6 +20,12 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <thread>
+
 #include <catch2/catch.hpp>
 #include "../src/fs_array.h"
 #include "../src/fs_map.h"
@@ -115,6 +121,226 @@ SCENARIO("Testing FS Array") {
         it = fsa.find(fockstate(v));
         REQUIRE(it == fsa.end());
     }
+    SECTION("batch matching of compiled fs masks") {
+        int m = 20, n = 4;
+        std::list<std::string> conditions{"1                  0", "  2              1  ", "    3               "};
+        fs_mask mask(m, n, conditions);
+        /* reference: exact occupancies of the constrained modes, missing photons counted as errors */
+        auto reference = [&](const fockstate &fs, bool allow_missing) {
+            for(const std::string &c: conditions) {
+                int allowed_errors = allow_missing ? n-fs.get_n() : 0;
+                for(int i=0; allowed_errors>=0 && i<m; i++)
+                    if (c[i] != ' ')
+                        allowed_errors = fs[i] > c[i]-'0' ? -1 : allowed_errors-(c[i]-'0'-fs[i]);
+                if (allowed_errors >= 0) return true;
+            }
+            return false;
+        };
+        for(int k=0; k<=n; k++) {
+            fs_array fsa(m, k);
+            fsa.generate();
+            std::string buffer;
+            for(auto fs: fsa)
+                buffer += std::string(fs.get_code(), k);
+            for(bool allow_missing: {true, false}) {
+                std::unique_ptr<bool[]> matches(new bool[fsa.count()]);
+                mask.match_many(buffer.data(), fsa.count(), k, matches.get(), allow_missing);
+                for(unsigned long long i=0; i<fsa.count(); i++) {
+                    bool expected = reference(fsa[i], allow_missing);
+                    REQUIRE(matches[i] == expected);
+                    REQUIRE(mask.match(fsa[i], allow_missing) == expected);
+                }
+            }
+        }
+        unsigned long long expected_count = 0;
+        for(auto fs: fs_array(m, n))
+            expected_count += reference(fs, true);
+        fs_array fsa_masked(m, n, mask);
+        REQUIRE(fsa_masked.count() == expected_count);
+        unsigned long long idx = 0;
+        for(auto fs: fs_array(m, n))
+            if (reference(fs, true))
+                REQUIRE(fsa_masked[idx++].to_vect() == fs.to_vect());
+    }
+    SECTION("extended fs mask conditions") {
+        int m = 6, n = 4;
+        /* complete states matching each condition */
+        std::vector<std::pair<std::string, std::function<bool(const std::vector<int> &)>>> cases{
+            {"[-1][-1][-1][-1][-1][-1]", [](const std::vector<int> &v) {
+                return *std::max_element(v.begin(), v.end()) <= 1; }},
+            {"[1-]  [2-3]  ", [](const std::vector<int> &v) { return v[0] >= 1 && v[3] >= 2; }},
+            {"[e][1o]    ", [](const std::vector<int> &v) { return v[0]%2 == 0 && v[1] == 1; }},
+            {"      (xxx...)[2](   .xx)[-1]", [](const std::vector<int> &v) {
+                return v[0]+v[1]+v[2] == 2 && v[4]+v[5] <= 1; }},
+            {"0     ( xx   )[3-]", [](const std::vector<int> &v) { return v[0] == 0 && v[1]+v[2] >= 3; }}
+        };
+        for(auto &c: cases) {
+            fs_mask mask(m, n, c.first);
+            for(int k=0; k<=n; k++) {
+                fs_array fsa(m, k);
+                std::vector<std::string> expected;
+                for(auto fs: fsa) {
+                    bool matched = mask.match(fs);
+                    if (k == n)
+                        REQUIRE(matched == c.second(fs.to_vect()));
+                    if (matched) {
+                        expected.push_back(std::string(fs.get_code(), k));
+                        /* masks are closed under photon removal: parents of matching states match */
+                        for(int i=0; i<m; i++) {
+                            std::vector<int> parent = fs.to_vect();
+                            if (parent[i]-- > 0)
+                                REQUIRE(mask.match(fockstate(parent)));
+                        }
+                    }
+                }
+                fs_array fsa_masked(m, k, mask);
+                REQUIRE(fsa_masked.count() == expected.size());
+                REQUIRE(mask.enumerate(k) == expected.size());
+                for(unsigned long long i=0; i<fsa_masked.count(); i++)
+                    REQUIRE(std::string(fsa_masked[i].get_code(), k) == expected[i]);
+            }
+        }
+        REQUIRE_THROWS_AS(fs_mask(m, n, "[2-1]     "), std::invalid_argument);
+        REQUIRE_THROWS_AS(fs_mask(m, n, "[1      "), std::invalid_argument);
+        REQUIRE_THROWS_AS(fs_mask(m, n, "      (xx"), std::invalid_argument);
+        REQUIRE_THROWS_AS(fs_mask(m, n, "      (xx    )[e]"), std::invalid_argument);
+    }
+    SECTION("mask algebra and index maps") {
+        int m = 6, n = 4;
+        fs_mask a(m, n, std::list<std::string>{"1     ", "[2-]  [e]  "});
+        fs_mask b(m, n, std::list<std::string>{"[-1][-1][-1][-1][-1][-1]", "  (xx    )[3-]"});
+        fs_mask a_and_b = a & b, a_or_b = a | b;
+        REQUIRE((a & fs_mask(m, n)).conditions() == a.conditions());
+        REQUIRE((a | fs_mask(m, n)).conditions().empty());
+        for(int k=0; k<=n; k++)
+            for(auto fs: fs_array(m, k)) {
+                REQUIRE(a_or_b.match(fs) == (a.match(fs) || b.match(fs)));
+                if (k == n)
+                    REQUIRE(a_and_b.match(fs) == (a.match(fs) && b.match(fs)));
+            }
+        fs_mask none = fs_mask(m, n, "0     ") & fs_mask(m, n, "1     ");
+        REQUIRE(fs_array(m, n, none).count() == 0);
+        REQUIRE(fs_array(m, 0, none).count() == 0);
+        REQUIRE_THROWS_AS(a & fs_mask(m, n+1), std::invalid_argument);
+        fs_array fsa(m, n), fsa_a(m, n, a), fsa_b(m, n, b), fsa_a_and_b(m, n, a_and_b);
+        auto n_threads = GENERATE(1, 4);
+        for(const fs_array *p_source: {&fsa_a, &fsa_b, &fsa_a_and_b})
+            for(const fs_array *p_target: {&fsa, &fsa_a, &fsa_b}) {
+                std::vector<unsigned long long> indexes(p_source->count());
+                p_source->index_map(*p_target, indexes.data(), n_threads);
+                for(unsigned long long i=0; i<p_source->count(); i++)
+                    REQUIRE(indexes[i] == p_target->find_idx((*p_source)[i]));
+            }
+        std::vector<unsigned long long> indexes(fsa_a_and_b.count());
+        fsa_a_and_b.index_map(fsa_b, indexes.data());
+        REQUIRE(std::find(indexes.begin(), indexes.end(), fs_npos) == indexes.end());
+        REQUIRE_THROWS_AS(fsa.index_map(fs_array(m, n-1), indexes.data()), std::invalid_argument);
+    }
+    SECTION("no-bunching fs-arrays and fs-maps") {
+        int m = 9, n = 4;
+        fs_array fsa(m, n, true), fsa_full(m, n);
+        fs_array fsa_masked(m, n, fs_mask(m, n, "[-1][-1][-1][-1][-1][-1][-1][-1][-1]"));
+        REQUIRE(fsa.count() == 126);
+        REQUIRE(fsa.is_no_bunching());
+        REQUIRE(!fsa.is_full());
+        REQUIRE(fs_array(3, 4, true).count() == 0);
+        REQUIRE(fs_array(m, 0, true).count() == 1);
+        REQUIRE(fsa.count() == fsa_masked.count());
+        std::vector<char> code(n);
+        unsigned long long idx = 0;
+        for(auto fs: fsa) {
+            REQUIRE(fs.to_str() == fsa_masked[idx].to_str());
+            REQUIRE(fsa.find_idx(fs) == idx);
+            REQUIRE(fsa.rank(fsa[idx].get_code()) == idx);
+            fsa.unrank(idx, code.data());
+            REQUIRE(std::string(code.data(), n) == std::string(fsa[idx].get_code(), n));
+            unsigned long long bits = fsa.unrank_bits(idx);
+            for(int k=0; k<m; k++)
+                REQUIRE(((bits >> k) & 1) == (unsigned long long)fs[k]);
+            REQUIRE(fsa.rank_bits(bits) == idx);
+            idx++;
+        }
+        REQUIRE(idx == fsa.count());
+        REQUIRE(fsa.rank("AABC") == fs_npos);
+        REQUIRE(fsa.rank_bits(0x7) == fs_npos);
+        REQUIRE_THROWS_AS(fsa_full.rank_bits(0xf), std::logic_error);
+        std::vector<unsigned long long> indexes(fsa.count());
+        fsa.index_map(fsa_full, indexes.data());
+        for(unsigned long long i=0; i<fsa.count(); i++)
+            REQUIRE(indexes[i] == fsa_full.find_idx(fsa[i]));
+        fs_array fsa_parent(m, n-1, true);
+        fs_map fsm(fsa, fsa_parent, true), fsm_implicit(fsa, fsa_parent, false, true);
+        fs_map fsm_from_full(fsa, fs_array(m, n-1), true);
+        fsm.generate(1, true);
+        for(unsigned long long i=0; i<fsa_parent.count(); i++)
+            for(int j=0; j<m; j++) {
+                std::vector<int> occupancies = fsa_parent[i].to_vect();
+                occupancies[j]++;
+                unsigned long long expected = occupancies[j] > 1 ? fs_npos : fsa.find_idx(fockstate(occupancies));
+                REQUIRE(fsm.get(i, j) == expected);
+                REQUIRE(fsm_implicit.get(i, j) == expected);
+            }
+        for(unsigned long long i=0; i<fsa.count(); i++) {
+            REQUIRE(fsm.reverse_offsets()[i+1]-fsm.reverse_offsets()[i] == (unsigned long long)n);
+            for(auto r=fsm.reverse_offsets()[i]; r<fsm.reverse_offsets()[i+1]; r++)
+                REQUIRE(fsm.get(fsm.reverse_parents()[r], fsm.reverse_modes()[r]) == i);
+        }
+        for(unsigned long long i=0; i<fsm_from_full.count(); i++)
+            for(int j=0; j<m; j++) {
+                unsigned long long child = fsm_from_full.get(i, j);
+                if (child != fs_npos)
+                    REQUIRE(std::string(fsa[child].get_code(), n).find(char('A'+j)) != std::string::npos);
+            }
+    }
+    SECTION("truncated fock spaces with photon caps") {
+        int m = 7, n = 5;
+        std::vector<int> caps{2, 0, 3, 1, 2, 5, 1};
+        auto within_caps = [&](const fockstate &fs, const std::vector<int> &c) {
+            for(int j=0; j<m; j++)
+                if (fs[j] > c[j]) return false;
+            return true;
+        };
+        for(const std::vector<int> &c: {caps, std::vector<int>(m, 2), std::vector<int>(m, 1)}) {
+            for(int k=0; k<=n; k++) {
+                fs_array fsa(m, k, c), fsa_full(m, k);
+                std::vector<std::string> expected;
+                for(auto fs: fsa_full)
+                    if (within_caps(fs, c))
+                        expected.push_back(fs.to_str());
+                REQUIRE(fsa.count() == expected.size());
+                /* enumeration without generation, then ranks in the generated array */
+                unsigned long long idx = 0;
+                for(auto fs: fsa)
+                    REQUIRE(fs.to_str() == expected[idx++]);
+                REQUIRE(idx == expected.size());
+                std::vector<char> code(k);
+                for(idx=0; idx<fsa.count(); idx++) {
+                    REQUIRE(fsa[idx].to_str() == expected[idx]);
+                    REQUIRE(fsa.rank(fsa[idx].get_code()) == idx);
+                    fsa.unrank(idx, code.data());
+                    REQUIRE(std::string(code.data(), k) == std::string(fsa[idx].get_code(), k));
+                }
+                for(auto fs: fsa_full)
+                    REQUIRE((fsa.rank(fs.get_code()) == fs_npos) == !within_caps(fs, c));
+            }
+        }
+        REQUIRE(fs_array(m, n, 2).get_caps() == std::vector<int>(m, 2));
+        REQUIRE(fs_array(m, n, 1).is_no_bunching());
+        REQUIRE(fs_array(m, n, n).is_full());
+        REQUIRE(fs_array(m, n, n).count() == fs_array(m, n).count());
+        REQUIRE_THROWS_AS(fs_array(m, n, std::vector<int>{1, 2}), std::invalid_argument);
+        REQUIRE_THROWS_AS(fs_array(m, n, -1), std::invalid_argument);
+        fs_array fsa(m, n, caps), fsa_parent(m, n-1, caps);
+        fs_map fsm(fsa, fsa_parent, true), fsm_implicit(fsa, fsa_parent, false, true);
+        for(unsigned long long i=0; i<fsa_parent.count(); i++)
+            for(int j=0; j<m; j++) {
+                std::vector<int> occupancies = fsa_parent[i].to_vect();
+                occupancies[j]++;
+                unsigned long long expected = fsa.find_idx(fockstate(occupancies));
+                REQUIRE(fsm.get(i, j) == expected);
+                REQUIRE(fsm_implicit.get(i, j) == expected);
+            }
+    }
     SECTION("builds a fsm from regular fsa") {
         WHEN("5 modes - storage on 1 byte") {
             fs_array fsa_parent(5, 2);
@@ -173,6 +399,297 @@ SCENARIO("Testing FS Array") {
             REQUIRE(fsa_child[fsm.get(idx, 8)].to_str() == "|1,0,0,0,1,0,0,1,1>");
         }
     }
+    SECTION("saving and loading fs-maps") {
+        fs_array fsa_parent(6, 2);
+        fs_array fsa_current(6, 3);
+        fs_map fsm(fsa_current, fsa_parent, true);
+        auto filename = (std::filesystem::temp_directory_path() / "quandelibc_test.fsm").string();
+        fsm.save(filename);
+        fs_map fsm_loaded(fsa_current, fsa_parent);
+        fsm_loaded.load(filename);
+        for(unsigned long long i=0; i<fsm.count(); i++)
+            for(int j=0; j<6; j++)
+                REQUIRE(fsm_loaded.get(i, j) == fsm.get(i, j));
+        fs_array fsa_other(6, 4);
+        fs_map fsm_other(fsa_other, fsa_current);
+        REQUIRE_THROWS_AS(fsm_other.load(filename), std::invalid_argument);
+        /* restricted fock spaces with the same number of states do not share their maps */
+        fs_array fsa_capped_a(3, 2, std::vector<int>{2, 1, 0}), fsa_capped_a_parent(3, 1, std::vector<int>{2, 1, 0});
+        fs_array fsa_capped_b(3, 2, std::vector<int>{0, 1, 2}), fsa_capped_b_parent(3, 1, std::vector<int>{0, 1, 2});
+        fs_array fsa_masked(3, 2, fs_mask(3, 2, "[1-] 0")), fsa_masked_parent(3, 1, fs_mask(3, 2, "[1-] 0"));
+        REQUIRE(fsa_capped_a.count() == fsa_capped_b.count());
+        REQUIRE(fsa_capped_a.count() == fsa_masked.count());
+        REQUIRE(fsa_capped_a_parent.count() == fsa_capped_b_parent.count());
+        REQUIRE(fsa_capped_a_parent.count() == fsa_masked_parent.count());
+        fs_map fsm_capped_a(fsa_capped_a, fsa_capped_a_parent, true);
+        fsm_capped_a.save(filename);
+        fs_map fsm_capped_a_loaded(fsa_capped_a, fsa_capped_a_parent);
+        fsm_capped_a_loaded.load(filename);
+        REQUIRE(fsm_capped_a_loaded.get(0, 0) == fsm_capped_a.get(0, 0));
+        fs_map fsm_capped_b(fsa_capped_b, fsa_capped_b_parent);
+        REQUIRE_THROWS_AS(fsm_capped_b.load(filename), std::invalid_argument);
+        fs_map fsm_masked(fsa_masked, fsa_masked_parent);
+        REQUIRE_THROWS_AS(fsm_masked.load(filename), std::invalid_argument);
+        std::filesystem::remove(filename);
+    }
+    SECTION("generating fs-maps in a file") {
+        int m = 7;
+        fs_mask mask(m, 4, "[1-]      (xx     )[-1]");
+        std::vector<std::pair<fs_array, fs_array>> layers;
+        layers.emplace_back(fs_array(m, 4), fs_array(m, 3));
+        layers.emplace_back(fs_array(m, 4, std::vector<int>{2, 1, 0, 3, 1, 2, 1}),
+                            fs_array(m, 3, std::vector<int>{2, 1, 0, 3, 1, 2, 1}));
+        layers.emplace_back(fs_array(m, 4, mask), fs_array(m, 3, mask));
+        layers.emplace_back(fs_array(m, 1), fs_array(m, 0));
+        auto filename = (std::filesystem::temp_directory_path() / "quandelibc_test_generated.fsm").string();
+        for(auto &l: layers) {
+            fs_map fsm(l.first, l.second, true);
+            for(unsigned long long chunk: {1ULL, 5ULL, 1ULL << 20}) {
+                fs_map fsm_file(l.first, l.second);
+                fsm_file.generate_file(filename, chunk, 2);
+                REQUIRE(fsm_file.is_generated());
+                for(unsigned long long i=0; i<fsm.count(); i++)
+                    for(int j=0; j<m; j++)
+                        REQUIRE(fsm_file.get(i, j) == fsm.get(i, j));
+                fs_map fsm_loaded(l.first, l.second);
+                fsm_loaded.load(filename);
+                for(unsigned long long i=0; i<fsm.count(); i++)
+                    for(int j=0; j<m; j++)
+                        REQUIRE(fsm_loaded.get(i, j) == fsm.get(i, j));
+            }
+        }
+        std::filesystem::remove(filename);
+    }
+    SECTION("ranking states and implicit fs-maps") {
+        for(int m: {1, 3, 7}) {
+            for(int n=1; n<=4; n++) {
+                fs_array fsa_parent(m, n-1);
+                fs_array fsa_current(m, n);
+                std::vector<char> code(n);
+                for(unsigned long long i=0; i<fsa_current.count(); i++) {
+                    fockstate fs = fsa_current[i];
+                    REQUIRE(fsa_current.rank(fs.get_code()) == i);
+                    fsa_current.unrank(i, code.data());
+                    REQUIRE(memcmp(code.data(), fs.get_code(), n) == 0);
+                    bool has_next = fs_array::next_code(code.data(), m, n);
+                    REQUIRE(has_next == (i+1 < fsa_current.count()));
+                    if (has_next)
+                        REQUIRE(memcmp(code.data(), fsa_current[i+1].get_code(), n) == 0);
+                }
+                fs_map fsm(fsa_current, fsa_parent, true);
+                fs_map fsm_implicit(fsa_current, fsa_parent, false, true);
+                REQUIRE(fsm_implicit.size() == 0);
+                for(unsigned long long i=0; i<fsm.count(); i++)
+                    for(int j=0; j<m; j++)
+                        REQUIRE(fsm_implicit.get(i, j) == fsm.get(i, j));
+            }
+        }
+        fs_mask mask(4, 2, "0   ");
+        fs_array fsa_masked(4, 2, mask);
+        fs_array fsa_parent(4, 1);
+        REQUIRE_THROWS_AS(fsa_masked.rank("AB"), std::logic_error);
+        REQUIRE_THROWS_AS(fs_map(fsa_masked, fsa_parent, false, true), std::invalid_argument);
+    }
+    SECTION("parallel generation of fs-maps") {
+        int m = 14;
+        auto masked = GENERATE(false, true);
+        fs_mask mask(m, 6, "1            0");
+        fs_array fsa_parent = masked ? fs_array(m, 5, mask) : fs_array(m, 5);
+        fs_array fsa_current = masked ? fs_array(m, 6, mask) : fs_array(m, 6);
+        REQUIRE(fsa_current.count() > 4096);
+        fs_map fsm_single(fsa_current, fsa_parent);
+        fsm_single.generate(1);
+        fs_map fsm_parallel(fsa_current, fsa_parent);
+        fsm_parallel.generate(4);
+        for(unsigned long long i=0; i<fsm_single.count(); i++) {
+            std::vector<int> parent = fsa_parent[i].to_vect();
+            for(int j=0; j<m; j++) {
+                unsigned long long idx = fsm_single.get(i, j);
+                REQUIRE(fsm_parallel.get(i, j) == idx);
+                std::vector<int> child(parent);
+                child[j]++;
+                REQUIRE(idx == fsa_current.find_idx(fockstate(child)));
+            }
+        }
+    }
+    SECTION("concurrent lazy generation") {
+        int m = 14;
+        fs_array fsa_parent(m, 5), fsa_current(m, 6);
+        fs_map fsm(fsa_current, fsa_parent);
+        std::vector<std::thread> threads;
+        std::vector<unsigned long long> found(8);
+        /* all the threads share the first generation of the arrays and of the map */
+        for(int t=0; t<8; t++)
+            threads.emplace_back([&, t]() {
+                fsm.generate(1, t%2 == 1);
+                found[t] = fsa_current.find_idx(fsa_current[1000+t]);
+            });
+        for(auto &thread: threads)
+            thread.join();
+        REQUIRE(fsa_parent.is_generated());
+        REQUIRE(fsm.is_generated());
+        REQUIRE(fsm.has_reverse());
+        for(int t=0; t<8; t++)
+            REQUIRE(found[t] == (unsigned long long)(1000+t));
+        fs_map fsm_reference(fsa_current, fsa_parent);
+        fsm_reference.generate(1);
+        for(unsigned long long i=0; i<fsm.count(); i++)
+            for(int j=0; j<m; j++)
+                REQUIRE(fsm.get(i, j) == fsm_reference.get(i, j));
+        fsm.release();
+        REQUIRE(!fsm.is_generated());
+        REQUIRE(!fsm.has_reverse());
+    }
+    SECTION("reverse index of fs-maps") {
+        int m = 14;
+        auto masked = GENERATE(false, true);
+        fs_mask mask(m, 6, "1            0");
+        fs_array fsa_parent = masked ? fs_array(m, 5, mask) : fs_array(m, 5);
+        fs_array fsa_current = masked ? fs_array(m, 6, mask) : fs_array(m, 6);
+        fs_map fsm(fsa_current, fsa_parent);
+        REQUIRE(!fsm.has_reverse());
+        fsm.generate(4, true);
+        REQUIRE(fsm.has_reverse());
+        unsigned long long n_transitions = 0;
+        for(unsigned long long i=0; i<fsm.count(); i++)
+            for(int j=0; j<m; j++)
+                n_transitions += fsm.get(i, j) != fs_npos;
+        REQUIRE(fsm.reverse_offsets()[fsa_current.count()] == n_transitions);
+        for(unsigned long long k=0; k<fsa_current.count(); k++) {
+            REQUIRE(fsm.reverse_offsets()[k+1]-fsm.reverse_offsets()[k] <= 6);
+            for(unsigned long long r=fsm.reverse_offsets()[k]; r<fsm.reverse_offsets()[k+1]; r++)
+                REQUIRE(fsm.get(fsm.reverse_parents()[r], fsm.reverse_modes()[r]) == k);
+        }
+        auto filename = (std::filesystem::temp_directory_path() / "quandelibc_test_reverse.fsm").string();
+        fsm.save(filename);
+        fs_map fsm_loaded(fsa_current, fsa_parent);
+        fsm_loaded.load(filename);
+        REQUIRE(fsm_loaded.has_reverse());
+        unsigned long long n_entries = fsm.reverse_offsets()[fsa_current.count()];
+        REQUIRE(memcmp(fsm_loaded.reverse_offsets(), fsm.reverse_offsets(),
+                       (fsa_current.count()+1)*sizeof(unsigned long long)) == 0);
+        REQUIRE(memcmp(fsm_loaded.reverse_parents(), fsm.reverse_parents(),
+                       n_entries*sizeof(unsigned long long)) == 0);
+        REQUIRE(memcmp(fsm_loaded.reverse_modes(), fsm.reverse_modes(), n_entries) == 0);
+        fsm_loaded.release();
+        REQUIRE(!fsm_loaded.has_reverse());
+        /* reverse index generated on a map loaded without it */
+        fs_map fsm_forward(fsa_current, fsa_parent, true);
+        fsm_forward.save(filename);
+        fs_map fsm_forward_loaded(fsa_current, fsa_parent);
+        fsm_forward_loaded.load(filename);
+        REQUIRE(!fsm_forward_loaded.has_reverse());
+        fsm_forward_loaded.generate(2, true);
+        REQUIRE(fsm_forward_loaded.has_reverse());
+        REQUIRE(memcmp(fsm_forward_loaded.reverse_parents(), fsm.reverse_parents(),
+                       n_entries*sizeof(unsigned long long)) == 0);
+        fsm_forward_loaded.release();
+        REQUIRE(!fsm_forward_loaded.is_generated());
+        std::filesystem::remove(filename);
+    }
+    SECTION("fused probabilities and reductions") {
+        fs_array fsa(11, 6);
+        std::vector<std::complex<double>> coefs(fsa.count());
+        for(unsigned long long i=0; i<coefs.size(); i++)
+            coefs[i] = std::complex<double>(std::cos(i), std::sin(2.*i));
+        std::vector<double> single(fsa.count()), parallel(fsa.count());
+        fs_reductions r_single, r_parallel;
+        for(fs_reductions *r: {&r_single, &r_parallel}) {
+            r->mode_marginals = true;
+            r->click_patterns = true;
+            r->masks.push_back(fs_mask(11, 6, "2          "));
+        }
+        fsa.probabilities(coefs.data(), 0.5, single.data(), &r_single, 1);
+        fsa.probabilities(coefs.data(), 0.5, parallel.data(), &r_parallel, 4);
+        REQUIRE(single == parallel);
+        std::vector<std::complex<double>> normalized(coefs);
+        fsa.norm_coefs(normalized.data());
+        for(unsigned long long i=0; i<coefs.size(); i++)
+            REQUIRE(std::abs(single[i] - 0.5*std::norm(normalized[i])) < 1e-12);
+        REQUIRE(r_single.clicks.size() == r_parallel.clicks.size());
+        for(auto &c: r_single.clicks)
+            REQUIRE(std::abs(r_parallel.clicks[c.first] - c.second) < 1e-9);
+        for(size_t c=0; c<r_single.marginals.size(); c++)
+            REQUIRE(std::abs(r_parallel.marginals[c] - r_single.marginals[c]) < 1e-9);
+        REQUIRE(std::abs(r_parallel.mask_totals[0] - r_single.mask_totals[0]) < 1e-9);
+        WHEN("with more than 64 modes") {
+            int m = 70;
+            fs_array fsa_large(m, 2);
+            std::vector<std::complex<double>> coefs_large(fsa_large.count(), 1);
+            std::vector<double> probabilities(fsa_large.count());
+            fs_reductions r;
+            r.mode_marginals = true;
+            r.masks.push_back(fs_mask(m, 2, "1" + std::string(m-1, ' ')));
+            fsa_large.probabilities(coefs_large.data(), 1, probabilities.data(), &r);
+            REQUIRE(r.clicks.empty());
+            double first_mode = 0, last_mode_pair = 0;
+            for(unsigned long long i=0; i<fsa_large.count(); i++) {
+                std::vector<int> v = fsa_large[i].to_vect();
+                if (v[0] == 1)
+                    first_mode += probabilities[i];
+                if (v[m-1] == 2)
+                    last_mode_pair += probabilities[i];
+            }
+            REQUIRE(r.mask_totals[0] == Approx(first_mode));
+            REQUIRE(r.marginals[(m-1)*3+2] == Approx(last_mode_pair));
+            r.click_patterns = true;
+            REQUIRE_THROWS_AS(fsa_large.probabilities(coefs_large.data(), 1, probabilities.data(), &r),
+                              std::invalid_argument);
+        }
+    }
+    SECTION("block enumeration of fock states") {
+        int m = 6, n = 4;
+        fs_mask mask(m, n, std::list<std::string>{"1     ", "[2-]  [e]  "});
+        std::vector<std::function<fs_array()>> spaces{
+            [&]() { return fs_array(m, n); },
+            [&]() { return fs_array(m, n, std::vector<int>{2, 1, 3, 0, 2, 1}); },
+            [&]() { return fs_array(m, n, true); },
+            [&]() { return fs_array(m, n, mask); },
+            [&]() { return fs_array(m, 0); }};
+        for(auto &space: spaces) {
+            fs_array fsa = space(), reference = space();
+            reference.generate();
+            unsigned long long count = fsa.count();
+            int n_fsa = fsa.get_n();
+            /* the states enumerated by blocks of any size match the generated array */
+            for(size_t k: {1, 7, 100000}) {
+                fs_enumerator it_enum(fsa);
+                std::vector<char> codes((count+k)*n_fsa+1);
+                size_t total = 0, got;
+                while ((got = it_enum.next_block(codes.data()+total*n_fsa, k)) != 0) {
+                    REQUIRE(got <= k);
+                    total += got;
+                }
+                REQUIRE(it_enum.done());
+                REQUIRE(total == count);
+                for(unsigned long long i=0; i<count; i++)
+                    REQUIRE(std::string(codes.data()+i*n_fsa, n_fsa) ==
+                            std::string(reference[i].get_code(), n_fsa));
+            }
+            /* enumeration from any position */
+            for(unsigned long long from: {0ULL, 3ULL, count/2, count}) {
+                fs_enumerator it_enum(fsa, from);
+                std::vector<char> code(n_fsa+1);
+                if (from < count) {
+                    REQUIRE(it_enum.next_block(code.data(), 1) == 1);
+                    REQUIRE(std::string(code.data(), n_fsa) == std::string(reference[from].get_code(), n_fsa));
+                } else {
+                    REQUIRE(it_enum.next_block(code.data(), 1) == 0);
+                }
+            }
+            /* iterating over a non-generated array walks through the blocks */
+            unsigned long long idx = 0;
+            for(auto it = fsa.begin(); it != fsa.end(); ++it, ++idx)
+                REQUIRE((*it).to_str() == reference[idx].to_str());
+            REQUIRE(idx == count);
+            REQUIRE(!fsa.is_generated());
+        }
+        /* without fs-array, the whole fock space */
+        fs_enumerator full(m, n);
+        std::vector<char> codes(200*n);
+        REQUIRE(full.next_block(codes.data(), 200) == 126);
+        REQUIRE(full.done());
+    }
     SECTION("test coefficient normalization") {
         WHEN("with 3 photons") {
             fs_array fsa(3, 3);
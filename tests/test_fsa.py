@@ -164,3 +164,28 @@ def test_fsa_iter_1():
         "|0,0,1>"
     ]
     assert fsa_states == [str(fs) for fs in fsa]
+
+
+def test_fsa_no_bunching():
+    fsa = qc.FSArray(5, 2, no_bunching=True)
+    assert fsa.no_bunching
+    assert fsa.count() == 10
+    states = [str(fs) for fs in fsa]
+    assert states[0] == "|1,1,0,0,0>"
+    assert states[-1] == "|0,0,0,1,1>"
+    assert fsa.find(qc.FockState([0, 1, 0, 1, 0])) == 5
+    parent = qc.FSArray(5, 1, no_bunching=True)
+    fsm = qc.FSMap(fsa, parent, True)
+    assert fsm.get(1, 2) == 4
+    assert fsm.get(1, 1) == 0xffffffff
+
+
+def test_fsa_caps():
+    fsa = qc.FSArray(8, 4, cap=2)
+    assert fsa.count() == 266
+    assert fsa.caps == [2] * 8
+    full = qc.FSArray(8, 4)
+    assert fsa.count() == sum(1 for fs in full if max(list(fs)) <= 2)
+    fsa = qc.FSArray(3, 3, cap=[3, 0, 1])
+    assert [str(fs) for fs in fsa] == ["|3,0,0>", "|2,0,1>"]
+    assert not qc.FSArray(3, 3, cap=3).caps
@@ -66,3 +66,15 @@ def test_genfsa_2():
     assert fsa_full.size() == 74256
     fsa_restricted = qc.FSArray(12, 6, fs_mask)
     assert fsa_restricted.size() == 990
+
+
+def test_mask_algebra():
+    herald = qc.FSMask(4, 2, ["1   "])
+    no_bunching = qc.FSMask(4, 2, ["[-1][-1][-1][-1]"])
+    fsa_full = qc.FSArray(4, 2)
+    fsa_heralded = qc.FSArray(4, 2, herald & no_bunching)
+    assert fsa_heralded.count() == 3
+    assert qc.FSArray(4, 2, herald | no_bunching).count() == 6
+    indexes = fsa_heralded.index_map(fsa_full)
+    for i in range(fsa_heralded.count()):
+        assert indexes[i] == fsa_full.find(fsa_heralded[i])
@@ -0,0 +1,727 @@
+// MIT License
+//
+// Copyright (c) 2022 Quandela
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+#include <complex>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include "../src/slos.h"
+#include "../src/fs_sampler.h"
+
+typedef std::complex<double> cplx;
+
+/* random unitary matrix obtained by Gram-Schmidt orthonormalization of a random complex matrix */
+static std::vector<cplx> random_unitary(int m, unsigned int seed) {
+    std::mt19937 gen(seed);
+    std::normal_distribution<double> dist;
+    std::vector<cplx> u(m*m);
+    for(auto &c: u) c = cplx(dist(gen), dist(gen));
+    for(int j=0; j<m; j++) {
+        for(int k=0; k<j; k++) {
+            cplx dot = 0;
+            for(int i=0; i<m; i++) dot += std::conj(u[i*m+k]) * u[i*m+j];
+            for(int i=0; i<m; i++) u[i*m+j] -= dot * u[i*m+k];
+        }
+        double norm = 0;
+        for(int i=0; i<m; i++) norm += std::norm(u[i*m+j]);
+        norm = sqrt(norm);
+        for(int i=0; i<m; i++) u[i*m+j] /= norm;
+    }
+    return u;
+}
+
+/* reference amplitude <output|U|input> computed with a naive permanent */
+static cplx reference_amplitude(const std::vector<cplx> &u, int m, const fockstate &input, const fockstate &output) {
+    int n = input.get_n();
+    std::vector<int> perm(n);
+    for(int i=0; i<n; i++) perm[i] = i;
+    cplx p = 0;
+    do {
+        cplx prod = 1;
+        for(int i=0; i<n; i++)
+            prod *= u[output.photon2mode(i)*m + input.photon2mode(perm[i])];
+        p += prod;
+    } while (std::next_permutation(perm.begin(), perm.end()));
+    return p / sqrt((double)input.prodnfact() * (double)output.prodnfact());
+}
+
+SCENARIO("Testing SLOS") {
+    SECTION("single photon is the unitary column") {
+        auto u = random_unitary(3, 1);
+        slos engine(3, 1);
+        REQUIRE(engine.count() == 3);
+        std::vector<cplx> out(3);
+        engine.compute(u.data(), fockstate(std::vector<int>{0, 1, 0}), out.data());
+        for(int i=0; i<3; i++)
+            REQUIRE(std::abs(out[i] - u[i*3+1]) < 1e-12);
+    }
+    SECTION("amplitudes match permanents") {
+        int m = 4;
+        auto u = random_unitary(m, 2);
+        auto input = GENERATE(as<std::vector<int>>{}, std::vector<int>{1, 1, 0, 0}, std::vector<int>{2, 0, 1, 0},
+                              std::vector<int>{0, 3, 0, 0}, std::vector<int>{1, 0, 1, 1});
+        fockstate fs_input(input);
+        slos engine(m, fs_input.get_n());
+        std::vector<cplx> out(engine.count());
+        engine.compute(u.data(), fs_input, out.data());
+        const fs_array &fsa = engine.layer(fs_input.get_n());
+        double total = 0;
+        for(unsigned long long i=0; i<fsa.count(); i++) {
+            REQUIRE(std::abs(out[i] - reference_amplitude(u, m, fs_input, fsa[i])) < 1e-12);
+            total += std::norm(out[i]);
+        }
+        REQUIRE(total == Approx(1));
+
+        std::vector<double> probs(engine.count());
+        engine.compute_probabilities(u.data(), fs_input, probs.data());
+        for(unsigned long long i=0; i<fsa.count(); i++)
+            REQUIRE(probs[i] == Approx(std::norm(out[i])));
+
+        std::vector<cplx> out_direct(engine.count());
+        slos_compute(u.data(), m, fs_input, out_direct.data());
+        REQUIRE(out_direct == out);
+    }
+    SECTION("vacuum input") {
+        auto u = random_unitary(2, 3);
+        slos engine(2, 0);
+        std::vector<cplx> out(1);
+        engine.compute(u.data(), fockstate(2), out.data());
+        REQUIRE(out[0] == cplx(1));
+    }
+    SECTION("masked output space") {
+        int m = 5;
+        auto u = random_unitary(m, 4);
+        fockstate fs_input(std::vector<int>{1, 1, 0, 1, 0});
+        slos engine(m, 3, fs_mask(m, 3, " 1 1 "));
+        std::vector<cplx> out(engine.count());
+        engine.compute(u.data(), fs_input, out.data());
+        const fs_array &fsa = engine.layer(3);
+        REQUIRE(fsa.count() == 3);
+        for(unsigned long long i=0; i<fsa.count(); i++)
+            REQUIRE(std::abs(out[i] - reference_amplitude(u, m, fs_input, fsa[i])) < 1e-12);
+    }
+    SECTION("truncated output space") {
+        int m = 6;
+        auto u = random_unitary(m, 9);
+        fockstate fs_input(std::vector<int>{2, 0, 1, 0, 1, 0});
+        slos engine_full(m, 4);
+        std::vector<cplx> out_full(engine_full.count());
+        engine_full.compute(u.data(), fs_input, out_full.data());
+        auto implicit_maps = GENERATE(false, true);
+        slos engine(m, 4, std::vector<int>(m, 2), implicit_maps);
+        const fs_array &fsa = engine.layer(4);
+        REQUIRE(fsa.count() < engine_full.count());
+        std::vector<cplx> out(engine.count());
+        engine.compute(u.data(), fs_input, out.data());
+        for(unsigned long long i=0; i<fsa.count(); i++)
+            REQUIRE(std::abs(out[i] - out_full[engine_full.layer(4).find_idx(fsa[i])]) < 1e-12);
+    }
+    SECTION("batched inputs match individual computations") {
+        int m = 5;
+        auto u = random_unitary(m, 6);
+        std::vector<fockstate> inputs;
+        /* odd batch size to exercise the scalar tail of the kernel */
+        for(auto v: std::vector<std::vector<int>>{{1, 1, 1, 0, 0}, {0, 0, 1, 1, 1}, {3, 0, 0, 0, 0},
+                                                  {1, 0, 2, 0, 0}, {0, 1, 0, 1, 1}})
+            inputs.emplace_back(v);
+        slos engine(m, 3);
+        int batch = (int)inputs.size();
+        std::vector<cplx> out(engine.count()*batch);
+        engine.compute_batch(u.data(), inputs, out.data());
+        std::vector<cplx> single(engine.count());
+        for(int b=0; b<batch; b++) {
+            engine.compute(u.data(), inputs[b], single.data());
+            for(unsigned long long i=0; i<engine.count(); i++)
+                REQUIRE(std::abs(out[i*batch+b] - single[i]) < 1e-12);
+        }
+    }
+    SECTION("prefix-sharing inputs") {
+        int m = 4;
+        auto u = random_unitary(m, 7);
+        slos engine(m, 3);
+        /* all 3-photon inputs, in reverse order */
+        std::vector<fockstate> inputs;
+        for(unsigned long long i=engine.count(); i-- > 0; )
+            inputs.push_back(engine.layer(3)[i]);
+        size_t batch = inputs.size();
+        std::vector<cplx> out(batch*engine.count());
+        /* prefix tree of the 20 codes: 4 nodes at depth 1, 10 at depth 2, 20 leaves */
+        REQUIRE(engine.compute_shared(u.data(), inputs, out.data()) == 34);
+        std::vector<cplx> single(engine.count());
+        for(size_t b=0; b<batch; b++) {
+            engine.compute(u.data(), inputs[b], single.data());
+            for(unsigned long long i=0; i<engine.count(); i++)
+                REQUIRE(std::abs(out[b*engine.count()+i] - single[i]) < 1e-12);
+        }
+        WHEN("memory budget only allows to keep layer 1") {
+            std::vector<cplx> out_budget(batch*engine.count());
+            unsigned long long computed = engine.compute_shared(u.data(), inputs, out_budget.data(),
+                                                                4*sizeof(cplx));
+            REQUIRE(computed == 4+2*20);
+            for(size_t i=0; i<out.size(); i++)
+                REQUIRE(std::abs(out_budget[i] - out[i]) < 1e-12);
+        }
+    }
+    SECTION("sweep over unitaries") {
+        int m = 4;
+        int n_unitaries = 7;
+        fockstate fs_input(std::vector<int>{1, 0, 2, 0});
+        std::vector<cplx> us;
+        for(int q=0; q<n_unitaries; q++) {
+            auto u = random_unitary(m, 100+q);
+            us.insert(us.end(), u.begin(), u.end());
+        }
+        slos engine(m, 3);
+        auto stream_block = GENERATE(1, 3, 8);
+        std::vector<int> seen(n_unitaries);
+        std::vector<double> probs(engine.count());
+        engine.compute_sweep(us.data(), n_unitaries, fs_input, [&](int q, const double *p_probs) {
+            seen[q]++;
+            engine.compute_probabilities(us.data()+q*m*m, fs_input, probs.data());
+            for(unsigned long long i=0; i<engine.count(); i++)
+                REQUIRE(p_probs[i] == Approx(probs[i]).margin(1e-12));
+        }, stream_block);
+        REQUIRE(seen == std::vector<int>(n_unitaries, 1));
+    }
+    SECTION("sparse propagation") {
+        /* block-diagonal unitary: the photons in modes 0-2 never reach modes 3-5 */
+        int m = 6;
+        auto u3 = random_unitary(3, 8);
+        std::vector<cplx> u(m*m);
+        for(int i=0; i<3; i++)
+            for(int j=0; j<3; j++) {
+                u[i*m+j] = u3[i*3+j];
+                u[(i+3)*m+j+3] = u3[j*3+i];
+            }
+        fockstate fs_input(std::vector<int>{1, 0, 1, 0, 1, 0});
+        slos engine(m, 3);
+        std::vector<cplx> out_dense(engine.count());
+        engine.set_sparse_threshold(0);
+        engine.compute(u.data(), fs_input, out_dense.data());
+        auto threshold = GENERATE(0.25, 1.0);
+        engine.set_sparse_threshold(threshold);
+        std::vector<cplx> out_sparse(engine.count(), 42.);
+        engine.compute(u.data(), fs_input, out_sparse.data());
+        REQUIRE(out_sparse == out_dense);
+
+        /* layer 1 from photon in mode 0 only reaches modes 0-2 */
+        const fs_map &fsm = engine.map(1);
+        std::vector<cplx> coefs(engine.layer(1).count());
+        std::vector<cplx> parent_coefs(1, 1);
+        std::vector<unsigned long long> parent_support(1, 0), support;
+        fsm.compute_slos_layer_sparse(u.data(), m, 0, coefs.data(), coefs.size(),
+                                      parent_coefs.data(), parent_support.data(), 1, support);
+        REQUIRE(support == std::vector<unsigned long long>{0, 1, 2});
+    }
+    SECTION("implicit fs-maps") {
+        int m = 5;
+        auto u = random_unitary(m, 11);
+        fockstate fs_input(std::vector<int>{1, 0, 2, 0, 1});
+        slos engine(m, 4);
+        slos engine_implicit(m, 4, true);
+        REQUIRE(engine_implicit.map(4).size() == 0);
+        std::vector<cplx> out(engine.count()), out_implicit(engine.count());
+        engine.compute(u.data(), fs_input, out.data());
+        auto threshold = GENERATE(0., 1.);
+        engine_implicit.set_sparse_threshold(threshold);
+        engine_implicit.compute(u.data(), fs_input, out_implicit.data());
+        for(unsigned long long i=0; i<out.size(); i++)
+            REQUIRE(std::abs(out_implicit[i]-out[i]) < 1e-12);
+        std::vector<fockstate> inputs{fs_input, fockstate(std::vector<int>{0, 1, 1, 1, 1})};
+        std::vector<cplx> out_batch(2*engine.count()), out_batch_implicit(2*engine.count());
+        engine.compute_batch(u.data(), inputs, out_batch.data());
+        engine_implicit.compute_batch(u.data(), inputs, out_batch_implicit.data());
+        for(unsigned long long i=0; i<out_batch.size(); i++)
+            REQUIRE(std::abs(out_batch_implicit[i]-out_batch[i]) < 1e-12);
+    }
+    SECTION("gather propagation") {
+        int m = 6;
+        auto u = random_unitary(m, 5);
+        fs_array fsa_parent(m, 3);
+        fs_array fsa_current(m, 4);
+        fs_map fsm(fsa_current, fsa_parent, true);
+        std::vector<cplx> parent_coefs(fsa_parent.count());
+        for(unsigned long long i=0; i<parent_coefs.size(); i++)
+            parent_coefs[i] = cplx(std::cos(i), std::sin(3.*i));
+        std::vector<cplx> coefs(fsa_current.count()), coefs_gather(fsa_current.count());
+        fsm.compute_slos_layer(u.data(), m, 2, coefs.data(), coefs.size(), parent_coefs.data(), parent_coefs.size());
+        auto n_threads = GENERATE(1, 3);
+        fsm.compute_slos_layer_gather(u.data(), m, 2, coefs_gather.data(), coefs_gather.size(), parent_coefs.data(),
+                                      n_threads);
+        for(unsigned long long k=0; k<coefs.size(); k++)
+            REQUIRE(std::abs(coefs_gather[k]-coefs[k]) < 1e-12);
+    }
+    SECTION("output-restricted computation") {
+        int m = 7;
+        auto u = random_unitary(m, 13);
+        fockstate fs_input(std::vector<int>{1, 1, 0, 1, 0, 1, 0});
+        auto implicit = GENERATE(false, true);
+        slos engine(m, 4, implicit);
+        std::vector<cplx> out(engine.count());
+        engine.compute(u.data(), fs_input, out.data());
+        /* heralded outputs: one photon in each of the modes 0 and 1 */
+        fs_mask mask(m, 4, "11     ");
+        fs_array targets(m, 4, mask);
+        std::vector<cplx> out_restricted(targets.count(), 42.);
+        engine.compute_restricted(u.data(), fs_input, targets, out_restricted.data());
+        for(unsigned long long b=0; b<targets.count(); b++)
+            REQUIRE(std::abs(out_restricted[b] - out[engine.layer(4).find_idx(targets[b])]) < 1e-12);
+        std::vector<cplx> out_mask(targets.count());
+        engine.compute_restricted(u.data(), fs_input, mask, out_mask.data());
+        REQUIRE(out_mask == out_restricted);
+        /* targets outside of a masked engine fock space */
+        slos engine_masked(m, 4, fs_mask(m, 4, "1      "));
+        fs_array single(m, 4, fs_mask(m, 4, "0101011"));
+        cplx amplitude = 42.;
+        engine_masked.compute_restricted(u.data(), fs_input, single, &amplitude);
+        REQUIRE(amplitude == 0.);
+        REQUIRE_THROWS_AS(engine.compute_restricted(u.data(), fs_input, fs_array(m, 3), out_mask.data()),
+                          std::invalid_argument);
+    }
+    SECTION("gradient with respect to the unitary") {
+        int m = 5;
+        auto u = random_unitary(m, 17);
+        fockstate fs_input(std::vector<int>{1, 0, 2, 0, 1});
+        slos engine(m, 4);
+        std::vector<double> weights(engine.count());
+        for(unsigned long long i=0; i<weights.size(); i++)
+            weights[i] = std::cos(1.+i);
+        auto checkpoint_every = GENERATE(0, 1, 2, 3);
+        std::vector<cplx> grad(m*m);
+        std::vector<double> probabilities(engine.count()), reference(engine.count());
+        double loss = engine.compute_gradient(u.data(), fs_input, weights.data(), grad.data(), checkpoint_every,
+                                              probabilities.data());
+        engine.compute_probabilities(u.data(), fs_input, reference.data());
+        auto weighted = [&](const std::vector<cplx> &v) {
+            std::vector<double> p(engine.count());
+            engine.compute_probabilities(v.data(), fs_input, p.data());
+            double l = 0;
+            for(unsigned long long i=0; i<p.size(); i++) l += weights[i]*p[i];
+            return l;
+        };
+        REQUIRE(std::abs(loss - weighted(u)) < 1e-12);
+        for(unsigned long long i=0; i<reference.size(); i++)
+            REQUIRE(std::abs(probabilities[i] - reference[i]) < 1e-12);
+        /* central finite differences on the real and imaginary parts of each element */
+        double h = 1e-6;
+        for(int e=0; e<m*m; e++)
+            for(cplx d: {cplx(h, 0), cplx(0, h)}) {
+                std::vector<cplx> up(u), down(u);
+                up[e] += d;
+                down[e] -= d;
+                double fd = (weighted(up)-weighted(down))/(2*h);
+                double expected = d.real() ? grad[e].real() : grad[e].imag();
+                REQUIRE(std::abs(fd - expected) < 1e-6);
+            }
+    }
+    SECTION("fused output stage") {
+        int m = 6;
+        auto u = random_unitary(m, 19);
+        fockstate fs_input(std::vector<int>{2, 0, 1, 0, 1, 0});
+        slos engine(m, 4);
+        std::vector<cplx> amplitudes(engine.count());
+        engine.compute(u.data(), fs_input, amplitudes.data());
+        fs_reductions reductions;
+        reductions.mode_marginals = true;
+        reductions.click_patterns = true;
+        reductions.masks.push_back(fs_mask(m, 4, "1     "));
+        reductions.masks.push_back(fs_mask(m, 4, std::list<std::string>{" 0    ", "  2   "}));
+        std::vector<double> probabilities(engine.count());
+        auto n_threads = GENERATE(1, 4);
+        engine.compute_probabilities(u.data(), fs_input, probabilities.data(), &reductions, n_threads);
+        std::vector<double> marginals(m*5);
+        std::map<unsigned long long, double> clicks;
+        std::vector<double> mask_totals(2);
+        for(unsigned long long i=0; i<engine.count(); i++) {
+            REQUIRE(std::abs(probabilities[i] - std::norm(amplitudes[i])) < 1e-12);
+            std::vector<int> v = engine.layer(4)[i].to_vect();
+            unsigned long long pattern = 0;
+            for(int j=0; j<m; j++) {
+                marginals[j*5+v[j]] += probabilities[i];
+                if (v[j]) pattern |= 1ULL << j;
+            }
+            clicks[pattern] += probabilities[i];
+            for(int c=0; c<2; c++)
+                if (reductions.masks[c].match(engine.layer(4)[i])) mask_totals[c] += probabilities[i];
+        }
+        for(int c=0; c<m*5; c++)
+            REQUIRE(std::abs(reductions.marginals[c] - marginals[c]) < 1e-12);
+        REQUIRE(reductions.clicks.size() == clicks.size());
+        for(auto &c: clicks)
+            REQUIRE(std::abs(reductions.clicks[c.first] - c.second) < 1e-12);
+        for(int c=0; c<2; c++)
+            REQUIRE(std::abs(reductions.mask_totals[c] - mask_totals[c]) < 1e-12);
+        /* reductions only */
+        fs_reductions only_marginals;
+        only_marginals.mode_marginals = true;
+        engine.compute_probabilities(u.data(), fs_input, nullptr, &only_marginals, n_threads);
+        REQUIRE(only_marginals.marginals.size() == marginals.size());
+    }
+    SECTION("lossy computation") {
+        int m = 4;
+        auto u = random_unitary(m, 23);
+        fockstate fs_input(std::vector<int>{2, 0, 1, 1});
+        slos engine(m, 4);
+        std::vector<double> eta{0.9, 0.5, 0.7, 0.3};
+        std::vector<std::vector<double>> probabilities;
+        engine.compute_lossy(u.data(), fs_input, eta.data(), probabilities);
+        REQUIRE(probabilities.size() == 5);
+        /* reference: input modes go through beam splitters to m loss modes, then U on the first m modes */
+        int m2 = 2*m;
+        std::vector<cplx> u_ext(m2*m2);
+        for(int i=0; i<m; i++) {
+            double t = std::sqrt(eta[i]), r = std::sqrt(1-eta[i]);
+            for(int j=0; j<m; j++) {
+                u_ext[j*m2+i] = u[j*m+i]*t;
+                u_ext[j*m2+m+i] = -u[j*m+i]*r;
+            }
+            u_ext[(m+i)*m2+i] = r;
+            u_ext[(m+i)*m2+m+i] = t;
+        }
+        fockstate fs_ext(std::vector<int>{2, 0, 1, 1, 0, 0, 0, 0});
+        slos engine_ext(m2, 4);
+        std::vector<double> p_ext(engine_ext.count());
+        engine_ext.compute_probabilities(u_ext.data(), fs_ext, p_ext.data());
+        std::vector<std::vector<double>> expected(5);
+        for(int k=0; k<=4; k++)
+            expected[k].assign(engine.layer(k).count(), 0);
+        for(unsigned long long i=0; i<engine_ext.count(); i++) {
+            std::vector<int> v = engine_ext.layer(4)[i].to_vect();
+            std::vector<int> kept(v.begin(), v.begin()+m);
+            int k = 0;
+            for(int c: kept) k += c;
+            expected[k][engine.layer(k).find_idx(fockstate(kept))] += p_ext[i];
+        }
+        double total = 0;
+        for(int k=0; k<=4; k++)
+            for(unsigned long long s=0; s<expected[k].size(); s++) {
+                REQUIRE(std::abs(probabilities[k][s] - expected[k][s]) < 1e-12);
+                total += probabilities[k][s];
+            }
+        REQUIRE(std::abs(total-1) < 1e-12);
+        /* no loss */
+        std::vector<double> lossless(engine.count());
+        engine.compute_probabilities(u.data(), fs_input, lossless.data());
+        engine.compute_lossy(u.data(), fs_input, 1., probabilities);
+        for(unsigned long long s=0; s<lossless.size(); s++)
+            REQUIRE(std::abs(probabilities[4][s] - lossless[s]) < 1e-12);
+        REQUIRE(probabilities[3] == std::vector<double>(engine.layer(3).count()));
+        REQUIRE_THROWS_AS(engine.compute_lossy(u.data(), fs_input, 1.5, probabilities), std::invalid_argument);
+    }
+    SECTION("graded fs-arrays over photon numbers") {
+        int m = 4, n = 3;
+        auto u = random_unitary(m, 41);
+        fockstate fs_input(std::vector<int>{1, 0, 1, 1});
+        slos engine(m, n);
+        fs_graded_array graded = engine.graded();
+        REQUIRE(&graded.grade(2) == &engine.layer(2));
+        REQUIRE(graded.count() == 1+4+10+20);
+        REQUIRE(graded.offset(3) == 15);
+        REQUIRE(graded.grade_of(0) == 0);
+        REQUIRE(graded.grade_of(14) == 2);
+        REQUIRE(graded.grade_of(15) == 3);
+        REQUIRE_THROWS_AS(graded.grade_of(graded.count()), std::out_of_range);
+        unsigned long long idx = 0;
+        for(auto fs: graded) {
+            int k = graded.grade_of(idx);
+            REQUIRE(fs.get_n() == k);
+            REQUIRE(fs.to_str() == engine.layer(k)[idx-graded.offset(k)].to_str());
+            REQUIRE(graded[idx].to_str() == fs.to_str());
+            REQUIRE(graded.find_idx(fs) == idx);
+            idx++;
+        }
+        REQUIRE(idx == graded.count());
+        REQUIRE(graded.find_idx(fockstate(std::vector<int>{2, 1, 1, 0})) == fs_npos);
+        /* masked grades - lower grades hold the states that can still complete the mask - and truncated grades, the
+         * empty ones being skipped */
+        fs_graded_array graded_masked(std::make_shared<fs_hierarchy>(m, n, fs_mask(m, n, "[2-]   ")));
+        fs_graded_array graded_capped(std::make_shared<fs_hierarchy>(m, n, std::vector<int>{1, 0, 0, 1}));
+        REQUIRE(graded_masked.count() == 1+4+4+4);
+        REQUIRE(graded_capped.count() == 1+2+1);
+        for(const fs_graded_array *p_graded: {&graded_masked, &graded_capped}) {
+            idx = 0;
+            for(auto fs: *p_graded)
+                REQUIRE(p_graded->find_idx(fs) == idx++);
+            REQUIRE(idx == p_graded->count());
+        }
+        /* lossy probabilities in a single vector, and fused output stage over all the grades */
+        std::vector<double> eta{0.9, 0.5, 0.7, 0.3};
+        std::vector<std::vector<double>> probabilities;
+        engine.compute_lossy(u.data(), fs_input, eta.data(), probabilities);
+        std::vector<double> graded_probabilities(graded.count());
+        engine.compute_lossy(u.data(), fs_input, eta.data(), graded_probabilities.data());
+        for(int k=0; k<=n; k++)
+            for(unsigned long long s=0; s<probabilities[k].size(); s++)
+                REQUIRE(graded_probabilities[graded.offset(k)+s] == probabilities[k][s]);
+        std::vector<cplx> coefs(graded.count());
+        for(unsigned long long i=0; i<coefs.size(); i++)
+            coefs[i] = cplx(std::cos(i), std::sin(3.*i));
+        fs_reductions reductions;
+        reductions.mode_marginals = true;
+        reductions.click_patterns = true;
+        reductions.masks.push_back(fs_mask(m, n, "0   "));
+        std::vector<double> p_graded(graded.count()), totals(n+1);
+        graded.probabilities(coefs.data(), 0.5, p_graded.data(), &reductions, totals.data(), 2);
+        std::vector<double> marginals(m*(n+1)), expected_totals(n+1);
+        double total = 0, mask_total = 0;
+        for(unsigned long long i=0; i<graded.count(); i++) {
+            fockstate fs = graded[i];
+            REQUIRE(std::abs(p_graded[i] - 0.5*std::norm(coefs[i])*(double)fs.prodnfact()) < 1e-9);
+            for(int j=0; j<m; j++)
+                marginals[j*(n+1)+fs[j]] += p_graded[i];
+            expected_totals[fs.get_n()] += p_graded[i];
+            total += p_graded[i];
+            if (fs[0] == 0)
+                mask_total += p_graded[i];
+        }
+        for(size_t c=0; c<marginals.size(); c++)
+            REQUIRE(std::abs(reductions.marginals[c] - marginals[c]) < 1e-9);
+        for(int k=0; k<=n; k++)
+            REQUIRE(std::abs(totals[k] - expected_totals[k]) < 1e-9);
+        REQUIRE(std::abs(reductions.total - total) < 1e-9);
+        REQUIRE(std::abs(reductions.mask_totals[0] - mask_total) < 1e-9);
+        REQUIRE(std::abs(reductions.clicks[0] - p_graded[0]) < 1e-12);
+        /* states of lower photon numbers are not partial matches of the masks */
+        fs_graded_array graded_small(2, 2);
+        std::vector<cplx> unit_coefs(graded_small.count(), 1);
+        fs_reductions exact_reductions;
+        exact_reductions.masks.push_back(fs_mask(2, 2, "11"));
+        graded_small.probabilities(unit_coefs.data(), 1, nullptr, &exact_reductions);
+        REQUIRE(exact_reductions.mask_totals[0] == Approx(1));
+        /* sampling over all the photon numbers */
+        fs_sampler sampler(graded, graded_probabilities.data());
+        REQUIRE(std::abs(sampler.total() - 1) < 1e-12);
+        std::vector<unsigned long long> samples(100);
+        std::vector<int> occupancies(100*m);
+        sampler.sample(100, samples.data(), 7);
+        sampler.sample_occupancies(100, occupancies.data(), 7);
+        for(int s=0; s<100; s++)
+            REQUIRE(std::vector<int>(occupancies.begin()+s*m, occupancies.begin()+(s+1)*m) ==
+                    graded[samples[s]].to_vect());
+    }
+    SECTION("distinguishable photons") {
+        /* HOM with distinguishable photons: no bunching interference */
+        std::vector<cplx> bs{cplx(1/std::sqrt(2)), cplx(1/std::sqrt(2)), cplx(1/std::sqrt(2)), cplx(-1/std::sqrt(2))};
+        slos hom(2, 2);
+        std::vector<double> p_hom(hom.count());
+        hom.compute_distinguishable(bs.data(), fockstate("|{_:1},{_:2}>"), p_hom.data());
+        REQUIRE(std::abs(p_hom[hom.layer(2).find_idx(fockstate("|1,1>"))] - 0.5) < 1e-12);
+        REQUIRE(std::abs(p_hom[hom.layer(2).find_idx(fockstate("|2,0>"))] - 0.25) < 1e-12);
+        hom.compute_distinguishable(bs.data(), fockstate("|{_:1},{_:1}>"), p_hom.data());
+        REQUIRE(std::abs(p_hom[hom.layer(2).find_idx(fockstate("|1,1>"))]) < 1e-12);
+        /* 3 groups - reference: each photon group is put in its own copy of the circuit on separate modes */
+        int m = 4;
+        auto u = random_unitary(m, 29);
+        fockstate fs_input("|{_:1},{_:2},{_:1}{_:3},{_:2}>");
+        slos engine(m, 5);
+        std::vector<double> p_out(engine.count());
+        auto n_threads = GENERATE(1, 3);
+        engine.compute_distinguishable(u.data(), fs_input, p_out.data(), n_threads);
+        std::vector<double> expected(engine.count());
+        std::vector<std::vector<int>> groups{{1, 0, 1, 0}, {0, 1, 0, 1}, {0, 0, 1, 0}};
+        std::vector<std::vector<double>> p_groups;
+        for(auto &g: groups) {
+            slos group_engine(m, g[0]+g[1]+g[2]+g[3]);
+            p_groups.emplace_back(group_engine.count());
+            group_engine.compute_probabilities(u.data(), fockstate(g), p_groups.back().data());
+        }
+        fs_array fsa2(m, 2), fsa1(m, 1);
+        double total = 0;
+        for(unsigned long long a=0; a<fsa2.count(); a++)
+            for(unsigned long long b=0; b<fsa2.count(); b++)
+                for(unsigned long long c=0; c<fsa1.count(); c++) {
+                    std::vector<int> v(m);
+                    for(int j=0; j<m; j++)
+                        v[j] = fsa2[a].to_vect()[j] + fsa2[b].to_vect()[j] + fsa1[c].to_vect()[j];
+                    expected[engine.layer(5).find_idx(fockstate(v))] += p_groups[0][a]*p_groups[1][b]*p_groups[2][c];
+                }
+        for(unsigned long long i=0; i<engine.count(); i++) {
+            REQUIRE(std::abs(p_out[i] - expected[i]) < 1e-12);
+            total += p_out[i];
+        }
+        REQUIRE(std::abs(total-1) < 1e-12);
+    }
+    SECTION("sampling output states") {
+        int m = 5;
+        auto u = random_unitary(m, 31);
+        fockstate fs_input(std::vector<int>{1, 1, 0, 1, 0});
+        slos engine(m, 3);
+        std::vector<cplx> amplitudes(engine.count());
+        engine.compute(u.data(), fs_input, amplitudes.data());
+        fs_sampler sampler(engine.layer(3), amplitudes.data());
+        REQUIRE(std::abs(sampler.total() - 1) < 1e-12);
+        unsigned long long n_samples = 400000;
+        std::vector<unsigned long long> samples(n_samples), samples_parallel(n_samples);
+        sampler.sample(n_samples, samples.data(), 42, 1);
+        sampler.sample(n_samples, samples_parallel.data(), 42, 4);
+        REQUIRE(samples == samples_parallel);
+        std::vector<double> frequencies(engine.count());
+        for(auto s: samples)
+            frequencies[s] += 1./n_samples;
+        for(unsigned long long i=0; i<engine.count(); i++) {
+            double p = std::norm(amplitudes[i]);
+            REQUIRE(std::abs(frequencies[i] - p) < 5*std::sqrt(p*(1-p)/n_samples) + 1e-9);
+        }
+        std::vector<int> occupancies(100*m);
+        sampler.sample_occupancies(100, occupancies.data(), 42);
+        for(int s=0; s<100; s++)
+            REQUIRE(std::vector<int>(occupancies.begin()+s*m, occupancies.begin()+(s+1)*m) ==
+                    engine.layer(3)[samples[s]].to_vect());
+        std::vector<double> null_distribution(engine.count());
+        REQUIRE_THROWS_AS(fs_sampler(engine.layer(3), null_distribution.data()), std::invalid_argument);
+    }
+    SECTION("shared fs-hierarchy") {
+        int m = 5;
+        auto u = random_unitary(m, 37);
+        fockstate fs_input(std::vector<int>{1, 0, 1, 1, 0});
+        auto hierarchy = std::make_shared<fs_hierarchy>(m, 3);
+        REQUIRE(!hierarchy->memory_report()[2].loaded);
+        REQUIRE(hierarchy->memory_usage() == 0);
+        std::vector<cplx> expected(fs_array(m, 3).count()), out(expected.size());
+        slos(m, 3).compute(u.data(), fs_input, expected.data());
+        {
+            slos engine_a(hierarchy), engine_b(hierarchy);
+            REQUIRE(&engine_a.layer(2) == &engine_b.layer(2));
+            REQUIRE(&engine_a.map(3) == &engine_b.map(3));
+            engine_a.compute(u.data(), fs_input, out.data());
+            for(size_t i=0; i<out.size(); i++)
+                REQUIRE(std::abs(out[i] - expected[i]) < 1e-12);
+            auto report = hierarchy->memory_report();
+            REQUIRE(report[3].loaded);
+            REQUIRE(report[3].count == 35);
+            REQUIRE(report[3].array_bytes == 35*3);
+            REQUIRE(report[3].map_bytes == hierarchy->map(3)->size());
+            REQUIRE(report[0].map_bytes == 0);
+            /* the hierarchy and the two engines */
+            REQUIRE(report[2].users >= 3);
+            hierarchy->release_all();
+            /* released layers stay alive while engines use them */
+            REQUIRE(hierarchy->memory_report()[2].loaded);
+            REQUIRE(hierarchy->layer(2).get() == &engine_b.layer(2));
+            hierarchy->release_all();
+        }
+        REQUIRE(!hierarchy->memory_report()[2].loaded);
+        REQUIRE(hierarchy->memory_usage() == 0);
+        hierarchy->generate(2);
+        REQUIRE(hierarchy->memory_report()[2].array_bytes == 15*2);
+        REQUIRE(hierarchy->memory_report()[1].array_bytes == 5);
+        REQUIRE(hierarchy->memory_report()[2].map_bytes == 5*5);
+        auto layer = hierarchy->layer(2);
+        hierarchy->release(2);
+        hierarchy->release(1);
+        REQUIRE(hierarchy->memory_report()[2].loaded);
+        REQUIRE(!hierarchy->memory_report()[1].loaded);
+        REQUIRE_THROWS_AS(hierarchy->map(0), std::out_of_range);
+        REQUIRE_THROWS_AS(hierarchy->layer(4), std::out_of_range);
+        auto masked = std::make_shared<fs_hierarchy>(m, 3, fs_mask(m, 3, "1    "));
+        slos engine_masked(masked);
+        REQUIRE(engine_masked.count() == fs_array(m, 3, fs_mask(m, 3, "1    ")).count());
+    }
+    SECTION("approximate computation") {
+        int m = 5;
+        auto u = random_unitary(m, 9);
+        fockstate fs_input(std::vector<int>{1, 1, 0, 2, 0});
+        slos engine(m, 4);
+        std::vector<cplx> out(engine.count());
+        engine.compute(u.data(), fs_input, out.data());
+        std::vector<unsigned long long> indexes;
+        std::vector<cplx> amplitudes;
+        WHEN("no truncation") {
+            double discarded = engine.compute_approximate(u.data(), fs_input, 0, 0, indexes, amplitudes);
+            REQUIRE(discarded == Approx(0).margin(1e-12));
+            REQUIRE(indexes.size() == engine.count());
+            for(size_t i=0; i<indexes.size(); i++)
+                REQUIRE(std::abs(amplitudes[i] - out[indexes[i]]) < 1e-12);
+        }
+        WHEN("keeping top-3 coefficients") {
+            double discarded = engine.compute_approximate(u.data(), fs_input, 0, 3, indexes, amplitudes);
+            REQUIRE(discarded > 0);
+            REQUIRE(std::is_sorted(indexes.begin(), indexes.end()));
+            double total = 0;
+            for(auto &a: amplitudes) total += std::norm(a);
+            REQUIRE(discarded == Approx(1-total));
+        }
+        WHEN("dropping coefficients below a threshold") {
+            double discarded = engine.compute_approximate(u.data(), fs_input, 0.3, 0, indexes, amplitudes);
+            REQUIRE(discarded > 0);
+            REQUIRE(indexes.size() <= engine.count());
+        }
+    }
+    SECTION("streaming computation") {
+        int m = 5;
+        auto u = random_unitary(m, 10);
+        fockstate fs_input(std::vector<int>{2, 0, 1, 0, 1});
+        slos engine(m, 4);
+        std::vector<cplx> out(engine.count());
+        engine.compute(u.data(), fs_input, out.data());
+        auto work_dir = std::filesystem::temp_directory_path() / "quandelibc_test_slos";
+        std::filesystem::create_directories(work_dir);
+        std::string output_file = (work_dir / "output.coefs").string();
+        auto memory_budget = GENERATE(0ULL, 1024ULL, 1ULL << 30);
+        for(int pass=0; pass<2; pass++) {
+            /* second pass reuses the saved maps */
+            engine.compute_streaming(u.data(), fs_input, output_file, work_dir.string(), memory_budget, 7);
+            std::vector<cplx> streamed(engine.count());
+            std::ifstream f(output_file, std::ios::binary);
+            f.read((char *)streamed.data(), streamed.size()*sizeof(cplx));
+            REQUIRE(f.gcount() == (std::streamsize)(streamed.size()*sizeof(cplx)));
+            for(size_t i=0; i<out.size(); i++)
+                REQUIRE(std::abs(streamed[i] - out[i]) < 1e-12);
+        }
+        REQUIRE(!std::filesystem::exists(work_dir / "slos-layer-1.coefs"));
+        /* the maps of a shared hierarchy are neither released nor replaced by a streamed computation */
+        auto hierarchy = std::make_shared<fs_hierarchy>(m, 4);
+        slos engine_a(hierarchy), engine_b(hierarchy);
+        hierarchy->generate(2);
+        engine_b.compute_streaming(u.data(), fs_input, output_file, work_dir.string(), 0, 7);
+        REQUIRE(hierarchy->map(2)->is_generated());
+        REQUIRE(!hierarchy->map(3)->is_generated());
+        REQUIRE(!hierarchy->map(4)->is_generated());
+        std::vector<cplx> shared_out(engine_a.count());
+        engine_a.compute(u.data(), fs_input, shared_out.data());
+        for(size_t i=0; i<out.size(); i++)
+            REQUIRE(std::abs(shared_out[i] - out[i]) < 1e-12);
+        /* spilled layers are removed when the computation fails - here the map of layer 2 cannot be written */
+        std::filesystem::remove_all(work_dir);
+        std::filesystem::create_directories(work_dir / "map-m5-n1.fsm");
+        slos engine_failing(m, 4);
+        REQUIRE_THROWS_AS(engine_failing.compute_streaming(u.data(), fs_input, output_file, work_dir.string(), 0, 7),
+                          std::runtime_error);
+        REQUIRE(!std::filesystem::exists(work_dir / "slos-layer-1.coefs"));
+        REQUIRE(!std::filesystem::exists(work_dir / "slos-layer-2.coefs"));
+        std::filesystem::remove_all(work_dir);
+    }
+    SECTION("invalid input") {
+        auto u = random_unitary(3, 5);
+        slos engine(3, 2);
+        std::vector<cplx> out(engine.count());
+        REQUIRE_THROWS_AS(engine.compute(u.data(), fockstate(std::vector<int>{1, 0, 0}), out.data()),
+                          std::invalid_argument);
+        REQUIRE_THROWS_AS(engine.compute(u.data(), fockstate(std::vector<int>{1, 0, 0, 1}), out.data()),
+                          std::invalid_argument);
+    }
+}
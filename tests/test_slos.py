@@ -0,0 +1,150 @@
+# -*- coding: utf-8 -*-
+# MIT License
+#
+# Copyright (c) 2022 Quandela
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+import pytest
+import numpy as np
+import quandelibc as qc
+
+
+def test_slos_single_photon():
+    u = np.array([[0, 1], [1, 0]], dtype=complex)
+    amplitudes = qc.slos_compute(u, qc.FockState([1, 0]))
+    assert np.allclose(amplitudes, [0, 1])
+
+
+def test_slos_hom():
+    # Hong-Ou-Mandel: no coincidence at the output of a balanced beam splitter
+    u = np.array([[1, 1], [1, -1]], dtype=complex) / np.sqrt(2)
+    engine = qc.SLOS(2, 2)
+    probabilities = engine.compute(u, qc.FockState([1, 1]), probabilities=True)
+    fsa = engine.layer(2)
+    assert engine.count() == 3
+    assert probabilities[fsa.find(qc.FockState([1, 1]))] == pytest.approx(0)
+    assert probabilities[fsa.find(qc.FockState([2, 0]))] == pytest.approx(0.5)
+    assert probabilities[fsa.find(qc.FockState([0, 2]))] == pytest.approx(0.5)
+
+
+def test_slos_batch():
+    u = np.array([[1, 1], [1, -1]], dtype=complex) / np.sqrt(2)
+    engine = qc.SLOS(2, 1)
+    amplitudes = engine.compute_batch(u, [qc.FockState([1, 0]), qc.FockState([0, 1])])
+    assert amplitudes.shape == (2, 2)
+    assert np.allclose(amplitudes, u)
+
+
+def test_slos_sweep():
+    engine = qc.SLOS(2, 2)
+    fs = qc.FockState([1, 1])
+    us = []
+    for theta in np.linspace(0, np.pi/2, 5):
+        us.append(np.array([[np.cos(theta), -np.sin(theta)], [np.sin(theta), np.cos(theta)]], dtype=complex))
+    us = np.array(us)
+    probabilities = engine.compute_sweep(us, fs)
+    assert probabilities.shape == (5, 3)
+    for k in range(5):
+        assert np.allclose(probabilities[k], engine.compute(us[k], fs, probabilities=True))
+    streamed = {}
+    engine.compute_sweep(us, fs, callback=lambda k, p: streamed.__setitem__(k, p), stream_block=2)
+    assert sorted(streamed.keys()) == list(range(5))
+    for k in range(5):
+        assert np.allclose(streamed[k], probabilities[k])
+
+
+def test_slos_implicit_maps():
+    m, n = 4, 3
+    u = np.linalg.qr(np.random.RandomState(0).randn(m, m) + 1j*np.random.RandomState(1).randn(m, m))[0]
+    fs = qc.FockState([1, 0, 2, 0])
+    engine = qc.SLOS(m, n, implicit_maps=True)
+    assert np.allclose(engine.compute(u, fs), qc.SLOS(m, n).compute(u, fs))
+    fsa_parent = qc.FSArray(m, n-1)
+    fsa_current = qc.FSArray(m, n)
+    fsm = qc.FSMap(fsa_current, fsa_parent, True)
+    fsm_implicit = qc.FSMap(fsa_current, fsa_parent, implicit=True)
+    assert fsm_implicit.implicit and fsm_implicit.size() == 0
+    for idx in range(fsm.count()):
+        for mk in range(m):
+            assert fsm_implicit.get(idx, mk) == fsm.get(idx, mk)
+
+
+def test_slos_caps():
+    m, n = 5, 4
+    u = np.linalg.qr(np.random.RandomState(2).randn(m, m) + 1j*np.random.RandomState(3).randn(m, m))[0]
+    fs = qc.FockState([2, 0, 1, 1, 0])
+    full = qc.SLOS(m, n)
+    engine = qc.SLOS(m, n, caps=[2]*m)
+    out_full = full.compute(u, fs)
+    out = engine.compute(u, fs)
+    fsa = engine.layer(n)
+    assert fsa.caps == [2]*m
+    for idx in range(fsa.count()):
+        assert np.isclose(out[idx], out_full[full.layer(n).find(fsa[idx])])
+
+
+def test_slos_gradient():
+    u = np.array([[1, 1], [1, -1]], dtype=complex) / np.sqrt(2)
+    engine = qc.SLOS(2, 2)
+    fs = qc.FockState([1, 1])
+    weights = np.arange(engine.count(), dtype=float)
+    loss, grad = engine.compute_gradient(u, fs, weights)
+    assert loss == pytest.approx(np.dot(weights, engine.compute(u, fs, probabilities=True)))
+    assert grad.shape == (2, 2)
+    h = 1e-6
+    up, down = u.copy(), u.copy()
+    up[0, 1] += h
+    down[0, 1] -= h
+    fd = (np.dot(weights, engine.compute(up, fs, probabilities=True)) -
+          np.dot(weights, engine.compute(down, fs, probabilities=True))) / (2*h)
+    assert grad[0, 1].real == pytest.approx(fd, abs=1e-6)
+
+
+def test_slos_shared_hierarchy():
+    u = np.array([[1, 1], [1, -1]], dtype=complex) / np.sqrt(2)
+    hierarchy = qc.FSHierarchy(2, 2)
+    engine_a = qc.SLOS(hierarchy)
+    engine_b = qc.SLOS(hierarchy)
+    fs = qc.FockState([1, 1])
+    assert np.allclose(engine_a.compute(u, fs), engine_b.compute(u, fs))
+    report = hierarchy.memory_report()
+    assert len(report) == 3 and report[2]["loaded"] and report[2]["count"] == 3
+    assert hierarchy.memory_usage() > 0
+    del engine_a, engine_b
+    hierarchy.release_all()
+    assert hierarchy.memory_usage() == 0
+
+
+def test_slos_graded():
+    m, n = 4, 3
+    u = np.linalg.qr(np.random.RandomState(4).randn(m, m) + 1j*np.random.RandomState(5).randn(m, m))[0]
+    fs = qc.FockState([1, 0, 1, 1])
+    engine = qc.SLOS(m, n)
+    graded = engine.graded()
+    assert graded.count() == 35
+    assert [graded.grade_of(idx) for idx in (0, 1, 5, 15)] == [0, 1, 2, 3]
+    assert [graded.find(state) for state in graded] == list(range(graded.count()))
+    layers = engine.compute_lossy(u, fs, 0.6)
+    probabilities = engine.compute_lossy(u, fs, 0.6, graded=True)
+    assert np.allclose(probabilities, np.concatenate(layers))
+    totals = [probabilities[graded.offset(k):graded.offset(k+1)].sum() for k in range(n+1)]
+    assert np.allclose(totals, [0.4**3, 3*0.6*0.4**2, 3*0.6**2*0.4, 0.6**3])
+    samples = qc.FSSampler(graded, probabilities).sample(100, seed=1, occupancies=True)
+    assert samples.shape == (100, m)